@@ -0,0 +1,202 @@
+/*
+ * bench/bench_pid_hash.c
+ *
+ * Time the pid_hash in machine/m_common.c against a red-black tree, as the
+ * per-pid nodes were kept before.  libbsd's <sys/tree.h> is not needed for
+ * the comparison: tsearch() in glibc is a red-black tree too, and is used in
+ * its place.
+ *
+ * usage: bench_pid_hash [backends ...]
+ *
+ * For each number of backends, the pids are spread over the default
+ * pid_max the way a busy server hands them out, then:
+ *
+ *	insert	every pid is added once
+ *	lookup	every pid is looked up, as each sample does for each backend
+ *	churn	a tenth of the backends exit and as many new ones start
+ *
+ * Times are in nanoseconds per operation, best of ROUNDS runs.
+ */
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "machine.h"
+
+#define ROUNDS		5
+#define LOOKUPS		10			/* lookups of every pid per round */
+#define PID_MAX		4194304
+
+static int	default_sizes[] = {1000, 10000, 100000};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare_pid(const void *a, const void *b)
+{
+	pid_t		pa = *(const pid_t *) a;
+	pid_t		pb = *(const pid_t *) b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/*
+ * make_pids - n distinct pids, increasing from a random start with small
+ * random gaps, in a random order
+ */
+static pid_t *
+make_pids(int n)
+{
+	pid_t	   *pids = malloc(n * 2 * sizeof(pid_t));
+	pid_t		pid = 1000 + random() % 100000;
+	int			i;
+
+	if (pids == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* the second half are the backends that start during the churn */
+	for (i = 0; i < n * 2; i++)
+	{
+		pid += 1 + random() % 8;
+		pids[i] = pid % PID_MAX + 1;
+	}
+	for (i = n - 1; i > 0; i--)
+	{
+		int			j = random() % (i + 1);
+		pid_t		t = pids[i];
+
+		pids[i] = pids[j];
+		pids[j] = t;
+	}
+	return pids;
+}
+
+static void
+bench_hash(pid_t *pids, int n, double *t)
+{
+	struct pid_hash h = PID_HASH_INITIALIZER;
+	double		start;
+	long		found = 0;
+	int			churn = n / 10;
+	int			i,
+				j;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		*pid_hash_enter(&h, pids[i]) = &pids[i];
+	t[0] = (now() - start) / n;
+
+	start = now();
+	for (j = 0; j < LOOKUPS; j++)
+		for (i = 0; i < n; i++)
+			found += pid_hash_lookup(&h, pids[i]) != NULL;
+	t[1] = (now() - start) / ((double) n * LOOKUPS);
+
+	start = now();
+	for (i = 0; i < churn; i++)
+	{
+		pid_hash_remove(&h, pids[i]);
+		*pid_hash_enter(&h, pids[n + i]) = &pids[n + i];
+	}
+	t[2] = (now() - start) / (churn * 2);
+
+	if (found != (long) n * LOOKUPS)
+		fprintf(stderr, "pid_hash lost %ld pids\n", (long) n * LOOKUPS - found);
+	free(h.slots);
+}
+
+static void
+bench_tree(pid_t *pids, int n, double *t)
+{
+	void	   *root = NULL;
+	double		start;
+	long		found = 0;
+	int			churn = n / 10;
+	int			i,
+				j;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		tsearch(&pids[i], &root, compare_pid);
+	t[0] = (now() - start) / n;
+
+	start = now();
+	for (j = 0; j < LOOKUPS; j++)
+		for (i = 0; i < n; i++)
+			found += tfind(&pids[i], &root, compare_pid) != NULL;
+	t[1] = (now() - start) / ((double) n * LOOKUPS);
+
+	start = now();
+	for (i = 0; i < churn; i++)
+	{
+		tdelete(&pids[i], &root, compare_pid);
+		tsearch(&pids[n + i], &root, compare_pid);
+	}
+	t[2] = (now() - start) / (churn * 2);
+
+	if (found != (long) n * LOOKUPS)
+		fprintf(stderr, "tree lost %ld pids\n", (long) n * LOOKUPS - found);
+	for (i = churn; i < n + churn; i++)
+		tdelete(&pids[i], &root, compare_pid);
+}
+
+static void
+keep_best(double *best, const double *t)
+{
+	int			i;
+
+	for (i = 0; i < 3; i++)
+		if (best[i] == 0 || t[i] < best[i])
+			best[i] = t[i];
+}
+
+int
+main(int argc, char *argv[])
+{
+	int			nsizes = argc > 1 ? argc - 1 : 3;
+	int			i,
+				r;
+
+	srandom(1);
+	printf("%9s %-9s %8s %8s %8s\n", "backends", "", "insert", "lookup",
+		   "churn");
+	for (i = 0; i < nsizes; i++)
+	{
+		int			n = argc > 1 ? atoi(argv[i + 1]) : default_sizes[i];
+		double		hash[3] = {0, 0, 0};
+		double		tree[3] = {0, 0, 0};
+		double		t[3];
+		pid_t	   *pids;
+
+		if (n < 10)
+		{
+			fprintf(stderr, "at least 10 backends are needed\n");
+			return 1;
+		}
+		pids = make_pids(n);
+		for (r = 0; r < ROUNDS; r++)
+		{
+			bench_hash(pids, n, t);
+			keep_best(hash, t);
+			bench_tree(pids, n, t);
+			keep_best(tree, t);
+		}
+		printf("%9d %-9s %8.1f %8.1f %8.1f\n", n, "pid_hash",
+			   hash[0] * 1e9, hash[1] * 1e9, hash[2] * 1e9);
+		printf("%9s %-9s %8.1f %8.1f %8.1f\n", "", "rbtree",
+			   tree[0] * 1e9, tree[1] * 1e9, tree[2] * 1e9);
+		free(pids);
+	}
+	return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * bench/bench_proc_parse.c
+ *
+ * Time the /proc/<pid>/stat and /proc/<pid>/io parsers in
+ * machine/m_linux_parse.h against the C library calls they replaced:
+ * strrchr() for the command, then skip_token() and strtoul() field by
+ * field for stat, and strchr() and strtoull() line by line for io.
+ *
+ * usage: bench_proc_parse [iterations]
+ *
+ * Times are in nanoseconds per file, best of ROUNDS runs.
+ * bench_proc_parse_scalar is the same built without __SSE2__, to time the
+ * scalar skip_fields().
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "m_linux_parse.h"
+
+#define ROUNDS		5
+
+/* a backend as the kernel shows it, with delayacct_blkio_ticks at 42 */
+static const char stat_line[] =
+"24817 (postgres) S 1021 1021 1021 0 -1 4194560 28163 0 12 0 12597 3718 0 0 "
+"20 0 1 0 873451207 229376000 35213 18446744073709551615 94554016735232 "
+"94554025010541 140725537281104 0 0 0 4194304 16797191 1115152 0 0 0 17 3 0 "
+"0 73 0 0 94554027481296 94554027576736 94554044383232 140725537289009 "
+"140725537289057 140725537289057 140725537292264 0\n";
+
+static const char io_text[] =
+"rchar: 1948310112\n"
+"wchar: 284710016\n"
+"syscr: 117250\n"
+"syscw: 35148\n"
+"read_bytes: 1218306048\n"
+"write_bytes: 274382848\n"
+"cancelled_write_bytes: 1024000\n";
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *
+skip_token(const char *p)
+{
+	while (isspace(*p))
+		p++;
+	while (*p && !isspace(*p))
+		p++;
+	return (char *) p;
+}
+
+/* the way m_linux.c read the same fields before parse_stat() */
+static int
+libc_stat(char *buffer, struct stat_fields *f)
+{
+	char	   *p,
+			   *q;
+	int			i;
+
+	if ((p = strchr(buffer, '(')) == NULL || (q = strrchr(++p, ')')) == NULL)
+		return -1;
+	*q = '\0';
+	f->comm = p;
+	p = q + 1;
+	while (isspace(*p))
+		p++;
+	f->state = *p++;
+	for (i = 0; i < 10; i++)
+		p = skip_token(p);
+	f->utime = strtoul(p, &p, 10);
+	f->stime = strtoul(p, &p, 10);
+	for (i = 0; i < 6; i++)
+		p = skip_token(p);
+	f->start_time = strtoul(p, &p, 10);
+	f->vsize = strtoul(p, &p, 10);
+	f->rss = strtoul(p, &p, 10);
+	for (i = 0; i < 17; i++)
+		p = skip_token(p);
+	f->blkio = strtoul(p, &p, 10);
+	return 0;
+}
+
+static int
+libc_io(const char *buffer, unsigned long long values[NIOFIELDS])
+{
+	const char *p = buffer;
+	char	   *q;
+	int			i;
+
+	for (i = 0; i < NIOFIELDS; i++)
+	{
+		if ((p = strchr(p, ':')) == NULL)
+			return -1;
+		values[i] = strtoull(p + 1, &q, 10);
+		p = q;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long		iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	char		buffer[sizeof(stat_line)];
+	int			len = sizeof(stat_line) - 1;
+	int			close = strrchr(stat_line, ')') - stat_line;
+	struct stat_fields f;
+	unsigned long long io[NIOFIELDS];
+	unsigned long long sum = 0;
+	double		best[4] = {0, 0, 0, 0};
+	double		start,
+				t;
+	long		i;
+	int			r,
+				k;
+
+	if (iterations < 1)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	memcpy(buffer, stat_line, sizeof(stat_line));
+
+	for (r = 0; r < ROUNDS; r++)
+	{
+		for (k = 0; k < 4; k++)
+		{
+			start = now();
+			for (i = 0; i < iterations; i++)
+			{
+				switch (k)
+				{
+					case 0:
+						if (parse_stat(buffer, len, &f) == 0)
+							sum += f.utime + f.rss + f.blkio;
+						buffer[close] = ')';
+						break;
+					case 1:
+						if (libc_stat(buffer, &f) == 0)
+							sum += f.utime + f.rss + f.blkio;
+						buffer[close] = ')';
+						break;
+					case 2:
+						if (parse_io(io_text, sizeof(io_text) - 1, io) == 0)
+							sum += io[IOF_SYSCR] + io[IOF_CANCELLED_WRITE_BYTES];
+						break;
+					case 3:
+						if (libc_io(io_text, io) == 0)
+							sum += io[IOF_SYSCR] + io[IOF_CANCELLED_WRITE_BYTES];
+						break;
+				}
+			}
+			t = (now() - start) / iterations;
+			if (best[k] == 0 || t < best[k])
+				best[k] = t;
+		}
+	}
+
+	printf("%-6s %10s %10s\n", "", "parse", "libc");
+	printf("%-6s %10.1f %10.1f\n", "stat", best[0] * 1e9, best[1] * 1e9);
+	printf("%-6s %10.1f %10.1f\n", "io", best[2] * 1e9, best[3] * 1e9);
+
+	/* keeps the loops from being optimized away */
+	return sum == 0;
+}
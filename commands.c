@@ -54,6 +54,7 @@ struct cmd	cmd_map[] = {
 	{'\014', cmd_redraw},
 	{'#', cmd_number},
 	{' ', cmd_update},
+	{'1', cmd_percpu},
 	{'?', cmd_help},
 	{'A', cmd_explain_analyze},
 	{'a', cmd_activity},
@@ -63,6 +64,7 @@ struct cmd	cmd_map[] = {
 #endif							/* ENABLE_COLOR */
 	{'d', cmd_displays},
 	{'E', cmd_explain},
+	{'G', cmd_cgroup},
 	{'h', cmd_help},
 	{'i', cmd_idletog},
 	{'I', cmd_io},
@@ -163,16 +165,22 @@ cmd_current_query(struct pg_top_context *pgtctx)
 int
 cmd_delay(struct pg_top_context *pgtctx)
 {
-	int			i;
+	double		secs;
 	char		tempbuf[50];
 
 	new_message(MT_standout, "Seconds to delay: ");
-	if ((i = readline(tempbuf, 8, Yes)) > -1)
+	if (readline(tempbuf, 8, No) > 0)
 	{
-		if ((pgtctx->delay = i) == 0 && getuid() != 0)
+		if ((secs = atosecs(tempbuf)) < 0)
+		{
+			new_message(MT_standout | MT_delayed, " Bad seconds delay");
+			return No;
+		}
+		if (secs < Minimum_DELAY && (secs != 0 || getuid() != 0))
 		{
-			pgtctx->delay = 1;
+			secs = Minimum_DELAY;
 		}
+		pgtctx->delay = secs;
 	}
 	clear_message();
 	return No;
@@ -307,6 +315,39 @@ cmd_number(struct pg_top_context *pgtctx)
 	return No;
 }
 
+int
+cmd_cgroup(struct pg_top_context *pgtctx)
+{
+	if (pgtctx->statics.cgroup_cpu_names == NULL)
+	{
+		new_message(MT_standout | MT_delayed,
+					" The figures of the server's cgroup are not available.");
+		putchar('\r');
+		return No;
+	}
+	pgtctx->hostview = !pgtctx->hostview;
+	new_message(MT_standout | MT_delayed, " Showing the figures of the %s.",
+				pgtctx->hostview ? "host" : "server's cgroup");
+	putchar('\r');
+	return No;
+}
+
+int
+cmd_percpu(struct pg_top_context *pgtctx)
+{
+	if (pgtctx->statics.ncpus == 0)
+	{
+		new_message(MT_standout | MT_delayed,
+					" The states of each cpu are not available.");
+		putchar('\r');
+		return No;
+	}
+	pgtctx->percpu = !pgtctx->percpu;
+	max_topn = display_percpu(pgtctx->percpu);
+	reset_display(pgtctx);
+	return No;
+}
+
 int
 cmd_quit(struct pg_top_context *pgtctx)
 {
@@ -599,7 +640,7 @@ show_current_query(struct pg_conninfo_ctx *conninfo, int procpid)
 	connect_to_db(conninfo);
 	if (conninfo->connection != NULL)
 	{
-		pgresult = pg_query(conninfo->connection, procpid);
+		pgresult = pg_query(conninfo, procpid);
 		rows = PQntuples(pgresult);
 	}
 	else
@@ -614,7 +655,6 @@ show_current_query(struct pg_conninfo_ctx *conninfo, int procpid)
 
 	if (pgresult != NULL)
 		PQclear(pgresult);
-	disconnect_from_db(conninfo);
 }
 
 void
@@ -638,7 +678,7 @@ show_explain(struct pg_conninfo_ctx *conninfo, int procpid, int analyze)
 	connect_to_db(conninfo);
 	if (conninfo->connection != NULL)
 	{
-		pgresult_query = pg_query(conninfo->connection, procpid);
+		pgresult_query = pg_query(conninfo, procpid);
 		rows = PQntuples(pgresult_query);
 	}
 	else
@@ -660,9 +700,9 @@ show_explain(struct pg_conninfo_ctx *conninfo, int procpid, int analyze)
 		{
 			sprintf(sql, "EXPLAIN\n%s", PQgetvalue(pgresult_query, i, 0));
 		}
-		PQexec(conninfo->connection, BEGIN);
+		PQclear(PQexec(conninfo->connection, BEGIN));
 		pgresult_explain = PQexec(conninfo->connection, sql);
-		PQexec(conninfo->connection, ROLLBACK);
+		PQclear(PQexec(conninfo->connection, ROLLBACK));
 		r = PQntuples(pgresult_explain);
 		/* This will display an error if the EXPLAIN fails. */
 		display_pager("\n\nQuery Plan:\n\n");
@@ -679,7 +719,6 @@ show_explain(struct pg_conninfo_ctx *conninfo, int procpid, int analyze)
 
 	if (pgresult_query != NULL)
 		PQclear(pgresult_query);
-	disconnect_from_db(conninfo);
 }
 
 void
@@ -703,12 +742,9 @@ show_locks(struct pg_conninfo_ctx *conninfo, int procpid)
 	/* Get the locks helf by the process. */
 	connect_to_db(conninfo);
 	if (conninfo->connection == NULL)
-	{
-		disconnect_from_db(conninfo);
 		return;
-	}
 
-	pgresult = pg_locks(conninfo->connection, procpid);
+	pgresult = pg_locks(conninfo, procpid);
 	rows = PQntuples(pgresult);
 
 	/* Determine column sizes. */
@@ -768,5 +804,4 @@ show_locks(struct pg_conninfo_ctx *conninfo, int procpid)
 	display_pager("\n");
 
 	PQclear(pgresult);
-	disconnect_from_db(conninfo);
 }
@@ -19,6 +19,7 @@ struct cmd
 #define EXPLAIN_ANALYZE 1
 
 int			cmd_activity(struct pg_top_context *);
+int			cmd_cgroup(struct pg_top_context *);
 #ifdef ENABLE_COLOR
 int			cmd_color(struct pg_top_context *);
 #endif							/* ENABLE_COLOR */
@@ -34,6 +35,7 @@ int			cmd_indexes(struct pg_top_context *);
 int			cmd_io(struct pg_top_context *);
 int			cmd_locks(struct pg_top_context *);
 int			cmd_number(struct pg_top_context *);
+int			cmd_percpu(struct pg_top_context *);
 int			cmd_quit(struct pg_top_context *);
 int			cmd_replication(struct pg_top_context *);
 int			cmd_order(struct pg_top_context *);
@@ -22,14 +22,16 @@
  *		  have minimal (or nonexistant) terminal capabilities.
  *
  *		  The routines are called in this order:  *_loadave, i_timeofday,
- *		  *_procstates, *_cpustates, *_memory, *_message, *_header,
- *		  *_process, u_endscreen.
+ *		  *_procstates, *_cpustates, i_percpu, *_memory, *_swap,
+ *		  *_pressure, *_message, *_header, *_process, u_endscreen.
  */
 
 #include "os.h"
 #include <ctype.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "pg_top.h"
 #include "machine.h"
@@ -45,6 +47,17 @@
 
 #define CURSOR_COST 8
 
+/*
+ * the per-CPU area shows all the states of each cpu when that takes no more
+ * than this many lines, or else a bar for each, as wide as lets them fit
+ */
+#define PERCPU_LINES	8
+#define PERCPU_BAR_MIN	2
+#define PERCPU_BAR_NUMBER	12
+
+/* the lines of the figures of the server's cgroup */
+#define NCGROUPLINES	3
+
 /* imported from screen.c */
 extern int	overstrike;
 
@@ -67,10 +80,14 @@ static int	x_procstate = X_PROCSTATE;
 static int	y_procstate = Y_PROCSTATE;
 static int	x_cpustates = X_CPUSTATES;
 static int	y_cpustates = Y_CPUSTATES;
+static int	y_percpu = Y_CPUSTATES + 1;
 static int	x_mem = X_MEM;
 static int	y_mem = Y_MEM;
 static int	x_swap = -1;
 static int	y_swap = -1;
+static int	y_cgroup = Y_CPUSTATES;
+static int	x_pressure = X_PRESSURE;
+static int	y_pressure = -1;
 static int	y_message = Y_MESSAGE;
 static int	x_header = X_HEADER;
 static int	y_header = Y_HEADER;
@@ -103,17 +120,39 @@ static char **procstate_names;
 static char **cpustate_names;
 static char **memory_names;
 static char **swap_names;
+static char **pressure_names;
 
 static int	num_procstates;
 static int	num_cpustates;
 static int	num_memory;
 static int	num_swap;
+static int	num_pressure;
+
+static char **cgroup_names[NCGROUPLINES];
+static int	num_cgroup[NCGROUPLINES];
+static long *cgroup_values;
+static int	cgroup_on;
+static char *cgroup_tags[NCGROUPLINES] =
+{
+	"Cgroup CPU: ", "Cgroup Memory: ", "Cgroup I/O per second: "
+};
 
 static int *lprocstates;
 static int *lcpustates;
 
 static int *cpustate_columns;
+static int *cpustate_rows;
+static int	cpustate_lines = 1;
 static int	cpustate_total_length;
+static int	cpustate_idle = -1;
+static int	cpustate_iowait = -1;
+
+static int	ncpus;
+static int	percpu_on;
+static int	percpu_lines;		/* lines of the per-CPU area, 0 when hidden */
+static int	percpu_cols;		/* bars on each line, 0 for all the states */
+static int	percpu_bar;			/* width of a bar */
+static int	percpu_digits;		/* width of a cpu number */
 
 static enum
 {
@@ -126,11 +165,25 @@ static int	header_cidx;
 static int *cpustate_cidx;
 static int *memory_cidx;
 static int *swap_cidx;
+static int *pressure_cidx;		/* some and full for each */
+static int *cgroup_cidx[NCGROUPLINES];
 #endif
 static int	header_color = 0;
 
+/*
+ * Messages from the collector thread are left in thread_msg, one at a time,
+ * and moved to next_msg by the display thread, which owns everything else
+ * here.
+ */
+static pthread_t display_thread;
+static int	display_thread_set;
+static char thread_msg[MAX_COLS + 8];
+static atomic_int thread_msg_ready;
+
 /* internal support routines */
 
+static void layout_cpustates();
+
 /*
  * static int string_count(char **pp)
  *
@@ -535,6 +588,7 @@ summary_format_memory(int x, int y, long *numbers, char **names, int *cidx)
 	register int color;
 	register char *thisname;
 	register char *lastname = NULL;
+	char		kbytes[FORMAT_SIZE];
 
 	/* format each number followed by its string */
 	while ((thisname = *names++) != NULL)
@@ -563,7 +617,7 @@ summary_format_memory(int x, int y, long *numbers, char **names, int *cidx)
 			/* is this number in kilobytes? */
 			if (thisname[0] == 'K')
 			{
-				display_write(x, y, color, 0, format_k(num));
+				display_write(x, y, color, 0, format_k(num, kbytes));
 				lastname++;
 			}
 			else
@@ -661,6 +715,9 @@ display_resize()
 		memzero(colorbuf, bufsize);
 	}
 
+	/* the lines from the cpu states down depend on the width */
+	layout_cpustates();
+
 	/* adjust total lines on screen to lines available for procs */
 	lines -= y_procs;
 
@@ -685,54 +742,79 @@ display_init(struct statics *statics)
 	register char *p;
 	register int *ip;
 	register int i;
+	register int j;
+
+	/* only this thread draws; see new_message_v() */
+	display_thread = pthread_self();
+	display_thread_set = 1;
 
 	/*
 	 * certain things may influence the screen layout, so look at those first
 	 */
-	/* a swap line shifts parts of the display down one */
+	/* a swap line shifts parts of the display down one, see layout_cpustates */
 	swap_names = statics->swap_names;
 	if ((num_swap = string_count(swap_names)) > 0)
 	{
-		/* adjust screen placements */
-		y_message++;
-		y_header++;
-		y_idlecursor++;
-		y_procs++;
 		x_swap = X_SWAP;
-		y_swap = Y_SWAP;
 	}
 
-	/* call resize to do the dirty work */
-	lines = display_resize();
+	/* and so does a pressure line */
+	pressure_names = statics->pressure_names;
+	num_pressure = string_count(pressure_names);
 
-	/* only do the rest if we need to */
-	if (lines > -1)
-	{
-		/* save pointers and allocate space for names */
-		procstate_names = statics->procstate_names;
-		num_procstates = string_count(procstate_names);
-		lprocstates = (int *) malloc(num_procstates * sizeof(int));
-
-		cpustate_names = statics->cpustate_names;
-		num_cpustates = string_count(cpustate_names);
-		lcpustates = (int *) malloc(num_cpustates * sizeof(int));
-		cpustate_columns = (int *) malloc(num_cpustates * sizeof(int));
-		memory_names = statics->memory_names;
-		num_memory = string_count(memory_names);
-
-		/* calculate starting columns where needed */
-		cpustate_total_length = 0;
-		pp = cpustate_names;
-		ip = cpustate_columns;
-		while (*pp != NULL)
+	/* the figures of the server's cgroup, when it has one */
+	cgroup_names[0] = statics->cgroup_cpu_names;
+	cgroup_names[1] = statics->cgroup_memory_names;
+	cgroup_names[2] = statics->cgroup_io_names;
+	for (i = 0, j = 0; i < NCGROUPLINES; i++)
+	{
+		num_cgroup[i] = string_count(cgroup_names[i]);
+		if (num_cgroup[i] > j)
 		{
-			*ip++ = cpustate_total_length;
-			if ((i = strlen(*pp++)) > 0)
-			{
-				cpustate_total_length += i + 8;
-			}
+			j = num_cgroup[i];
 		}
 	}
+	cgroup_values = (long *) malloc((j + 1) * sizeof(long));
+
+	/* save pointers and allocate space for names */
+	procstate_names = statics->procstate_names;
+	num_procstates = string_count(procstate_names);
+	lprocstates = (int *) malloc(num_procstates * sizeof(int));
+
+	cpustate_names = statics->cpustate_names;
+	num_cpustates = string_count(cpustate_names);
+	lcpustates = (int *) malloc(num_cpustates * sizeof(int));
+	cpustate_columns = (int *) malloc(num_cpustates * sizeof(int));
+	cpustate_rows = (int *) malloc(num_cpustates * sizeof(int));
+	memory_names = statics->memory_names;
+	num_memory = string_count(memory_names);
+
+	/* calculate starting columns where needed */
+	cpustate_total_length = 0;
+	pp = cpustate_names;
+	ip = cpustate_columns;
+	while (*pp != NULL)
+	{
+		*ip++ = cpustate_total_length;
+		if ((i = strlen(*pp)) > 0)
+		{
+			cpustate_total_length += i + 8;
+		}
+
+		/* the states that are not a cpu being busy */
+		if (strcmp(*pp, "idle") == 0)
+			cpustate_idle = pp - cpustate_names;
+		else if (strcmp(*pp, "iowait") == 0)
+			cpustate_iowait = pp - cpustate_names;
+		pp++;
+	}
+
+	/* the per-CPU area numbers the cpus from 0 */
+	ncpus = statics->ncpus;
+	percpu_digits = strlen(itoa(ncpus > 0 ? ncpus - 1 : 0));
+
+	/* call resize to do the dirty work */
+	lines = display_resize();
 
 #ifdef ENABLE_COLOR
 	/* set up color tags for loadavg */
@@ -773,6 +855,28 @@ display_init(struct statics *statics)
 		strcpy(p, homogenize(swap_names[i] + 1));
 		swap_cidx[i++] = color_tag(scratchbuf);
 	}
+
+	/* color tags for pressure, such as pressure.io.full */
+	pressure_cidx = (int *) malloc(num_pressure * 2 * sizeof(int));
+	for (i = 0; i < num_pressure * 2; i++)
+	{
+		sprintf(scratchbuf, "pressure.%s.%s", pressure_names[i / 2],
+				i % 2 == 0 ? "some" : "full");
+		pressure_cidx[i] = color_tag(scratchbuf);
+	}
+
+	/* color tags for the cgroup, such as cgroup.cpu.periodsthrottled */
+	for (i = 0; i < NCGROUPLINES; i++)
+	{
+		cgroup_cidx[i] = (int *) malloc((num_cgroup[i] + 1) * sizeof(int));
+		p = strecpy(scratchbuf, "cgroup.");
+		p = strecpy(p, i == 0 ? "cpu." : i == 1 ? "memory." : "io.");
+		for (j = 0; j < num_cgroup[i]; j++)
+		{
+			strcpy(p, homogenize(cgroup_names[i][j] + 1));
+			cgroup_cidx[i][j] = color_tag(scratchbuf);
+		}
+	}
 #endif
 
 	/* return number of lines available (or error) */
@@ -1001,13 +1105,111 @@ cpustates_tag()
 	return (use);
 }
 
+/*
+ * layout_cpustates() puts the cpu states on as many lines as they need at
+ * the current width, followed by the per-CPU area when it is shown, and
+ * moves the rest of the display down below them.
+ */
+
+static void
+layout_cpustates()
+{
+	register int i;
+	register int len;
+	register int col = 0;
+	register int row = 0;
+	int			shift;
+	int			wanted;
+	int			room;
+
+	/* wrap before a state whose trailing comma would go off the screen */
+	(void) cpustates_tag();
+	for (i = 0; i < num_cpustates; i++)
+	{
+		if ((len = strlen(cpustate_names[i])) > 0)
+		{
+			len += 8;
+		}
+		if (col > 0 && x_cpustates + col + len - 1 > display_width)
+		{
+			row++;
+			col = 0;
+		}
+		cpustate_columns[i] = col;
+		cpustate_rows[i] = row;
+		col += len;
+	}
+	cpustate_lines = row + 1;
+	y_percpu = y_cpustates + cpustate_lines;
+
+	percpu_lines = 0;
+	if (percpu_on && ncpus > 0 && !cgroup_on)
+	{
+		if (ncpus * cpustate_lines <= PERCPU_LINES)
+		{
+			/* a line like the cpu states for each */
+			percpu_cols = 0;
+			wanted = ncpus * cpustate_lines;
+		}
+		else
+		{
+			/* bars as wide as lets them fit on PERCPU_LINES lines */
+			percpu_cols = (ncpus + PERCPU_LINES - 1) / PERCPU_LINES;
+			percpu_bar = (display_width + 1) / percpu_cols - percpu_digits - 3;
+			if (percpu_bar < PERCPU_BAR_MIN)
+			{
+				percpu_bar = PERCPU_BAR_MIN;
+			}
+			percpu_cols = (display_width + 1) / (percpu_digits + percpu_bar + 3);
+			if (percpu_cols < 1)
+			{
+				percpu_cols = 1;
+			}
+			wanted = (ncpus + percpu_cols - 1) / percpu_cols;
+		}
+
+		/* leave a line for processes at least */
+		room = screen_length - (Y_PROCS + cpustate_lines - 1 +
+								(num_swap > 0) + (num_pressure > 0)) - 1;
+		percpu_lines = smart_terminal && wanted > room ?
+			(room > 0 ? room : 0) : wanted;
+	}
+
+	/* the figures of a cgroup take the place of all those of the host */
+	if (cgroup_on)
+	{
+		shift = NCGROUPLINES - 2;
+	}
+	else
+	{
+		shift = cpustate_lines - 1 + percpu_lines;
+	}
+	y_mem = Y_MEM + shift;
+	if (num_swap > 0 && !cgroup_on)
+	{
+		y_swap = Y_SWAP + shift;
+		shift++;
+	}
+	if (num_pressure > 0)
+	{
+		y_pressure = Y_SWAP + shift;
+		shift++;
+	}
+	y_message = Y_MESSAGE + shift;
+	y_header = Y_HEADER + shift;
+	y_idlecursor = Y_IDLECURSOR + shift;
+	y_procs = Y_PROCS + shift;
+}
+
 void
 i_cpustates(int64_t * states)
 {
+	int64_t    *first = states;
 	int			value;
 	char	  **names;
 	char	   *thisname;
 	int		   *colp;
+	int		   *rowp;
 	int color = 0;
 
 #ifdef ENABLE_COLOR
@@ -1017,6 +1219,7 @@ i_cpustates(int64_t * states)
 	/* initialize */
 	names = cpustate_names;
 	colp = cpustate_columns;
+	rowp = cpustate_rows;
 
 	/* print tag */
 	display_write(0, y_cpustates, 0, 0, cpustates_tag());
@@ -1035,7 +1238,7 @@ i_cpustates(int64_t * states)
 #endif
 
 			/* if percentage is >= 1000, print it as 100% */
-			display_fmt(x_cpustates + *colp, y_cpustates,
+			display_fmt(x_cpustates + *colp, y_cpustates + *rowp,
 						color, 0,
 						(value >= 1000 ? "%4.0f%% %s" : "%4.1f%% %s"),
 						((float) value) / 10.,
@@ -1046,11 +1249,13 @@ i_cpustates(int64_t * states)
 		}
 		/* increment */
 		colp++;
+		rowp++;
 		states++;
 	}
 
 	/* copy over values into "last" array */
-	memcpy(lcpustates, states, num_cpustates * sizeof(int));
+	for (value = 0; value < num_cpustates; value++)
+		lcpustates[value] = first[value];
 }
 
 void
@@ -1061,6 +1266,7 @@ u_cpustates(int64_t * states)
 	char	   *thisname;
 	int		   *lp;
 	int		   *colp;
+	int		   *rowp;
 	int color = 0;
 
 #ifdef ENABLE_COLOR
@@ -1069,6 +1275,7 @@ u_cpustates(int64_t * states)
 
 	lp = lcpustates;
 	colp = cpustate_columns;
+	rowp = cpustate_rows;
 
 	/* we could be much more optimal about this */
 	while ((thisname = *names++) != NULL)
@@ -1088,7 +1295,7 @@ u_cpustates(int64_t * states)
 #endif
 
 				/* if percentage is >= 1000, print it as 100% */
-				display_fmt(x_cpustates + *colp, y_cpustates,
+				display_fmt(x_cpustates + *colp, y_cpustates + *rowp,
 							color, 0,
 							(value >= 1000 ? "%4.0f%% %s" : "%4.1f%% %s"),
 							((float) value) / 10.,
@@ -1108,6 +1315,7 @@ u_cpustates(int64_t * states)
 		lp++;
 		states++;
 		colp++;
+		rowp++;
 	}
 }
 
@@ -1126,9 +1334,11 @@ z_cpustates()
 	{
 		if (*thisname != '\0')
 		{
-			display_fmt(-1, -1, 0, 0, "%s    %% %s", i++ == 0 ? "" : ", ",
-						thisname);
+			display_fmt(x_cpustates + cpustate_columns[i],
+						y_cpustates + cpustate_rows[i], 0, 0, "    %% %s%s",
+						thisname, *names != NULL ? "," : "");
 		}
+		i++;
 	}
 
 	/* fill the "last" array with all -1s, to insure correct updating */
@@ -1140,6 +1350,135 @@ z_cpustates()
 	}
 }
 
+/*
+ *	i_percpu(states) - show the cpu states of each cpu, or bars of how busy
+ *	each one was when there are too many for that.  The states of a cpu that
+ *	is offline are all 0.  Like i_timeofday, this is used for every update,
+ *	and leaves it to display_write to send only what changed.
+ */
+
+static int
+percpu_busy(int64_t * states)
+{
+	register int i;
+	int64_t		total = 0;
+	int64_t		idle = 0;
+
+	for (i = 0; i < num_cpustates; i++)
+	{
+		total += states[i];
+		if (i == cpustate_idle || i == cpustate_iowait)
+		{
+			idle += states[i];
+		}
+	}
+	return (total > 0 ? (int) ((total - idle) * 1000 / total) : -1);
+}
+
+void
+i_percpu(int64_t * states)
+{
+	register int cpu;
+	register int i;
+	int64_t    *cs;
+	int			line;
+	int			last;
+	int			len;
+	int			busy;
+	char		bar[MAX_COLS];
+	int color = 0;
+
+	if (states == NULL)
+	{
+		return;
+	}
+
+	for (cpu = 0; cpu < ncpus; cpu++)
+	{
+		cs = &states[cpu * num_cpustates];
+		busy = percpu_busy(cs);
+
+		if (percpu_cols == 0)
+		{
+			/* the numbers go under those of all the cpus */
+			line = y_percpu + cpu * cpustate_lines;
+			if (line >= y_percpu + percpu_lines)
+			{
+				break;
+			}
+			display_fmt(0, line, 0, busy < 0, "%*d: %s",
+						x_cpustates - 2, cpu, busy < 0 ? "offline" : "");
+			for (i = 0; i < num_cpustates; i++)
+			{
+				if ((len = strlen(cpustate_names[i])) == 0 ||
+					line + cpustate_rows[i] >= y_percpu + percpu_lines)
+				{
+					continue;
+				}
+				last = i == num_cpustates - 1 ||
+					cpustate_rows[i + 1] != cpustate_rows[i];
+				if (busy < 0)
+				{
+					/* the rest of an offline cpu's lines are blank */
+					if (last && cpustate_rows[i] > 0)
+					{
+						display_write(0, line + cpustate_rows[i], 0, 1, "");
+					}
+					continue;
+				}
+
+#ifdef ENABLE_COLOR
+				color = color_test(cpustate_cidx[i], cs[i] / 10);
+#endif
+				display_fmt(x_cpustates + cpustate_columns[i],
+							line + cpustate_rows[i], color, 0,
+							(cs[i] >= 1000 ? "%4.0f%%" : "%4.1f%%"),
+							((float) cs[i]) / 10.);
+				display_fmt(-1, -1, 0, last, "%*s", last ? 0 : len + 3, "");
+			}
+		}
+		else
+		{
+			/* the bars go across, then down */
+			line = y_percpu + cpu / percpu_cols;
+			if (line >= y_percpu + percpu_lines)
+			{
+				break;
+			}
+			len = busy > 0 ? (busy * percpu_bar + 500) / 1000 : 0;
+			memset(bar, '|', len);
+			memset(bar + len, ' ', percpu_bar - len);
+			bar[percpu_bar] = '\0';
+
+			/* with the percentage at the end when there is room */
+			if (busy >= 0 && percpu_bar >= PERCPU_BAR_NUMBER)
+			{
+				snprintf(bar + percpu_bar - 6, 7, (busy >= 1000 ?
+												  "%5.0f%%" : "%5.1f%%"),
+						 ((float) busy) / 10.);
+			}
+			display_fmt((cpu % percpu_cols) * (percpu_digits + percpu_bar + 3),
+						line, 0,
+						cpu % percpu_cols == percpu_cols - 1 || cpu == ncpus - 1,
+						"%*d[%s] ", percpu_digits, cpu, bar);
+		}
+	}
+}
+
+/*
+ * int display_percpu(int on)
+ *
+ * Show the per-CPU area below the cpu states, or hide it.  Returns the
+ * number of lines then available for displaying processes.
+ */
+
+int
+display_percpu(int on)
+{
+	percpu_on = on;
+	return (display_resize());
+}
+
 /*
  *	*_memory(stats) - print "Memory: " followed by the memory summary string
  *
@@ -1195,6 +1534,138 @@ u_swap(long *stats)
 	}
 }
 
+/*
+ *	*_pressure(stats) - print the share of the time that some and that all
+ *	tasks stalled on each resource
+ *
+ *	These functions only print something when num_pressure > 0
+ */
+
+static void
+summary_format_pressure(int64_t * stats)
+{
+	register int i;
+	int			x = x_pressure;
+	int			y = y_pressure;
+	int			color = 0;
+
+	for (i = 0; i < num_pressure * 2; i++)
+	{
+		/* the name, then the some and full that there are */
+		if (i % 2 == 0)
+		{
+			display_fmt(x, y, 0, 0, "%s%s", i > 0 ? ", " : "",
+						pressure_names[i / 2]);
+			x = y = -1;
+		}
+		if (stats[i] < 0)
+		{
+			continue;
+		}
+
+#ifdef ENABLE_COLOR
+		color = color_test(pressure_cidx[i], stats[i] / 10);
+#endif
+		display_write(-1, -1, 0, 0, " ");
+		display_fmt(-1, -1, color, 0,
+					(stats[i] >= 1000 ? "%4.0f%%" : "%4.1f%%"),
+					((float) stats[i]) / 10.);
+	}
+	display_write(-1, -1, 0, 1, "");
+}
+
+/*
+ *	*_cgroup(stats) - print the figures of the server's cgroup in place of
+ *	those of the host, and then the stalls in it
+ */
+
+static void
+summary_format_cgroup(int64_t * stats, int tags)
+{
+	register int i;
+	register int j;
+	int			shown;
+
+	for (i = 0; i < NCGROUPLINES; i++)
+	{
+		if (tags)
+		{
+			display_write(0, y_cgroup + i, 0, 0, cgroup_tags[i]);
+		}
+		for (j = 0, shown = 0; j < num_cgroup[i]; j++)
+		{
+			if ((cgroup_values[j] = (long) *stats++) >= 0)
+			{
+				shown++;
+			}
+		}
+
+		/* a line with nothing to show is cleared, not left as it was */
+		if (shown == 0)
+		{
+			display_write(strlen(cgroup_tags[i]), y_cgroup + i, 0, 1, "");
+			continue;
+		}
+		summary_format_memory(strlen(cgroup_tags[i]), y_cgroup + i,
+							  cgroup_values, cgroup_names[i], cgroup_cidx[i]);
+	}
+
+	if (num_pressure > 0)
+	{
+		if (tags)
+		{
+			display_write(0, y_pressure, 0, 0, "Pressure some/full: ");
+		}
+		summary_format_pressure(stats);
+	}
+}
+
+void
+i_cgroup(int64_t * stats)
+{
+	summary_format_cgroup(stats, 1);
+}
+
+void
+u_cgroup(int64_t * stats)
+{
+	summary_format_cgroup(stats, 0);
+}
+
+/*
+ *	display_cgroup(on)
+ *
+ * Show the figures of the server's cgroup in place of those of the host, or
+ * the other way round.  Returns the number of lines then available for
+ * displaying processes.
+ */
+
+int
+display_cgroup(int on)
+{
+	cgroup_on = on;
+	return (display_resize());
+}
+
+void
+i_pressure(int64_t * stats)
+{
+	if (num_pressure > 0 && stats != NULL)
+	{
+		display_write(0, y_pressure, 0, 0, "Pressure some/full: ");
+		summary_format_pressure(stats);
+	}
+}
+
+void
+u_pressure(int64_t * stats)
+{
+	if (num_pressure > 0 && stats != NULL)
+	{
+		summary_format_pressure(stats);
+	}
+}
+
 /*
  *	*_message() - print the next pending message line, or erase the one
  *				  that is there.
@@ -1218,6 +1689,12 @@ static int	msglen = 0;
 void
 i_message()
 {
+	if (atomic_load(&thread_msg_ready))
+	{
+		strcpy(next_msg, thread_msg);
+		atomic_store(&thread_msg_ready, 0);
+	}
+
 	if (smart_terminal)
 	{
 		if (next_msg[0] != '\0')
@@ -1340,6 +1817,17 @@ new_message_v(int type, char *msgfmt, va_list ap)
 {
 	register int i;
 
+	if (display_thread_set && !pthread_equal(pthread_self(), display_thread))
+	{
+		/* a newer message waits until the pending one has been shown */
+		if (!atomic_load(&thread_msg_ready))
+		{
+			(void) vsnprintf(thread_msg, sizeof(thread_msg), msgfmt, ap);
+			atomic_store(&thread_msg_ready, 1);
+		}
+		return;
+	}
+
 	/* first, format the message */
 	(void) vsnprintf(next_msg, sizeof(next_msg), msgfmt, ap);
 
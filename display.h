@@ -24,10 +24,17 @@ void		u_procstates(int total, int *brkdn);
 void		i_cpustates(int64_t * states);
 void		u_cpustates(int64_t * states);
 void		z_cpustates();
+void		i_percpu(int64_t * states);
+int			display_percpu(int on);
 void		i_memory(long *stats);
 void		u_memory(long *stats);
 void		i_swap(long *stats);
 void		u_swap(long *stats);
+void		i_pressure(int64_t * stats);
+void		u_pressure(int64_t * stats);
+void		i_cgroup(int64_t * stats);
+void		u_cgroup(int64_t * stats);
+int			display_cgroup(int on);
 void		i_message();
 void		u_message();
 void		i_header(char *text);
@@ -0,0 +1,36 @@
+/*
+ * fuzz/fuzz_proc_io.c
+ *
+ * Fuzz parse_io() with anything that could be read from /proc/<pid>/io.
+ * The seeds are in corpus/io.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_linux_parse.h"
+
+/* the most read_one_proc_stat() reads of the file */
+#define IO_MAX		4095
+
+int			LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	unsigned long long values[NIOFIELDS];
+	char	   *buffer;
+
+	if (size > IO_MAX)
+		size = IO_MAX;
+
+	/* a copy of exactly size bytes, so that reading past it is caught */
+	if (size == 0 || (buffer = malloc(size)) == NULL)
+		return 0;
+	memcpy(buffer, data, size);
+
+	(void) parse_io(buffer, (int) size, values);
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * fuzz/fuzz_proc_stat.c
+ *
+ * Fuzz parse_stat() with anything that could be read from /proc/<pid>/stat.
+ * The seeds are in corpus/stat.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_linux_parse.h"
+
+/* the most read_one_proc_stat() reads of the file */
+#define STAT_MAX	4095
+
+int			LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct stat_fields f;
+	char	   *buffer;
+
+	if (size > STAT_MAX)
+		size = STAT_MAX;
+
+	/* a copy of exactly size bytes, so that reading past it is caught */
+	if (size == 0 || (buffer = malloc(size)) == NULL)
+		return 0;
+	memcpy(buffer, data, size);
+
+	/* the command must have been terminated inside the buffer */
+	if (parse_stat(buffer, (int) size, &f) == 0 &&
+		(f.comm <= buffer || f.comm + strlen(f.comm) >= buffer + size))
+		abort();
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * fuzz/replay.c
+ *
+ * A main() for the fuzz targets where libFuzzer is not available: run the
+ * target once on each file named, and on each file in each directory
+ * named, such as the seed corpus.
+ */
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int			LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+static int	inputs;
+
+static void
+replay_file(const char *path)
+{
+	FILE	   *f;
+	uint8_t    *data;
+	long		size;
+
+	if ((f = fopen(path, "rb")) == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if ((data = malloc(size > 0 ? size : 1)) == NULL ||
+		fread(data, 1, size, f) != (size_t) size)
+	{
+		fprintf(stderr, "%s: read error\n", path);
+		exit(1);
+	}
+	fclose(f);
+
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	inputs++;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stat st;
+	struct dirent *de;
+	DIR		   *dir;
+	char		path[4096];
+	int			i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			if ((dir = opendir(argv[i])) == NULL)
+			{
+				perror(argv[i]);
+				return 1;
+			}
+			while ((de = readdir(dir)) != NULL)
+			{
+				if (de->d_name[0] == '.')
+					continue;
+				snprintf(path, sizeof(path), "%s/%s", argv[i], de->d_name);
+				replay_file(path);
+			}
+			closedir(dir);
+		}
+		else
+			replay_file(argv[i]);
+	}
+	printf("%d inputs run\n", inputs);
+	return 0;
+}
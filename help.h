@@ -14,6 +14,7 @@ A       - EXPLAIN ANALYZE (UPDATE/DELETE safe)\n\
 a       - show PostgreSQL activity\n\
 C       - toggle the use of color\n\
 E       - show execution plan (UPDATE/DELETE safe)\n\
+G       - toggle between the server's cgroup and the host (Linux only)\n\
 I       - show I/O statistics per process (Linux only)\n\
 L       - show locks held by a process\n\
 Q       - show current query of a process\n\
@@ -23,6 +24,7 @@ h or ?  - help; show this text\n\
 i       - toggle the displaying of idle processes\n\
 n or #  - change number of processes to display\n\
 o       - specify sort order (%s)\n\
+1       - toggle the display of the states of each cpu\n\
 q       - quit\n\
 s       - change number of seconds to delay between updates\n\
 u       - display processes for only one user (+ selects all users)\n\
@@ -29,6 +29,7 @@
 #define  Y_MEM		3
 #define  X_SWAP		6
 #define  Y_SWAP		4
+#define  X_PRESSURE	20
 #define  Y_MESSAGE	4
 #define  X_HEADER	0
 #define  Y_HEADER	5
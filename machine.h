@@ -9,6 +9,7 @@
 #ifndef _MACHINE_H_
 #define _MACHINE_H_
 
+#include <stdint.h>
 #include <time.h>
 #include <sys/types.h>
 
@@ -60,6 +61,10 @@ struct statics
 	char	  **swap_names;		/* optional */
 	char	  **order_names;	/* optional */
 	char	  **color_names;	/* optional */
+	char	  **pressure_names;	/* optional */
+	char	  **cgroup_cpu_names;	/* optional, those of the server's cgroup */
+	char	  **cgroup_memory_names;	/* optional */
+	char	  **cgroup_io_names;	/* optional */
 	time_t		boottime;		/* optional */
 	int			ncpus;
 	struct
@@ -88,6 +93,10 @@ struct system_info
 	int			P_ACTIVE;		/* number of procs considered "active" */
 	int		   *procstates;
 	int64_t    *cpustates;
+	int64_t    *percpu_cpustates;	/* cpustates of each of ncpus, or NULL */
+	int64_t    *pressure;		/* some and full for each pressure name */
+	int64_t    *cgroup;			/* each of the cgroup names, then pressure
+								 * like above, or NULL without a cgroup */
 	long	   *memory;
 	long	   *swap;
 };
@@ -107,8 +116,64 @@ struct process_select
 	int			fullcmd;		/* show full command */
 	char	   *command;		/* only this command (unless == NULL) */
 	char		usename[NAMEDATALEN + 1];	/* only this postgres usename */
+	int			collectors;		/* threads to gather per process stats */
+	int			topn;			/* rows the caller is going to display */
+	int			width;			/* columns the caller is going to display */
+	int			lock_interval;	/* seconds between counts of pg_locks */
+	int			lock_waits;		/* only flag backends waiting on a lock */
 };
 
+/*
+ * A node_pool hands out fixed size nodes carved from larger slabs.  Freed
+ * nodes are kept on a free list for reuse, so once the number of backends
+ * stops growing no more memory is allocated.
+ */
+
+struct node_pool
+{
+	size_t		size;			/* size of one node */
+	int			per_slab;		/* nodes allocated at a time */
+	void	   *free;			/* list of available nodes */
+};
+
+#define NODE_POOL_INITIALIZER(type) { sizeof(type), 256, NULL }
+
+/*
+ * A pid_hash maps a pid to the node holding its data.  It uses open
+ * addressing with linear probing over an array of (pid, node) pairs, so a
+ * lookup normally touches a single cache line and never the nodes themselves.
+ * A pid of 0 marks an empty slot.
+ */
+
+struct pid_slot
+{
+	pid_t		pid;
+	void	   *node;
+};
+
+struct pid_hash
+{
+	struct pid_slot *slots;
+	int			bits;			/* log2 of the number of slots */
+	unsigned int count;			/* slots in use */
+};
+
+#define PID_HASH_INITIALIZER { NULL, 0, 0 }
+
+/*
+ * Only the rows that will be displayed need to be put in order.  sort_top()
+ * takes an optional function returning an integer sort key for a row, which
+ * must order rows the same way as the first key of the comparison function.
+ * The rows are first narrowed down on that key alone and the comparison
+ * function is only used to break ties among the remaining candidates.
+ */
+
+typedef int (*sort_compare_fn) (const void *, const void *);
+typedef uint64_t (*sort_key_fn) (const void *);
+
+/* three-way comparison that neither truncates nor overflows */
+#define compare_value(a, b) (((a) > (b)) - ((a) < (b)))
+
 /* routines defined by the machine dependent module */
 int			machine_init(struct statics *);
 void		get_system_info(struct system_info *);
@@ -116,13 +181,22 @@ caddr_t		get_process_info(struct system_info *, struct process_select *, int,
 							 struct pg_conninfo_ctx *, int);
 char	   *format_header(char *);
 #if defined(__linux__) || defined (__FreeBSD__)
-char	   *format_next_io(caddr_t);
+char	   *format_next_io(caddr_t, char *);
 #endif /* defined(__linux__) || defined (__FreeBSD__) */
-char	   *format_next_process(caddr_t);
-char	   *format_next_replication(caddr_t);
+char	   *format_next_process(caddr_t, char *);
+char	   *format_next_replication(caddr_t, char *);
 uid_t		proc_owner(pid_t);
 void		update_state(int *pgstate, char *state);
 void		update_str(char **, char *);
+void	   *pool_alloc(struct node_pool *);
+void		pool_free(struct node_pool *, void *);
+void	  **pid_hash_enter(struct pid_hash *, pid_t);
+void	   *pid_hash_lookup(const struct pid_hash *, pid_t);
+void		pid_hash_remove(struct pid_hash *, pid_t);
+const char *intern(const char *);
+void		sort_top(void **, int, int, sort_compare_fn, sort_key_fn);
+uint64_t	sort_key_int(long long, int);
+uint64_t	sort_key_double(double, int);
 
 extern int	mode_stats;
 
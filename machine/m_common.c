@@ -5,6 +5,8 @@
  *
  * Copyright (c) 2013 VMware, Inc. All Rights Reserved.
  */
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
@@ -59,3 +61,469 @@ update_str(char **old, char *new)
 		*old = strdup(new);
 	}
 }
+
+/*
+ * pool_alloc - return a zeroed node from the pool, allocating another slab
+ * when the free list is empty.  Returns NULL when out of memory.
+ */
+
+void *
+pool_alloc(struct node_pool *pool)
+{
+	char	   *slab;
+	void	   *node;
+	int			i;
+
+	if (pool->free == NULL)
+	{
+		slab = malloc(pool->size * pool->per_slab);
+		if (slab == NULL)
+			return NULL;
+		for (i = 0; i < pool->per_slab; i++)
+			pool_free(pool, slab + i * pool->size);
+	}
+
+	node = pool->free;
+	pool->free = *(void **) node;
+	memset(node, 0, pool->size);
+	return node;
+}
+
+/* pool_free - put a node back on the free list */
+
+void
+pool_free(struct node_pool *pool, void *node)
+{
+	*(void **) node = pool->free;
+	pool->free = node;
+}
+
+/*
+ * Fibonacci hashing: multiply by 2^32 / phi and keep the top bits, which
+ * spreads the mostly sequential pids evenly over the table.
+ */
+#define pid_hash_index(h, pid) \
+		((unsigned int) ((uint32_t) (pid) * 2654435769u) >> (32 - (h)->bits))
+
+/* pid_hash_grow - double the size of the table, rehashing every entry */
+
+static int
+pid_hash_grow(struct pid_hash *h)
+{
+	struct pid_slot *old = h->slots;
+	unsigned int oldsize = h->slots == NULL ? 0 : 1u << h->bits;
+	unsigned int i,
+				j,
+				mask;
+	int			bits = h->bits == 0 ? 10 : h->bits + 1;
+
+	h->slots = calloc(1u << bits, sizeof(struct pid_slot));
+	if (h->slots == NULL)
+	{
+		h->slots = old;
+		return -1;
+	}
+	h->bits = bits;
+	mask = (1u << bits) - 1;
+
+	for (i = 0; i < oldsize; i++)
+	{
+		if (old[i].pid == 0)
+			continue;
+		j = pid_hash_index(h, old[i].pid);
+		while (h->slots[j].pid != 0)
+			j = (j + 1) & mask;
+		h->slots[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * pid_hash_enter - return the address of the node pointer for pid, adding an
+ * entry set to NULL if the pid is not in the table yet.  The address is only
+ * good until the next call.  Returns NULL when out of memory.
+ */
+
+void	  **
+pid_hash_enter(struct pid_hash *h, pid_t pid)
+{
+	unsigned int i,
+				mask;
+
+	/* keep the load factor under one half */
+	if ((h->count + 1) * 2 > (h->slots == NULL ? 0 : 1u << h->bits) &&
+		pid_hash_grow(h) != 0)
+		return NULL;
+
+	mask = (1u << h->bits) - 1;
+	for (i = pid_hash_index(h, pid); h->slots[i].pid != 0; i = (i + 1) & mask)
+	{
+		if (h->slots[i].pid == pid)
+			return &h->slots[i].node;
+	}
+
+	h->slots[i].pid = pid;
+	h->slots[i].node = NULL;
+	h->count++;
+	return &h->slots[i].node;
+}
+
+/* pid_hash_lookup - return the node for pid, or NULL if it has none */
+
+void *
+pid_hash_lookup(const struct pid_hash *h, pid_t pid)
+{
+	unsigned int i,
+				mask;
+
+	if (h->slots == NULL)
+		return NULL;
+
+	mask = (1u << h->bits) - 1;
+	for (i = pid_hash_index(h, pid); h->slots[i].pid != 0; i = (i + 1) & mask)
+	{
+		if (h->slots[i].pid == pid)
+			return h->slots[i].node;
+	}
+	return NULL;
+}
+
+/*
+ * pid_hash_remove - delete pid from the table.  Entries after it in the same
+ * run are shifted back so that lookups never need tombstones.
+ */
+
+void
+pid_hash_remove(struct pid_hash *h, pid_t pid)
+{
+	unsigned int i,
+				j,
+				k,
+				mask;
+
+	if (h->slots == NULL)
+		return;
+
+	mask = (1u << h->bits) - 1;
+	for (i = pid_hash_index(h, pid); h->slots[i].pid != pid;
+		 i = (i + 1) & mask)
+	{
+		if (h->slots[i].pid == 0)
+			return;
+	}
+
+	for (j = (i + 1) & mask; h->slots[j].pid != 0; j = (j + 1) & mask)
+	{
+		/* move entry j into the hole at i unless its home lies in (i, j] */
+		k = pid_hash_index(h, h->slots[j].pid);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+	h->slots[i].pid = 0;
+	h->slots[i].node = NULL;
+	h->count--;
+}
+
+/*
+ * The strings that many backends share and that rarely change, such as role
+ * names, application names, client addresses and states, are interned: each
+ * distinct value is stored once, in an open addressing table keyed by an
+ * FNV-1a hash, and is never freed.  Sampling them again then allocates
+ * nothing.
+ */
+
+static char **intern_slots;
+static unsigned int intern_size;	/* a power of 2 */
+static unsigned int intern_count;
+
+static uint32_t
+intern_hash(const char *s)
+{
+	uint32_t	h = 2166136261u;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+/* intern_grow - double the size of the table, rehashing every entry */
+
+static int
+intern_grow(void)
+{
+	char	  **old = intern_slots;
+	unsigned int oldsize = intern_size;
+	unsigned int size = intern_size == 0 ? 256 : intern_size * 2;
+	unsigned int i,
+				j;
+
+	intern_slots = calloc(size, sizeof(char *));
+	if (intern_slots == NULL)
+	{
+		intern_slots = old;
+		return -1;
+	}
+	intern_size = size;
+
+	for (i = 0; i < oldsize; i++)
+	{
+		if (old[i] == NULL)
+			continue;
+		for (j = intern_hash(old[i]) & (size - 1); intern_slots[j] != NULL;
+			 j = (j + 1) & (size - 1))
+			;
+		intern_slots[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * intern - return the shared copy of s, adding it if it is new.  Returns
+ * NULL when out of memory.
+ */
+
+const char *
+intern(const char *s)
+{
+	unsigned int i;
+
+	/* keep the load factor under one half */
+	if ((intern_count + 1) * 2 > intern_size && intern_grow() != 0)
+		return NULL;
+
+	for (i = intern_hash(s) & (intern_size - 1); intern_slots[i] != NULL;
+		 i = (i + 1) & (intern_size - 1))
+	{
+		if (strcmp(intern_slots[i], s) == 0)
+			return intern_slots[i];
+	}
+
+	if ((intern_slots[i] = strdup(s)) == NULL)
+		return NULL;
+	intern_count++;
+	return intern_slots[i];
+}
+
+/*
+ * sort_key_int - turn a value into a key that sorts the same way when
+ * compared as an unsigned integer, from the largest value first if desc
+ */
+
+uint64_t
+sort_key_int(long long value, int desc)
+{
+	uint64_t	key = (uint64_t) value ^ ((uint64_t) 1 << 63);
+
+	return desc ? ~key : key;
+}
+
+/* sort_key_double - the same for a double, which must not be a NaN */
+
+uint64_t
+sort_key_double(double value, int desc)
+{
+	uint64_t	key;
+
+	/* make -0.0 and 0.0 the same key */
+	if (value == 0.0)
+		value = 0.0;
+	memcpy(&key, &value, sizeof(key));
+	key = (key >> 63) ? ~key : key ^ ((uint64_t) 1 << 63);
+
+	return desc ? ~key : key;
+}
+
+struct sort_entry
+{
+	uint64_t	key;
+	int			index;			/* into the rows being sorted */
+};
+
+/* the rows and comparison function sort_top() is currently working with */
+static void **sort_rows;
+static sort_compare_fn sort_compare;
+
+static int
+sort_entry_compare(const void *v1, const void *v2)
+{
+	const struct sort_entry *e1 = (const struct sort_entry *) v1;
+	const struct sort_entry *e2 = (const struct sort_entry *) v2;
+
+	if (e1->key != e2->key)
+		return e1->key < e2->key ? -1 : 1;
+	return sort_compare(sort_rows[e1->index], sort_rows[e2->index]);
+}
+
+#define swap_entries(a, b) \
+		do { struct sort_entry t = (a); (a) = (b); (b) = t; } while (0)
+
+/*
+ * radix_select - move the entries whose keys are among the n smallest to the
+ * front, looking at one byte of the key at a time from the top.  Entries with
+ * the same key as the n-th smallest come along too, so the number returned
+ * may be larger than n.
+ */
+
+static int
+radix_select(struct sort_entry *entries, int nentries, int n)
+{
+	int			count[256];
+	int			lo = 0,
+				hi = nentries;
+	int			shift;
+
+	/* everything before lo sorts ahead of the n-th entry, lo < n <= hi */
+	for (shift = 56; shift >= 0 && hi - lo > 1; shift -= 8)
+	{
+		int			below = lo,
+					b,
+					i,
+					lt,
+					gt;
+
+		memset(count, 0, sizeof(count));
+		for (i = lo; i < hi; i++)
+			count[(entries[i].key >> shift) & 0xff]++;
+
+		for (b = 0; below + count[b] < n; b++)
+			below += count[b];
+		if (count[b] == hi - lo)
+			continue;
+
+		/* split into the bytes below b, equal to b and above b */
+		lt = i = lo;
+		gt = hi;
+		while (i < gt)
+		{
+			int			byte = (entries[i].key >> shift) & 0xff;
+
+			if (byte < b)
+			{
+				swap_entries(entries[lt], entries[i]);
+				lt++;
+				i++;
+			}
+			else if (byte > b)
+			{
+				gt--;
+				swap_entries(entries[i], entries[gt]);
+			}
+			else
+				i++;
+		}
+		lo = lt;
+		hi = gt;
+	}
+
+	return hi;
+}
+
+/* sift_down - restore a heap that has the last entry in sort order on top */
+
+static void
+sift_down(struct sort_entry *heap, int n, int i)
+{
+	int			child;
+
+	while ((child = 2 * i + 1) < n)
+	{
+		if (child + 1 < n &&
+			sort_entry_compare(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (sort_entry_compare(&heap[child], &heap[i]) <= 0)
+			break;
+		swap_entries(heap[i], heap[child]);
+		i = child;
+	}
+}
+
+/*
+ * heap_select - leave the first n of the entries in sort order at the front,
+ * keeping a heap of the best n seen so far
+ */
+
+static void
+heap_select(struct sort_entry *entries, int nentries, int n)
+{
+	int			i;
+
+	for (i = n / 2 - 1; i >= 0; i--)
+		sift_down(entries, n, i);
+
+	for (i = n; i < nentries; i++)
+	{
+		if (sort_entry_compare(&entries[i], &entries[0]) < 0)
+		{
+			swap_entries(entries[0], entries[i]);
+			sift_down(entries, n, 0);
+		}
+	}
+
+	for (i = n - 1; i > 0; i--)
+	{
+		swap_entries(entries[0], entries[i]);
+		sift_down(entries, i, 0);
+	}
+}
+
+/*
+ * sort_top - put the first topn of nrows rows in order at the front of rows,
+ * leaving the rest behind them in no particular order.  key may be NULL.
+ */
+
+void
+sort_top(void **rows, int nrows, int topn, sort_compare_fn compare,
+		 sort_key_fn key)
+{
+	static struct sort_entry *entries;
+	static void **sorted;
+	static int	size;
+
+	int			i,
+				ncandidates;
+
+	if (topn > nrows)
+		topn = nrows;
+	if (topn <= 0 || nrows < 2)
+		return;
+
+	if (nrows > size)
+	{
+		free(entries);
+		free(sorted);
+		entries = malloc(nrows * sizeof(struct sort_entry));
+		sorted = malloc(nrows * sizeof(void *));
+		if (entries == NULL || sorted == NULL)
+		{
+			fprintf(stderr, "malloc error\n");
+			exit(1);
+		}
+		size = nrows;
+	}
+
+	for (i = 0; i < nrows; i++)
+	{
+		entries[i].key = key != NULL ? key(rows[i]) : 0;
+		entries[i].index = i;
+	}
+	sort_rows = rows;
+	sort_compare = compare;
+
+	ncandidates = nrows;
+	if (key != NULL && topn < nrows)
+		ncandidates = radix_select(entries, nrows, topn);
+
+	if (topn < ncandidates)
+		heap_select(entries, ncandidates, topn);
+	else
+		qsort(entries, ncandidates, sizeof(struct sort_entry),
+			  sort_entry_compare);
+
+	for (i = 0; i < nrows; i++)
+		sorted[i] = rows[entries[i].index];
+	memcpy(rows, sorted, nrows * sizeof(void *));
+}
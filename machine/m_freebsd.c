@@ -106,11 +106,11 @@ struct pg_proc
 	char	   *application_name;
 	char	   *client_addr;
 	char	   *repstate;
-	char	   *primary;
-	char	   *sent;
-	char	   *write;
-	char	   *flush;
-	char	   *replay;
+	uint64_t	primary;
+	uint64_t	sent;
+	uint64_t	write;
+	uint64_t	flush;
+	uint64_t	replay;
 	long long	sent_lag;
 	long long	write_lag;
 	long long	flush_lag;
@@ -506,6 +506,7 @@ get_system_info(struct system_info *si)
 
 	/* set arrays and strings */
 	si->cpustates = cpu_states;
+	si->percpu_cpustates = pcpu_cpu_states;
 	si->memory = memory_stats;
 	si->swap = swap_stats;
 
@@ -522,6 +523,40 @@ get_system_info(struct system_info *si)
 
 static struct handle handle;
 static int	show_fullcmd;
+static time_t locks_counted;	/* when pg_locks was last counted */
+
+/*
+ * count_locks - refresh the lock count of every backend from pg_locks, which
+ * is expensive on a busy server and so is not done on every sample.  A failed
+ * query leaves the counts as they were.
+ */
+
+static void
+count_locks(struct pg_conninfo_ctx *conninfo)
+{
+	PGresult   *pgresult;
+	struct pg_proc n, *p;
+	int			i;
+
+	pgresult = pg_lock_counts(conninfo);
+	if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
+	{
+		PQclear(pgresult);
+		return;
+	}
+
+	RB_FOREACH(p, pgproc, &head_proc)
+		p->locks = 0;
+	for (i = 0; i < PQntuples(pgresult); i++)
+	{
+		n.pid = pg_getint(pgresult, i, LOCK_PID);
+		p = RB_FIND(pgproc, &head_proc, &n);
+		if (p != NULL)
+			p->locks = pg_getint(pgresult, i, LOCK_COUNT);
+	}
+	PQclear(pgresult);
+	locks_counted = time(NULL);
+}
 
 caddr_t
 get_process_info(struct system_info *si,
@@ -545,24 +580,31 @@ get_process_info(struct system_info *si,
 	PGresult   *pgresult = NULL;
 	struct pg_proc *n, *p;
 
+	/* every backend is wanted; the processes are filtered on their own */
+	struct pg_sample_filter filter = {1, "", 0, 0, 0, 0, ""};
+
 	nproc = 0;
 	connect_to_db(conninfo);
 	if (conninfo->connection != NULL)
 	{
 		if (mode == MODE_REPLICATION)
 		{
-			pgresult = pg_replication(conninfo->connection);
+			pgresult = pg_replication(conninfo);
 		}
 		else
 		{
-			pgresult = pg_processes(conninfo->connection);
+			filter.width = sel->width;
+			pgresult = pg_processes(conninfo, &filter);
 		}
 		nproc = PQntuples(pgresult);
+
+		/* skip the counts of backends in each state that end the sample */
+		while (mode != MODE_REPLICATION && nproc > 0 &&
+			   PQgetisnull(pgresult, nproc - 1, PROC_PID))
+			nproc--;
 		if (nproc > onproc)
 			pbase = (struct kinfo_proc *)
 				realloc(pbase, sizeof(struct kinfo_proc) * nproc);
-
-		pgresult = pg_processes(conninfo->connection);
 	}
 
 	if (nproc > onproc)
@@ -592,7 +634,7 @@ get_process_info(struct system_info *si,
 		int			junk;
 
 		junk2 = kvm_getprocs(kd, KERN_PROC_PID,
-							 atoi(PQgetvalue(pgresult, i, 0)), &junk);
+							 pg_getint(pgresult, i, 0), &junk);
 		if (junk2 == NULL)
 		{
 			continue;
@@ -635,7 +677,7 @@ get_process_info(struct system_info *si,
 			exit(1);
 		}
 		memset(n, 0, sizeof(struct pg_proc));
-		n->pid = atoi(PQgetvalue(pgresult, i, 0));
+		n->pid = pg_getint(pgresult, i, 0);
 		p = RB_INSERT(pgproc, &head_proc, n);
 		if (p != NULL)
 		{
@@ -652,32 +694,39 @@ get_process_info(struct system_info *si,
 			update_str(&n->client_addr,
 					PQgetvalue(pgresult, i, REP_CLIENT_ADDR));
 			update_str(&n->repstate, PQgetvalue(pgresult, i, REP_STATE));
-			update_str(&n->primary,
-					PQgetvalue(pgresult, i, REP_WAL_INSERT));
-			update_str(&n->sent, PQgetvalue(pgresult, i, REP_SENT));
-			update_str(&n->write, PQgetvalue(pgresult, i, REP_WRITE));
-			update_str(&n->flush, PQgetvalue(pgresult, i, REP_FLUSH));
-			update_str(&n->replay, PQgetvalue(pgresult, i, REP_REPLAY));
-			n->sent_lag = atol(PQgetvalue(pgresult, i, REP_SENT_LAG));
-			n->write_lag = atol(PQgetvalue(pgresult, i, REP_WRITE_LAG));
-			n->flush_lag = atol(PQgetvalue(pgresult, i, REP_FLUSH_LAG));
-			n->replay_lag = atol(PQgetvalue(pgresult, i, REP_REPLAY_LAG));
+			n->primary = pg_getlsn(pgresult, i, REP_WAL_INSERT);
+			n->sent = pg_getlsn(pgresult, i, REP_SENT);
+			n->write = pg_getlsn(pgresult, i, REP_WRITE);
+			n->flush = pg_getlsn(pgresult, i, REP_FLUSH);
+			n->replay = pg_getlsn(pgresult, i, REP_REPLAY);
+			n->sent_lag = pg_getint(pgresult, i, REP_SENT_LAG);
+			n->write_lag = pg_getint(pgresult, i, REP_WRITE_LAG);
+			n->flush_lag = pg_getint(pgresult, i, REP_FLUSH_LAG);
+			n->replay_lag = pg_getint(pgresult, i, REP_REPLAY_LAG);
 		}
 		else
 		{
 			update_str(&n->name, PQgetvalue(pgresult, i, PROC_QUERY));
 			printable(n->name);
 			update_state(&n->pgstate, PQgetvalue(pgresult, i, PROC_STATE));
-			update_str(&n->usename, PQgetvalue(pgresult, i, PROC_USENAME));
-			n->xtime = atol(PQgetvalue(pgresult, i, PROC_XSTART));
-			n->qtime = atol(PQgetvalue(pgresult, i, PROC_QSTART));
-			n->locks = atoi(PQgetvalue(pgresult, i, PROC_LOCKS));
+			update_str(&n->usename,
+					   (char *) pg_role_name(conninfo,
+											 pg_getint(pgresult, i,
+													   PROC_USESYSID)));
+			n->xtime = pg_getint(pgresult, i, PROC_XSTART);
+			n->qtime = pg_getint(pgresult, i, PROC_QSTART);
+			if (sel->lock_waits)
+				n->locks = pg_getint(pgresult, i, PROC_LOCK_WAIT);
 		}
 	}
 
 	if (pgresult != NULL)
 		PQclear(pgresult);
-	disconnect_from_db(conninfo);
+
+	if (mode != MODE_REPLICATION && !sel->lock_waits &&
+		conninfo->connection != NULL &&
+		time(NULL) - locks_counted >= sel->lock_interval)
+		count_locks(conninfo);
 
 	/* if requested, sort the "interesting" processes */
 	if (compare_index >= 0 && active_procs)
@@ -694,11 +743,8 @@ get_process_info(struct system_info *si,
 	return ((caddr_t) & handle);
 }
 
-char		fmt[MAX_COLS];		/* static area where result is built */
-char		cmd[MAX_COLS];
-
 char *
-format_next_io(caddr_t handle)
+format_next_io(caddr_t handle, char *fmt)
 {
 	register struct kinfo_proc *pp;
 	struct handle *hp;
@@ -713,7 +759,7 @@ format_next_io(caddr_t handle)
 	n.pid = PP(pp, pid);
 	p = RB_FIND(pgproc, &head_proc, &n);
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			"%5d %-*.*s %6ld %6ld %6ld %6ld %6ld %6ld %s",
 			PP(pp, pid),
 			namelength, namelength,
@@ -732,14 +778,19 @@ format_next_io(caddr_t handle)
 }
 
 char *
-format_next_process(caddr_t handle)
+format_next_process(caddr_t handle, char *fmt)
 
 {
 	register struct kinfo_proc *pp;
 	register long cputime;
 	register double pct;
 	struct handle *hp;
+	char		cmd[MAX_COLS];
 	char		status[16];
+	char		size[FORMAT_SIZE];
+	char		rss[FORMAT_SIZE];
+	char		xtime[FORMAT_SIZE];
+	char		qtime[FORMAT_SIZE];
 	int			state;
 
 	struct pg_proc n, *pr = NULL;
@@ -836,16 +887,16 @@ format_next_process(caddr_t handle)
 	pr = RB_FIND(pgproc, &head_proc, &n);
 
 	/* format this entry */
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			"%5d %-*.*s %7s %6s %-6.6s %5s %5s %5.2f%% %5d %s",
 			PP(pp, pid),
 			namelength, namelength,
 			pr->usename,
-			format_k(PROCSIZE(pp)),
-			format_k(pagetok(VP(pp, rssize))),
+			format_k(PROCSIZE(pp), size),
+			format_k(pagetok(VP(pp, rssize)), rss),
 			backendstatenames[pr->pgstate],
-			format_time(pr->xtime),
-			format_time(pr->qtime),
+			format_time(pr->xtime, xtime),
+			format_time(pr->qtime, qtime),
 			100.0 * pct,
 			pr->locks,
 			pr->name);
@@ -855,12 +906,13 @@ format_next_process(caddr_t handle)
 }
 
 char *
-format_next_replication(caddr_t handle)
+format_next_replication(caddr_t handle, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
 	register struct kinfo_proc *pp;
 	struct handle *hp;
 	struct pg_proc n, *p = NULL;
+	char		lsn[5][FORMAT_SIZE];
+	char		lag[4][FORMAT_SIZE];
 
 	/* find and remember the next proc structure */
 	hp = (struct handle *) handle;
@@ -871,22 +923,22 @@ format_next_replication(caddr_t handle)
 	n.pid = PP(pp, pid);
 	p = RB_FIND(pgproc, &head_proc, &n);
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			 "%5d %-8.8s %-11.11s %15s %-9.9s %-10.10s %-10.10s %-10.10s %-10.10s %-10.10s %5s %5s %5s %5s",
 			 p->pid,
 			 p->usename,
 			 p->application_name,
 			 p->client_addr,
 			 p->repstate,
-			 p->primary,
-			 p->sent,
-			 p->write,
-			 p->flush,
-			 p->replay,
-			 format_b(p->sent_lag),
-			 format_b(p->write_lag),
-			 format_b(p->flush_lag),
-			 format_b(p->replay_lag));
+			 format_lsn(p->primary, lsn[0]),
+			 format_lsn(p->sent, lsn[1]),
+			 format_lsn(p->write, lsn[2]),
+			 format_lsn(p->flush, lsn[3]),
+			 format_lsn(p->replay, lsn[4]),
+			 format_b(p->sent_lag, lag[0]),
+			 format_b(p->write_lag, lag[1]),
+			 format_b(p->flush_lag, lag[2]),
+			 format_b(p->replay_lag, lag[3]));
 
 	/* return the result */
 	return (fmt);
@@ -17,6 +17,9 @@
  * Ported to 2.4 by William LeFebvre
  */
 
+/* for recvmmsg() */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <sys/types.h>
@@ -25,16 +28,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <bsd/stdlib.h>
-#include <bsd/sys/tree.h>
 #include <errno.h>
 #include <dirent.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
 
 #include <sys/param.h>			/* for HZ */
 
@@ -44,23 +53,8 @@
 #define PROC_SUPER_MAGIC 0x9fa0
 #endif
 
-#define BUFFERLEN 255
-#define GET_VALUE(v) \
-		p = strchr(p, ':'); \
-		++p; \
-		++p; \
-		q = strchr(p, '\n'); \
-		len = q - p; \
-		if (len >= BUFFERLEN) \
-		{ \
-			printf("ERROR - value is larger than the buffer: %d\n", __LINE__); \
-			exit(1); \
-		} \
-		strncpy(value, p, len); \
-		value[len] = '\0'; \
-		v = atoll(value);
-
 #include "machine.h"
+#include "m_linux_parse.h"
 #include "utils.h"
 
 #define PROCFS "/proc"
@@ -68,67 +62,156 @@ extern char *myname;
 
 /*=PROCESS INFORMATION==================================================*/
 
+/* Per pid files kept open between samples. */
+enum pid_file
+{
+	PIDFILE_CMDLINE,
+	PIDFILE_STAT,
+	PIDFILE_IO,
+	PIDFILE_SCHEDSTAT,
+	NPIDFILES
+};
+
+/* System wide files kept open between samples. */
+enum sys_file
+{
+	SYSFILE_LOADAVG,
+	SYSFILE_STAT,
+	SYSFILE_MEMINFO,
+	SYSFILE_VMSTAT,
+	SYSFILE_PRESSURE,			/* one for each of pressurenames */
+	SYSFILE_PRESSURE_IO,
+	SYSFILE_PRESSURE_MEMORY,
+	SYSFILE_CGROUP_CPU_STAT,	/* those of the server's cgroup, from here */
+	SYSFILE_CGROUP_CPU_MAX,
+	SYSFILE_CGROUP_MEMORY_CURRENT,
+	SYSFILE_CGROUP_MEMORY_MAX,
+	SYSFILE_CGROUP_MEMORY_STAT,
+	SYSFILE_CGROUP_MEMORY_SWAP,
+	SYSFILE_CGROUP_IO_STAT,
+	SYSFILE_CGROUP_PRESSURE,	/* one for each of pressurenames */
+	SYSFILE_CGROUP_PRESSURE_IO,
+	SYSFILE_CGROUP_PRESSURE_MEMORY,
+	NSYSFILES
+};
+
+/* Replication data, only allocated for pids shown in that mode. */
+struct top_proc_rep
+{
+	const char *application_name;	/* interned */
+	const char *client_addr;
+	const char *repstate;
+	uint64_t	primary;
+	uint64_t	sent;
+	uint64_t	write;
+	uint64_t	flush;
+	uint64_t	replay;
+};
+
 struct top_proc
 {
-	RB_ENTRY(top_proc) entry;
 	pid_t		pid;
+	int			slot;			/* row of this pid in the columns */
+
+	/* Cached descriptors for /proc/<pid>/..., -1 when not open. */
+	int			fd[NPIDFILES];
+	unsigned int generation;	/* last sample this pid was seen in */
+	struct top_proc *lru_prev;
+	struct top_proc *lru_next;
+
+	char	   *name;			/* from /proc */
+	char	   *query;			/* cut to the screen width, or NULL */
+	const char *usename;		/* interned */
+	struct top_proc_rep *rep;
+};
 
-	/* index for which element is current in data arrays */
-	int index;
+/*
+ * the command to show: the query text if it was asked for, else the name,
+ * which a pid only has once /proc has been read, after a lazy sort
+ */
+#define proc_command(p) ((p)->query != NULL ? (p)->query : \
+						 (p)->name != NULL ? (p)->name : "")
+
+/*
+ * The numbers sampled for each pid are not kept in its node but in columns,
+ * one array per value indexed by the slot of the node.  Working out the io
+ * rates or the sort keys then walks a few dense arrays instead of every node.
+ */
+
+enum io_counter
+{
+	IO_IOPS,					/* syscr + syscw */
+	IO_SYSCR,
+	IO_SYSCW,
+	IO_READ_BYTES,
+	IO_WRITE_BYTES,
+	NIOCOUNTERS
+};
 
+struct proc_columns
+{
 	/* Data from /proc/<pid>/stat. */
-	char	   *name;
-	char	   *usename;
-	unsigned long size,
-				rss;			/* in k */
-	int			state;
-	int			pgstate;
-	unsigned long time;
-	unsigned long start_time;
-	unsigned long xtime;
-	unsigned long qtime;
-	unsigned int locks;
-	double		pcpu;
-
-	/* Data from /proc/<pid>/io. */
-	long long	iops[2]; /* syscr + syscw */
-	long long	syscr[2];
-	long long	syscw[2];
-	long long	read_bytes[2];
-	long long	write_bytes[2];
-
-	/* Replication data */
-	char	   *application_name;
-	char	   *client_addr;
-	char	   *repstate;
-	char	   *primary;
-	char	   *sent;
-	char	   *write;
-	char	   *flush;
-	char	   *replay;
-	long long	sent_lag;
-	long long	write_lag;
-	long long	flush_lag;
-	long long	replay_lag;
+	unsigned long *size;		/* in k */
+	unsigned long *rss;			/* in k */
+	int		   *state;
+	unsigned long *time;
+	unsigned long *start_time;
+	double	   *pcpu;
+	double	   *read_at;		/* ticks since boot when last read */
+	double	   *elapsed;		/* ticks between the last two reads */
+
+	/*
+	 * Data from /proc/<pid>/schedstat: nanoseconds on the cpu and waiting on
+	 * a run queue, and the share of the time spent waiting.  When there is
+	 * no schedstat, pcpu comes from the ticks in stat instead.
+	 */
+	char	   *schedstat;		/* whether it was read in the last sample */
+	unsigned long long *run_ns;
+	unsigned long long *wait_ns;
+	double	   *prqwait;
+
+	/* Nanoseconds spent waiting on block io, and their share. */
+	unsigned long long *blkio;
+	double	   *piowait;
+
+	/* Data from the database. */
+	int		   *pgstate;
+	unsigned long *xtime;
+	unsigned long *qtime;
+	unsigned int *locks;
+	long long  *sent_lag;
+	long long  *write_lag;
+	long long  *flush_lag;
+	long long  *replay_lag;
+
+	/* Data from /proc/<pid>/io: this sample, the one before and the change. */
+	long long  *io[NIOCOUNTERS];
+	long long  *io_last[NIOCOUNTERS];
+	long long  *io_diff[NIOCOUNTERS];
 };
 
-int			topproccmp(struct top_proc *, struct top_proc *);
+static struct proc_columns col;
+static int	nslots;				/* length of every column */
+static int *free_slots;			/* slots not in use */
+static int	nfree_slots;
 
-RB_HEAD(pgproc, top_proc) head_proc = RB_INITIALIZER(&head_proc);
-RB_PROTOTYPE(pgproc, top_proc, entry, topproccmp)
-RB_GENERATE(pgproc, top_proc, entry, topproccmp)
+static struct pid_hash proc_hash = PID_HASH_INITIALIZER;
 
 double		timediff;
 
 /*=STATE IDENT STRINGS==================================================*/
 
-#define NCPUSTATES 5
+/* the columns of the cpu lines of /proc/stat, as many as the kernel has */
+#define NCPUSTATES 10
+#define CPUGUEST		8
+#define CPUGUESTNICE	9
 static char *cpustatenames[NCPUSTATES + 1] =
 {
-	"user", "nice", "system", "idle", "iowait",
+	"user", "nice", "system", "idle", "iowait", "irq", "softirq", "steal",
+	"guest", "guest_nice",
 	NULL
 };
-static int	show_iowait = 0;
+static int	ncpustates = NCPUSTATES;
 
 #define MEMUSED    0
 #define MEMFREE    1
@@ -156,6 +239,53 @@ static char *swapnames[NSWAPSTATS + 1] =
 	"K used, ", "K free, ", "K cached, ", "K in, ", "K out", NULL
 };
 
+/* /proc/pressure has the time some and all tasks stalled on each of these */
+#define NPRESSURE 3
+static char *pressurenames[NPRESSURE + 1] =
+{
+	"cpu", "io", "memory",
+	NULL
+};
+static int	show_pressure = 0;
+
+/*
+ * The figures of the cgroup the postmaster is in, each line in turn and then
+ * its pressure like that of the host
+ */
+enum cgroup_stat
+{
+	CGROUP_CPU_USED,
+	CGROUP_CPU_MAX,
+	CGROUP_CPU_PERIODS_THROTTLED,
+	CGROUP_CPU_TIME_THROTTLED,
+	CGROUP_MEMORY_USED,
+	CGROUP_MEMORY_MAX,
+	CGROUP_MEMORY_ANON,
+	CGROUP_MEMORY_FILE,
+	CGROUP_MEMORY_SWAP,
+	CGROUP_IO_READ,
+	CGROUP_IO_WRITTEN,
+	CGROUP_IO_READS,
+	CGROUP_IO_WRITES,
+	CGROUP_PRESSURE,
+	NCGROUPSTATS = CGROUP_PRESSURE + NPRESSURE * 2
+};
+static char *cgroupcpunames[] =
+{
+	"% used, ", "% max, ", "% periods throttled, ", "% time throttled",
+	NULL
+};
+static char *cgroupmemorynames[] =
+{
+	"K used, ", "K max, ", "K anon, ", "K file, ", "K swap",
+	NULL
+};
+static char *cgroupionames[] =
+{
+	"K read, ", "K written, ", " reads, ", " writes",
+	NULL
+};
+
 struct swap_t
 {
 	int index;
@@ -164,22 +294,24 @@ struct swap_t
 } swap_activity;
 
 static char fmt_header[] =
-"    PID X           SIZE   RES STATE   XTIME  QTIME  %CPU LOCKS COMMAND";
+"    PID X           SIZE   RES STATE   XTIME  QTIME  %CPU %RQWAIT %IOWAIT LOCKS COMMAND";
 
 char		fmt_header_io[] =
-"    PID  IOPS   IORPS   IOWPS READS WRITES COMMAND";
+"    PID  IOPS   IORPS   IOWPS READS WRITES %IOWAIT COMMAND";
 
 /* these are names given to allowed sorting orders -- first is default */
 static char *ordernames[] =
 {
 	"cpu", "size", "res", "xtime", "qtime", "iops", "iorps", "iowps", "reads",
-	"writes", "locks", "command", "flag", "rlag", "slag", "wlag", NULL
+	"writes", "locks", "command", "flag", "rlag", "slag", "wlag", "rqwait",
+	"iowait", NULL
 };
 
 /* forward definitions for comparison functions */
 static int	compare_cmd(const void *, const void *);
 static int	compare_cpu(const void *, const void *);
 static int	compare_iops(const void *, const void *);
+static int	compare_iowait(const void *, const void *);
 static int	compare_lag_flush(const void *, const void *);
 static int	compare_lag_replay(const void *, const void *);
 static int	compare_lag_sent(const void *, const void *);
@@ -188,6 +320,7 @@ static int	compare_locks(const void *, const void *);
 static int	compare_qtime(const void *, const void *);
 static int	compare_reads(const void *, const void *);
 static int	compare_res(const void *, const void *);
+static int	compare_rqwait(const void *, const void *);
 static int	compare_size(const void *, const void *);
 static int	compare_syscr(const void *, const void *);
 static int	compare_syscw(const void *, const void *);
@@ -212,6 +345,8 @@ int			(*proc_compares[]) () =
 		compare_lag_replay,
 		compare_lag_sent,
 		compare_lag_write,
+		compare_rqwait,
+		compare_iowait,
 		NULL
 };
 
@@ -223,21 +358,154 @@ static int64_t cp_time[NCPUSTATES];
 static int64_t cp_old[NCPUSTATES];
 static int64_t cp_diff[NCPUSTATES];
 
+/* the same for each cpu, ncpustates apart */
+static int	ncpus;
+static int64_t *pcpu_cp_time;
+static int64_t *pcpu_cp_old;
+static int64_t *pcpu_cp_diff;
+static int64_t *pcpu_cpu_states;
+
+/* /proc/stat up to the end of the cpu lines, at least */
+static char *stat_buffer;
+static size_t stat_buffer_size;
+
+/* the stall totals in microseconds at the last sample, some then full */
+static uint64_t pressure_total[NPRESSURE * 2];
+static struct timespec pressure_time;
+
+/* where the cgroup v2 hierarchy is mounted if it is, and the cgroup on top */
+static char cgroup_mount[PATH_MAX];
+static char cgroup_mount_root[PATH_MAX];
+static pid_t cgroup_backend;	/* the backend it was last looked up from */
+static int	cgroup_found;
+
+/* the counters of the cgroup at the last sample, -1 before the first */
+enum cgroup_counter
+{
+	CGROUP_USAGE_USEC,
+	CGROUP_NR_PERIODS,
+	CGROUP_NR_THROTTLED,
+	CGROUP_THROTTLED_USEC,
+	CGROUP_RBYTES,
+	CGROUP_WBYTES,
+	CGROUP_RIOS,
+	CGROUP_WIOS,
+	NCGROUPCOUNTERS
+};
+static int64_t cgroup_counters[NCGROUPCOUNTERS];
+static uint64_t cgroup_pressure_total[NPRESSURE * 2];
+static struct timespec cgroup_time;
+
 /* for calculating the exponential average */
 
-static struct timeval lasttime;
+static struct timespec lasttime;
 
 /* these are for keeping track of processes */
 
 #define INITIAL_ACTIVE_SIZE  (256)
 #define PROCBLOCK_SIZE		 (32)
-static struct top_proc *pgtable;
+static void **pgtable;			/* the nodes to display, in order */
 static int	proc_index;
+static int	last_mode = -1;		/* mode of the last sample taken */
+static char sampled_at[64];		/* server time of the last sample */
+static int	sent_width = -1;	/* query width asked for in it */
+static time_t locks_counted;	/* when pg_locks was last counted, on
+								 * CLOCK_MONOTONIC */
 static time_t boottime = -1;
 
+/*
+ * Descriptors for the files under /proc are opened once and re-read with
+ * pread() on every sample.  Every pid we know about is kept on a list in the
+ * order it was last sampled, so the ones that have gone away collect at the
+ * tail where they are reaped before the next read.  Whatever is left of
+ * RLIMIT_NOFILE after that bounds the number of descriptors kept open.
+ */
+
+/* descriptors we leave for libpq, the terminal and everything else */
+#define FD_RESERVE	64
+
+static char *pidfilenames[NPIDFILES] = {"cmdline", "stat", "io", "schedstat"};
+static char *sysfilenames[NSYSFILES] = {"loadavg", "stat", "meminfo", "vmstat",
+"pressure/cpu", "pressure/io", "pressure/memory"};
+static int	sysfd[NSYSFILES] = {-1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+
+/* the cgroup files in turn, found under the directory of the cgroup */
+static char *cgroupfilenames[] = {"cpu.stat", "cpu.max", "memory.current",
+	"memory.max", "memory.stat", "memory.swap.current", "io.stat",
+"cpu.pressure", "io.pressure", "memory.pressure", NULL};
+
+static struct top_proc *lru_head;
+static struct top_proc *lru_tail;
+static int	pidfd_count;
+static int	pidfd_max;
+static unsigned int generation;
+static pthread_mutex_t pidfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct node_pool proc_pool = NODE_POOL_INITIALIZER(struct top_proc);
+
+/*
+ * The /proc files of the backends can be read by a pool of collector threads,
+ * each taking a contiguous share of the sample.  The calling thread does the
+ * first share itself.
+ */
+
+#define MAX_COLLECTORS	64
+
+struct collect_job
+{
+	struct top_proc **work;
+	int			nwork;
+	int			nshards;
+	struct process_select *sel;
+	double		tickdiff;
+	double		uptime;			/* ticks since boot */
+};
+
+static pthread_t collectors[MAX_COLLECTORS];
+static int	ncollectors = 1;
+static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t collect_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t collect_done = PTHREAD_COND_INITIALIZER;
+static unsigned int collect_round;
+static int	collect_pending;
+static struct collect_job job;
+static struct top_proc **workset;
+static int	workset_size;
+
+/*
+ * Where the kernel has the TASKSTATS generic netlink family, the cpu, delay
+ * and io counters of each pid come from it as one binary struct.  They are
+ * asked for in batches over a socket per collector thread, instead of
+ * reading and parsing /proc/<pid>/schedstat and io.  Asking for a pid takes
+ * CAP_NET_ADMIN; without it, or without the family, those files are read as
+ * before.
+ */
+
+#define TASKSTATS_BATCH	32
+
+struct taskstats_conn
+{
+	int			fd;				/* -1 until opened */
+	int			size;			/* of stats and found */
+	struct taskstats *stats;	/* for each pid of the shard */
+	char	   *found;			/* whether stats has an answer */
+	char	   *answers;		/* room to receive a batch */
+};
+
+#define TASKSTATS_ANSWER_SIZE	1024
+
+static int	taskstats_family;	/* 0 when it cannot be used */
+static struct taskstats_conn taskstats_conns[MAX_COLLECTORS];
+
+static void taskstats_init();
+static int *missing;			/* pids whose query text was not sent */
+
 /* these are for passing data back to the machine independant portion */
 
 static int64_t cpu_states[NCPUSTATES];
+static int64_t pressure_stats[NPRESSURE * 2];
+static int64_t cgroup_stats[NCGROUPSTATS];
 static int	process_states[NPROCSTATES];
 static long memory_stats[NMEMSTATS];
 static long swap_stats[NSWAPSTATS];
@@ -249,7 +517,7 @@ static long swap_stats[NSWAPSTATS];
 /*======================================================================*/
 
 static inline long long
-diff_stat(long long value[2], int index)
+diff_stat(const long long value[2], int index)
 {
 	return value[index] - value[(index + 1) % 2];
 }
@@ -272,509 +540,1891 @@ skip_token(const char *p)
 	return (char *) p;
 }
 
-int
-topproccmp(struct top_proc *e1, struct top_proc *e2)
+/*
+ * meminfo_value - read the number following a "Name:" of keylen characters at
+ * the start of line p in /proc/meminfo
+ */
+
+static inline unsigned long
+meminfo_value(const char *p, const char *end, int keylen)
 {
-	return (e1->pid < e2->pid ? -1 : e1->pid > e2->pid);
+	unsigned long long value;
+
+	p += keylen;
+	if (scan_number(&p, end, &value) != 0)
+		return 0;
+	return value;
 }
 
+/*
+ * pidfd_init - size the descriptor cache from RLIMIT_NOFILE, raising the soft
+ * limit as far as the hard limit allows.
+ */
+
 static void
-xfrm_cmdline(char *p, int len)
+pidfd_init()
 {
-	while (--len > 0)
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
 	{
-		if (*p == '\0')
-		{
-			*p = ' ';
-		}
-		p++;
+		pidfd_max = 0;
+		return;
+	}
+
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			getrlimit(RLIMIT_NOFILE, &rl);
 	}
+
+	if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+		pidfd_max = INT_MAX - FD_RESERVE;
+	else if (rl.rlim_cur > FD_RESERVE)
+		pidfd_max = rl.rlim_cur - FD_RESERVE;
+	else
+		pidfd_max = 0;
 }
 
-int
-machine_init(struct statics *statics)
+static void
+lru_unlink(struct top_proc *proc)
 {
-	/* make sure the proc filesystem is mounted */
-	{
-		struct statfs sb;
+	if (proc->lru_prev != NULL)
+		proc->lru_prev->lru_next = proc->lru_next;
+	else
+		lru_head = proc->lru_next;
+	if (proc->lru_next != NULL)
+		proc->lru_next->lru_prev = proc->lru_prev;
+	else
+		lru_tail = proc->lru_prev;
+	proc->lru_prev = proc->lru_next = NULL;
+}
 
-		if (statfs(PROCFS, &sb) < 0 || sb.f_type != PROC_SUPER_MAGIC)
-		{
-			fprintf(stderr, "%s: proc filesystem not mounted on " PROCFS "\n",
-					myname);
-			return -1;
-		}
+/* lru_touch - move proc to the head of the list, marking it as seen */
+
+static void
+lru_touch(struct top_proc *proc)
+{
+	proc->generation = generation;
+	if (lru_head == proc)
+		return;
+	if (proc->lru_prev != NULL || lru_tail == proc)
+		lru_unlink(proc);
+	proc->lru_next = lru_head;
+	if (lru_head != NULL)
+		lru_head->lru_prev = proc;
+	lru_head = proc;
+	if (lru_tail == NULL)
+		lru_tail = proc;
+}
+
+/* pidfd_release - close one descriptor, caller holds pidfd_lock */
+
+static void
+pidfd_release(struct top_proc *proc, int which)
+{
+	if (proc->fd[which] != -1)
+	{
+		close(proc->fd[which]);
+		proc->fd[which] = -1;
+		pidfd_count--;
 	}
+}
 
-	/* chdir to the proc filesystem to make things easier */
-	chdir(PROCFS);
+/* pidfd_drop - close everything held for proc, caller holds pidfd_lock */
 
-	/* a few preliminary checks */
+static void
+pidfd_drop(struct top_proc *proc)
+{
+	int			i;
+
+	for (i = 0; i < NPIDFILES; i++)
+		pidfd_release(proc, i);
+}
+
+static void
+pidfd_close(struct top_proc *proc, int which)
+{
+	pthread_mutex_lock(&pidfd_lock);
+	pidfd_release(proc, which);
+	pthread_mutex_unlock(&pidfd_lock);
+}
+
+/* pidfd_evict - close every descriptor held for proc */
+
+static void
+pidfd_evict(struct top_proc *proc)
+{
+	pthread_mutex_lock(&pidfd_lock);
+	pidfd_drop(proc);
+	pthread_mutex_unlock(&pidfd_lock);
+}
+
+/*
+ * pidfd_read - read /proc/<pid>/<file> from the start into buffer, using the
+ * cached descriptor when there is one.  A cached descriptor that returns
+ * nothing may belong to a pid that has exited, so it is reopened once.
+ * Returns the number of bytes read, or -1.
+ *
+ * This is called from the collector threads, so only the descriptors of proc
+ * itself may be touched without holding pidfd_lock.
+ */
+
+static int
+pidfd_read(struct top_proc *proc, int which, char *buffer, size_t size)
+{
+	char		path[32];
+	int			fd;
+	int			len;
+	int			cached;
+
+	if ((fd = proc->fd[which]) != -1)
 	{
-		int			fd;
-		char		buff[128];
-		char	   *p;
-		int			cnt = 0;
-		unsigned long uptime;
-		struct timeval tv;
+		if ((len = pread(fd, buffer, size, 0)) > 0)
+			return len;
+		pidfd_close(proc, which);
+	}
 
-		/* get a boottime */
-		if ((fd = open("uptime", 0)) != -1)
-		{
-			if (read(fd, buff, sizeof(buff)) > 0)
-			{
-				uptime = strtoul(buff, &p, 10);
-				gettimeofday(&tv, 0);
-				boottime = tv.tv_sec - uptime;
-			}
-			close(fd);
-		}
+	/*
+	 * Pids that have gone away were reaped before the read started, so if
+	 * we are out of descriptors the file is read without caching one.
+	 */
+	pthread_mutex_lock(&pidfd_lock);
+	if ((cached = pidfd_count < pidfd_max))
+		pidfd_count++;
+	pthread_mutex_unlock(&pidfd_lock);
+
+	snprintf(path, sizeof(path), "%d/%s", proc->pid, pidfilenames[which]);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		len = -1;
+	else
+		len = pread(fd, buffer, size, 0);
 
-		/* see how many states we get from stat */
-		if ((fd = open("stat", 0)) != -1)
-		{
-			if (read(fd, buff, sizeof(buff)) > 0)
-			{
-				if ((p = strchr(buff, '\n')) != NULL)
-				{
-					*p = '\0';
-					p = buff;
-					cnt = 0;
-					while (*p != '\0')
-					{
-						if (*p++ == ' ')
-						{
-							cnt++;
-						}
-					}
-				}
-			}
+	if (cached && len > 0)
+	{
+		proc->fd[which] = fd;
+		return len;
+	}
 
-			close(fd);
-		}
-		if (cnt > 5)
-		{
-			/* we have iowait */
-			show_iowait = 1;
-		}
+	if (fd != -1)
+		close(fd);
+	if (cached)
+	{
+		pthread_mutex_lock(&pidfd_lock);
+		pidfd_count--;
+		pthread_mutex_unlock(&pidfd_lock);
 	}
+	return len;
+}
+
+/* sysfd_read - like pidfd_read for the system wide files */
 
-	/* if we aren't showing iowait, then we have to tweak cpustatenames */
-	if (!show_iowait)
+static int
+sysfd_read(int which, char *buffer, size_t size)
+{
+	int			len;
+
+	/* the cgroup files that are not there have no name */
+	if (sysfilenames[which] == NULL)
+		return -1;
+	if (sysfd[which] == -1 &&
+		(sysfd[which] = open(sysfilenames[which], O_RDONLY)) == -1)
+		return -1;
+
+	if ((len = pread(sysfd[which], buffer, size, 0)) < 0)
 	{
-		cpustatenames[4] = NULL;
+		close(sysfd[which]);
+		sysfd[which] = -1;
 	}
+	return len;
+}
 
-	/* fill in the statics information */
-	statics->procstate_names = procstatenames;
-	statics->cpustate_names = cpustatenames;
-	statics->memory_names = memorynames;
-	statics->swap_names = swapnames;
-	statics->order_names = ordernames;
-	statics->boottime = boottime;
-	statics->flags.fullcmds = 1;
-	statics->flags.warmup = 1;
+/*
+ * slots_grow - double the length of the columns.  The new slots go on the
+ * free list.  Returns -1 when out of memory.
+ */
 
-	/* all done! */
+#define GROW_COLUMN(column) \
+	do { \
+		void	   *p = realloc((column), newsize * sizeof(*(column))); \
+\
+		if (p == NULL) \
+			return -1; \
+		(column) = p; \
+	} while (0)
+
+static int
+slots_grow()
+{
+	int			newsize = nslots == 0 ? INITIAL_ACTIVE_SIZE : nslots * 2;
+	int			c,
+				i;
+
+	GROW_COLUMN(col.size);
+	GROW_COLUMN(col.rss);
+	GROW_COLUMN(col.state);
+	GROW_COLUMN(col.time);
+	GROW_COLUMN(col.start_time);
+	GROW_COLUMN(col.pcpu);
+	GROW_COLUMN(col.read_at);
+	GROW_COLUMN(col.elapsed);
+	GROW_COLUMN(col.schedstat);
+	GROW_COLUMN(col.run_ns);
+	GROW_COLUMN(col.wait_ns);
+	GROW_COLUMN(col.prqwait);
+	GROW_COLUMN(col.blkio);
+	GROW_COLUMN(col.piowait);
+	GROW_COLUMN(col.pgstate);
+	GROW_COLUMN(col.xtime);
+	GROW_COLUMN(col.qtime);
+	GROW_COLUMN(col.locks);
+	GROW_COLUMN(col.sent_lag);
+	GROW_COLUMN(col.write_lag);
+	GROW_COLUMN(col.flush_lag);
+	GROW_COLUMN(col.replay_lag);
+	for (c = 0; c < NIOCOUNTERS; c++)
+	{
+		GROW_COLUMN(col.io[c]);
+		GROW_COLUMN(col.io_last[c]);
+		GROW_COLUMN(col.io_diff[c]);
+	}
+	GROW_COLUMN(free_slots);
+
+	/* hand out the lowest slots first */
+	for (i = newsize - 1; i >= nslots; i--)
+		free_slots[nfree_slots++] = i;
+	nslots = newsize;
 	return 0;
 }
 
-void
-get_system_info(struct system_info *info)
+/* slot_alloc - take a free slot and clear it, -1 when out of memory */
+
+static int
+slot_alloc()
 {
-	char		buffer[4096 + 1];
-	int			fd,
-				len;
-	char	   *p;
+	int			slot;
+	int			c;
+
+	if (nfree_slots == 0 && slots_grow() != 0)
+		return -1;
+	slot = free_slots[--nfree_slots];
+
+	col.size[slot] = 0;
+	col.rss[slot] = 0;
+	col.state[slot] = 0;
+	col.time[slot] = 0;
+	col.start_time[slot] = 0;
+	col.pcpu[slot] = 0;
+	col.read_at[slot] = 0;
+	col.elapsed[slot] = 0;
+	col.schedstat[slot] = 0;
+	col.run_ns[slot] = 0;
+	col.wait_ns[slot] = 0;
+	col.prqwait[slot] = 0;
+	col.blkio[slot] = 0;
+	col.piowait[slot] = 0;
+	col.pgstate[slot] = 0;
+	col.xtime[slot] = 0;
+	col.qtime[slot] = 0;
+	col.locks[slot] = 0;
+	col.sent_lag[slot] = 0;
+	col.write_lag[slot] = 0;
+	col.flush_lag[slot] = 0;
+	col.replay_lag[slot] = 0;
+	for (c = 0; c < NIOCOUNTERS; c++)
+	{
+		col.io[c][slot] = 0;
+		col.io_last[c][slot] = 0;
+		col.io_diff[c][slot] = 0;
+	}
+	return slot;
+}
 
-	/* get load averages */
+/*
+ * count_locks - refresh the lock count of each of the rows backends in the
+ * workset from pg_locks.  Between refreshes a backend keeps the count it was
+ * last given; a failed query leaves them all as they were.  now is the time
+ * of the sample, on the monotonic clock that it is compared on.
+ */
 
-	if ((fd = open("loadavg", O_RDONLY)) != -1)
+static void
+count_locks(struct pg_conninfo_ctx *conninfo, int rows, time_t now)
+{
+	PGresult   *pgresult;
+	struct top_proc *n;
+	int			i;
+
+	pgresult = pg_lock_counts(conninfo);
+	if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
 	{
-		if ((len = read(fd, buffer, sizeof(buffer) - 1)) > 0)
-		{
-			buffer[len] = '\0';
-			info->load_avg[0] = strtod(buffer, &p);
-			info->load_avg[1] = strtod(p, &p);
-			info->load_avg[2] = strtod(p, &p);
-			p = skip_token(p);	/* skip running/tasks */
-			p = skip_ws(p);
-			if (*p)
-			{
-				info->last_pid = atoi(p);
-			}
-			else
-			{
-				info->last_pid = -1;
-			}
-		}
-		close(fd);
+		PQclear(pgresult);
+		return;
 	}
 
-	/* get the cpu time info */
-	if ((fd = open("stat", O_RDONLY)) != -1)
+	for (i = 0; i < rows; i++)
+		col.locks[workset[i]->slot] = 0;
+	for (i = 0; i < PQntuples(pgresult); i++)
 	{
-		if ((len = read(fd, buffer, sizeof(buffer) - 1)) > 0)
-		{
-			buffer[len] = '\0';
-			p = skip_token(buffer); /* "cpu" */
-			cp_time[0] = strtoul(p, &p, 0);
-			cp_time[1] = strtoul(p, &p, 0);
-			cp_time[2] = strtoul(p, &p, 0);
-			cp_time[3] = strtoul(p, &p, 0);
-			if (show_iowait)
-			{
-				cp_time[4] = strtoul(p, &p, 0);
-			}
+		n = pid_hash_lookup(&proc_hash, pg_getint(pgresult, i, LOCK_PID));
+		if (n != NULL)
+			col.locks[n->slot] = pg_getint(pgresult, i, LOCK_COUNT);
+	}
+	PQclear(pgresult);
+	locks_counted = now;
+}
 
-			/* convert cp_time counts to percentages */
-			percentages(NCPUSTATES, cpu_states, cp_time, cp_old, cp_diff);
+/*
+ * fetch_query_texts - get the query text of the nmissing pids in missing,
+ * which the sample left out because it had not changed.  After a failed
+ * query they are asked for again with the next sample.
+ */
+static void
+fetch_query_texts(struct pg_conninfo_ctx *conninfo, int nmissing, int width)
+{
+	PGresult   *pgresult;
+	struct top_proc *n;
+	int			i;
+
+	pgresult = pg_query_texts(conninfo, missing, nmissing, width);
+	if (PQresultStatus(pgresult) == PGRES_TUPLES_OK)
+	{
+		for (i = 0; i < PQntuples(pgresult); i++)
+		{
+			n = pid_hash_lookup(&proc_hash, pg_getint(pgresult, i, 0));
+			if (n != NULL)
+				update_str(&n->query, PQgetvalue(pgresult, i, 1));
 		}
-		close(fd);
 	}
+	PQclear(pgresult);
+}
 
-	/* get system wide memory usage */
-	if ((fd = open("meminfo", O_RDONLY)) != -1)
-	{
-		char	   *p;
-		int			mem = 0;
-		int			swap = 0;
-		unsigned long memtotal = 0;
-		unsigned long memfree = 0;
-		unsigned long swaptotal = 0;
+/*
+ * reap_procs - forget every pid that is not part of the current sample,
+ * returning its node to the pool
+ */
 
-		if ((len = read(fd, buffer, sizeof(buffer) - 1)) > 0)
-		{
-			buffer[len] = '\0';
-			p = buffer - 1;
+static void
+reap_procs()
+{
+	struct top_proc *n;
 
-			/* iterate thru the lines */
-			while (p != NULL)
-			{
-				p++;
-				if (p[0] == ' ' || p[0] == '\t')
-				{
-					/* skip */
-				}
-				else if (strncmp(p, "Mem:", 4) == 0)
+	while ((n = lru_tail) != NULL && n->generation != generation)
+	{
+		pidfd_drop(n);
+		lru_unlink(n);
+		pid_hash_remove(&proc_hash, n->pid);
+
+		free(n->name);
+		free(n->query);
+		free(n->rep);
+		free_slots[nfree_slots++] = n->slot;
+		pool_free(&proc_pool, n);
+	}
+}
+
+static void
+xfrm_cmdline(char *p, int len)
+{
+	while (--len > 0)
+	{
+		if (*p == '\0')
+		{
+			*p = ' ';
+		}
+		p++;
+	}
+}
+
+/*
+ * stat_init - see how many cpu states the kernel accounts in /proc/stat,
+ * and make room for a line of them for each cpu.  Returns -1 when out of
+ * memory.
+ */
+
+static int
+stat_init()
+{
+	char		buff[512];
+	char	   *p;
+	char	   *q;
+	int			fd;
+	int			len;
+	int			cnt = 0;
+
+	if ((fd = open("stat", O_RDONLY)) != -1)
+	{
+		if ((len = read(fd, buff, sizeof(buff) - 1)) > 0)
+		{
+			buff[len] = '\0';
+			p = skip_token(buff);	/* "cpu" */
+			while (cnt < NCPUSTATES)
+			{
+				strtoull(p, &q, 10);
+				if (q == p)
+					break;
+				p = q;
+				cnt++;
+			}
+		}
+		close(fd);
+	}
+
+	/* every kernel has had user, nice, system and idle */
+	if (cnt < 4)
+		cnt = 4;
+	ncpustates = cnt;
+	cpustatenames[cnt] = NULL;
+
+	/* offline cpus have no line, but keep their place */
+	if ((ncpus = sysconf(_SC_NPROCESSORS_CONF)) < 0)
+		ncpus = 0;
+	pcpu_cp_time = calloc(ncpus * ncpustates + 1, sizeof(int64_t));
+	pcpu_cp_old = calloc(ncpus * ncpustates + 1, sizeof(int64_t));
+	pcpu_cp_diff = calloc(ncpus * ncpustates + 1, sizeof(int64_t));
+	pcpu_cpu_states = calloc(ncpus * ncpustates + 1, sizeof(int64_t));
+
+	/* a cpu line takes well under 256 bytes even with every counter huge */
+	stat_buffer_size = (ncpus + 1) * 256;
+	if (stat_buffer_size < 4096)
+		stat_buffer_size = 4096;
+	stat_buffer = malloc(stat_buffer_size + 1);
+
+	if (pcpu_cp_time == NULL || pcpu_cp_old == NULL ||
+		pcpu_cp_diff == NULL || pcpu_cpu_states == NULL ||
+		stat_buffer == NULL)
+		return -1;
+	return 0;
+}
+
+/*
+ * read_pressure - read the stall totals from the pressure file which, of
+ * /proc/pressure or of a cgroup, into totals, and its averages over the last
+ * 10 seconds in tenths of a percent into avg10, some and then full.  Those
+ * that the kernel does not have, such as full for cpu before 5.13, are left
+ * at -1.  Returns -1 when the file cannot be read, as without PSI or with it
+ * turned off.
+ */
+
+static int
+read_pressure(int which, uint64_t * totals, int64_t * avg10)
+{
+	char		buffer[256];
+	char	   *p;
+	char	   *q;
+	int			len;
+	int			j;
+
+	if ((len = sysfd_read(which, buffer, sizeof(buffer) - 1)) <= 0)
+		return -1;
+	buffer[len] = '\0';
+
+	avg10[0] = avg10[1] = -1;
+	for (p = buffer; *p != '\0'; p = q)
+	{
+		/* "some avg10=1.23 avg60=1.23 avg300=1.23 total=123456" */
+		if ((q = strchr(p, '\n')) != NULL)
+			*q++ = '\0';
+		else
+			q = p + strlen(p);
+		j = strncmp(p, "full", 4) == 0;
+		if ((p = strstr(p, "avg10=")) == NULL)
+			continue;
+		avg10[j] = (int64_t) (strtod(p + 6, NULL) * 10 + 0.5);
+		if ((p = strstr(p, "total=")) != NULL)
+			totals[j] = strtoull(p + 6, NULL, 10);
+	}
+	return 0;
+}
+
+/*
+ * sample_pressure - set stats to the share of the elapsed microseconds that
+ * tasks stalled on each resource, from the pressure files starting at which
+ * and the totals of the last sample, or to the kernel's own averages when
+ * there was no last sample
+ */
+
+static void
+sample_pressure(int which, uint64_t * total, int64_t * stats, double elapsed)
+{
+	uint64_t	totals[2];
+	int64_t		avg10[2];
+	int			i;
+	int			j;
+
+	for (i = 0; i < NPRESSURE * 2; i += 2)
+	{
+		totals[0] = total[i];
+		totals[1] = total[i + 1];
+		if (read_pressure(which + i / 2, totals, avg10) == -1)
+		{
+			stats[i] = stats[i + 1] = -1;
+			continue;
+		}
+		for (j = 0; j < 2; j++)
+		{
+			if (avg10[j] < 0 || elapsed <= 0)
+				stats[i + j] = avg10[j];
+			else
+				stats[i + j] = (int64_t)
+					((totals[j] - total[i + j]) * 1000 / elapsed + 0.5);
+			if (stats[i + j] > 1000)
+				stats[i + j] = 1000;
+			total[i + j] = totals[j];
+		}
+	}
+}
+
+/*
+ * cgroup_init - find where the cgroup v2 hierarchy is mounted, if it is, as
+ * the figures of the server's cgroup can only be shown from there
+ */
+
+static void
+cgroup_init()
+{
+	FILE	   *fp;
+	char		line[PATH_MAX * 2 + 256];
+	char		format[64];
+
+	if ((fp = fopen("self/mountinfo", "r")) == NULL)
+		return;
+
+	/* "36 25 0:30 / /sys/fs/cgroup rw,nosuid - cgroup2 cgroup2 rw" */
+	snprintf(format, sizeof(format), "%%*d %%*d %%*s %%%ds %%%ds",
+			 PATH_MAX - 1, PATH_MAX - 1);
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (strstr(line, " - cgroup2 ") != NULL &&
+			sscanf(line, format, cgroup_mount_root, cgroup_mount) == 2)
+			break;
+	}
+	fclose(fp);
+}
+
+/*
+ * read_file - read up to size - 1 bytes of the file name into buffer, and
+ * end them with a null.  Returns the number read, or -1.
+ */
+
+static int
+read_file(const char *name, char *buffer, size_t size)
+{
+	int			fd;
+	int			len;
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		return -1;
+	len = read(fd, buffer, size - 1);
+	close(fd);
+	if (len >= 0)
+		buffer[len] = '\0';
+	return len;
+}
+
+/*
+ * cgroup_find - point the cgroup files at those of the cgroup that the
+ * postmaster, the parent of backend, is in.  Returns -1 when it is in none
+ * that can be seen from here.
+ */
+
+static int
+cgroup_find(pid_t backend)
+{
+	char		buffer[4096];
+	char		path[PATH_MAX * 2];
+	char	   *p;
+	char	   *q;
+	size_t		len;
+	int			postmaster;
+	int			i;
+
+	/* the parent follows the command, which may have spaces in it */
+	snprintf(path, sizeof(path), "%d/stat", (int) backend);
+	if (read_file(path, buffer, sizeof(buffer)) <= 0 ||
+		(p = strrchr(buffer, ')')) == NULL ||
+		sscanf(p + 1, " %*c %d", &postmaster) != 1)
+		return -1;
+
+	/* the hierarchy of cgroup v2 is the one numbered 0 */
+	snprintf(path, sizeof(path), "%d/cgroup", postmaster);
+	if (read_file(path, buffer, sizeof(buffer)) <= 0)
+		return -1;
+	for (p = buffer; strncmp(p, "0::", 3) != 0; p = q + 1)
+		if ((q = strchr(p, '\n')) == NULL)
+			return -1;
+	p += 3;
+	if ((q = strchr(p, '\n')) != NULL)
+		*q = '\0';
+
+	/* it has to be below the top of what is mounted */
+	len = strlen(cgroup_mount_root);
+	if (strcmp(cgroup_mount_root, "/") != 0)
+	{
+		if (strncmp(p, cgroup_mount_root, len) != 0 ||
+			(p[len] != '/' && p[len] != '\0'))
+			return -1;
+		p += len;
+	}
+	if (strstr(p, "/..") != NULL)
+		return -1;
+	if (strcmp(p, "/") == 0)
+		p++;
+
+	/* only the files that are there are read */
+	for (i = 0; cgroupfilenames[i] != NULL; i++)
+	{
+		q = sysfilenames[SYSFILE_CGROUP_CPU_STAT + i];
+		if (sysfd[SYSFILE_CGROUP_CPU_STAT + i] != -1)
+		{
+			close(sysfd[SYSFILE_CGROUP_CPU_STAT + i]);
+			sysfd[SYSFILE_CGROUP_CPU_STAT + i] = -1;
+		}
+		free(q);
+		snprintf(path, sizeof(path), "%s%s/%s", cgroup_mount, p,
+				 cgroupfilenames[i]);
+		sysfilenames[SYSFILE_CGROUP_CPU_STAT + i] =
+			access(path, R_OK) == 0 ? strdup(path) : NULL;
+	}
+	if (sysfilenames[SYSFILE_CGROUP_CPU_STAT] == NULL)
+		return -1;
+
+	/* the rates start over */
+	for (i = 0; i < NCGROUPCOUNTERS; i++)
+		cgroup_counters[i] = -1;
+	memset(cgroup_pressure_total, 0, sizeof(cgroup_pressure_total));
+	memset(&cgroup_time, 0, sizeof(cgroup_time));
+	return 0;
+}
+
+/*
+ * cgroup_value - the number after key on a line of buffer, as in cpu.stat and
+ * memory.stat, or -1 if there is none
+ */
+
+static int64_t
+cgroup_value(const char *buffer, const char *key)
+{
+	const char *p = buffer;
+	size_t		len = strlen(key);
+
+	for (;;)
+	{
+		if (strncmp(p, key, len) == 0 && p[len] == ' ')
+			return strtoll(p + len + 1, NULL, 10);
+		if ((p = strchr(p, '\n')) == NULL)
+			return -1;
+		p++;
+	}
+}
+
+/*
+ * cgroup_limit - the number in a limit file like memory.max, and the one
+ * after it in period when that is not NULL, or -1 if the file says "max"
+ */
+
+static int64_t
+cgroup_limit(int which, int64_t * period)
+{
+	char		buffer[64];
+	int			len;
+
+	if ((len = sysfd_read(which, buffer, sizeof(buffer) - 1)) <= 0)
+		return -1;
+	buffer[len] = '\0';
+	if (strncmp(buffer, "max", 3) == 0)
+		return -1;
+	if (period != NULL)
+		*period = strtoll(skip_token(buffer), NULL, 10);
+	return strtoll(buffer, NULL, 10);
+}
+
+/*
+ * cgroup_sample - set cgroup_stats to the figures of the server's cgroup,
+ * with the use of cpu and I/O as rates since the last sample.  Returns -1 if
+ * the cgroup is gone.
+ */
+
+static int
+cgroup_sample()
+{
+	char		buffer[4096 + 1];
+	int64_t		counters[NCGROUPCOUNTERS];
+	int64_t		delta[NCGROUPCOUNTERS];
+	int64_t		period;
+	struct timespec now;
+	double		elapsed = 0;
+	char	   *p;
+	int			len;
+	int			i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (cgroup_time.tv_sec != 0)
+		elapsed = ((now.tv_sec - cgroup_time.tv_sec) +
+				   (now.tv_nsec - cgroup_time.tv_nsec) * 1e-9);
+	cgroup_time = now;
+	for (i = 0; i < CGROUP_PRESSURE; i++)
+		cgroup_stats[i] = -1;
+	for (i = 0; i < NCGROUPCOUNTERS; i++)
+		counters[i] = -1;
+
+	/* the throttling is only there with the cpu controller */
+	if ((len = sysfd_read(SYSFILE_CGROUP_CPU_STAT, buffer,
+						  sizeof(buffer) - 1)) <= 0)
+		return -1;
+	buffer[len] = '\0';
+	counters[CGROUP_USAGE_USEC] = cgroup_value(buffer, "usage_usec");
+	counters[CGROUP_NR_PERIODS] = cgroup_value(buffer, "nr_periods");
+	counters[CGROUP_NR_THROTTLED] = cgroup_value(buffer, "nr_throttled");
+	counters[CGROUP_THROTTLED_USEC] = cgroup_value(buffer, "throttled_usec");
+
+	/* a quota of "200000 100000" is two cpus */
+	if ((cgroup_stats[CGROUP_CPU_MAX] =
+		 cgroup_limit(SYSFILE_CGROUP_CPU_MAX, &period)) >= 0)
+		cgroup_stats[CGROUP_CPU_MAX] = period > 0 ?
+			cgroup_stats[CGROUP_CPU_MAX] * 100 / period : -1;
+
+	/* memory in bytes */
+	if ((cgroup_stats[CGROUP_MEMORY_USED] =
+		 cgroup_limit(SYSFILE_CGROUP_MEMORY_CURRENT, NULL)) >= 0)
+		cgroup_stats[CGROUP_MEMORY_USED] =
+			bytetok(cgroup_stats[CGROUP_MEMORY_USED]);
+	if ((cgroup_stats[CGROUP_MEMORY_MAX] =
+		 cgroup_limit(SYSFILE_CGROUP_MEMORY_MAX, NULL)) >= 0)
+		cgroup_stats[CGROUP_MEMORY_MAX] =
+			bytetok(cgroup_stats[CGROUP_MEMORY_MAX]);
+	if ((cgroup_stats[CGROUP_MEMORY_SWAP] =
+		 cgroup_limit(SYSFILE_CGROUP_MEMORY_SWAP, NULL)) >= 0)
+		cgroup_stats[CGROUP_MEMORY_SWAP] =
+			bytetok(cgroup_stats[CGROUP_MEMORY_SWAP]);
+	if ((len = sysfd_read(SYSFILE_CGROUP_MEMORY_STAT, buffer,
+						  sizeof(buffer) - 1)) > 0)
+	{
+		buffer[len] = '\0';
+		if ((cgroup_stats[CGROUP_MEMORY_ANON] =
+			 cgroup_value(buffer, "anon")) >= 0)
+			cgroup_stats[CGROUP_MEMORY_ANON] =
+				bytetok(cgroup_stats[CGROUP_MEMORY_ANON]);
+		if ((cgroup_stats[CGROUP_MEMORY_FILE] =
+			 cgroup_value(buffer, "file")) >= 0)
+			cgroup_stats[CGROUP_MEMORY_FILE] =
+				bytetok(cgroup_stats[CGROUP_MEMORY_FILE]);
+	}
+
+	/* "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0" for each device */
+	if ((len = sysfd_read(SYSFILE_CGROUP_IO_STAT, buffer,
+						  sizeof(buffer) - 1)) >= 0)
+	{
+		buffer[len] = '\0';
+		for (i = CGROUP_RBYTES; i <= CGROUP_WIOS; i++)
+			counters[i] = 0;
+		for (p = buffer; (p = strchr(p, '=')) != NULL; p++)
+		{
+			if (p - buffer < 6)
+				continue;
+			if (strncmp(p - 6, "rbytes", 6) == 0)
+				counters[CGROUP_RBYTES] += strtoll(p + 1, NULL, 10);
+			else if (strncmp(p - 6, "wbytes", 6) == 0)
+				counters[CGROUP_WBYTES] += strtoll(p + 1, NULL, 10);
+			else if (strncmp(p - 4, "rios", 4) == 0)
+				counters[CGROUP_RIOS] += strtoll(p + 1, NULL, 10);
+			else if (strncmp(p - 4, "wios", 4) == 0)
+				counters[CGROUP_WIOS] += strtoll(p + 1, NULL, 10);
+		}
+	}
+
+	/* counters that went back, as when the cgroup was replaced, start over */
+	for (i = 0; i < NCGROUPCOUNTERS; i++)
+	{
+		delta[i] = counters[i] >= 0 && cgroup_counters[i] >= 0 &&
+			counters[i] >= cgroup_counters[i] && elapsed > 0 ?
+			counters[i] - cgroup_counters[i] : -1;
+		cgroup_counters[i] = counters[i];
+	}
+	if (delta[CGROUP_USAGE_USEC] >= 0)
+		cgroup_stats[CGROUP_CPU_USED] = (int64_t)
+			(delta[CGROUP_USAGE_USEC] / elapsed / 1e4 + 0.5);
+	if (delta[CGROUP_NR_PERIODS] > 0 && delta[CGROUP_NR_THROTTLED] >= 0)
+		cgroup_stats[CGROUP_CPU_PERIODS_THROTTLED] =
+			(delta[CGROUP_NR_THROTTLED] * 100 + delta[CGROUP_NR_PERIODS] / 2) /
+			delta[CGROUP_NR_PERIODS];
+	else if (delta[CGROUP_NR_PERIODS] == 0)
+		cgroup_stats[CGROUP_CPU_PERIODS_THROTTLED] = 0;
+	if (delta[CGROUP_THROTTLED_USEC] >= 0)
+		cgroup_stats[CGROUP_CPU_TIME_THROTTLED] = (int64_t)
+			(delta[CGROUP_THROTTLED_USEC] / elapsed / 1e4 + 0.5);
+	for (i = 0; i < 4; i++)
+		if (delta[CGROUP_RBYTES + i] >= 0)
+			cgroup_stats[CGROUP_IO_READ + i] = (int64_t)
+				(delta[CGROUP_RBYTES + i] / elapsed / (i < 2 ? 1024 : 1) + 0.5);
+
+	/* and the stalls in it, like those of the host */
+	if (show_pressure)
+		sample_pressure(SYSFILE_CGROUP_PRESSURE, cgroup_pressure_total,
+						&cgroup_stats[CGROUP_PRESSURE], elapsed * 1e6);
+	return 0;
+}
+
+int
+machine_init(struct statics *statics)
+{
+	/* make sure the proc filesystem is mounted */
+	{
+		struct statfs sb;
+
+		if (statfs(PROCFS, &sb) < 0 || sb.f_type != PROC_SUPER_MAGIC)
+		{
+			fprintf(stderr, "%s: proc filesystem not mounted on " PROCFS "\n",
+					myname);
+			return -1;
+		}
+	}
+
+	/* chdir to the proc filesystem to make things easier */
+	chdir(PROCFS);
+
+	/* decide how many /proc descriptors we can afford to keep open */
+	pidfd_init();
+
+	/* and whether most of them are needed at all */
+	taskstats_init();
+
+	/* see which cpu states there are to show */
+	if (stat_init() == -1)
+	{
+		fprintf(stderr, "%s: malloc error\n", myname);
+		return -1;
+	}
+
+	/* and whether there is pressure stall information */
+	show_pressure = read_pressure(SYSFILE_PRESSURE, pressure_total,
+								  pressure_stats) != -1;
+
+	/* and where to look for the cgroup of the server */
+	cgroup_init();
+
+	/* a few preliminary checks */
+	{
+		int			fd;
+		char		buff[128];
+		char	   *p;
+		unsigned long uptime;
+		struct timeval tv;
+
+		/* get a boottime */
+		if ((fd = open("uptime", 0)) != -1)
+		{
+			if (read(fd, buff, sizeof(buff)) > 0)
+			{
+				uptime = strtoul(buff, &p, 10);
+				gettimeofday(&tv, 0);
+				boottime = tv.tv_sec - uptime;
+			}
+			close(fd);
+		}
+	}
+
+	/* fill in the statics information */
+	statics->procstate_names = procstatenames;
+	statics->cpustate_names = cpustatenames;
+	statics->memory_names = memorynames;
+	statics->swap_names = swapnames;
+	statics->order_names = ordernames;
+	statics->pressure_names = show_pressure ? pressurenames : NULL;
+	if (cgroup_mount[0] != '\0')
+	{
+		statics->cgroup_cpu_names = cgroupcpunames;
+		statics->cgroup_memory_names = cgroupmemorynames;
+		statics->cgroup_io_names = cgroupionames;
+	}
+	statics->boottime = boottime;
+	statics->ncpus = ncpus;
+	statics->flags.fullcmds = 1;
+	statics->flags.warmup = 1;
+
+	/* all done! */
+	return 0;
+}
+
+/*
+ * parse_cpu_times - read the columns of a cpu line of /proc/stat at p into
+ * times, and return where they end.  The guest time is also counted in user
+ * and nice, so it is taken out of those for the states to add up to the time
+ * that passed.
+ */
+
+static char *
+parse_cpu_times(char *p, int64_t * times)
+{
+	int			i;
+
+	for (i = 0; i < ncpustates; i++)
+		times[i] = strtoull(p, &p, 10);
+	if (ncpustates > CPUGUEST)
+		times[0] -= times[CPUGUEST];
+	if (ncpustates > CPUGUESTNICE)
+		times[1] -= times[CPUGUESTNICE];
+	return p;
+}
+
+void
+get_system_info(struct system_info *info)
+{
+	char		buffer[4096 + 1];
+	int			len;
+	char	   *p;
+	int			cpu;
+	int			i;
+
+	/* get load averages */
+
+	if ((len = sysfd_read(SYSFILE_LOADAVG, buffer, sizeof(buffer) - 1)) > 0)
+	{
+		buffer[len] = '\0';
+		info->load_avg[0] = strtod(buffer, &p);
+		info->load_avg[1] = strtod(p, &p);
+		info->load_avg[2] = strtod(p, &p);
+		p = skip_token(p);	/* skip running/tasks */
+		p = skip_ws(p);
+		if (*p)
+		{
+			info->last_pid = atoi(p);
+		}
+		else
+		{
+			info->last_pid = -1;
+		}
+	}
+
+	/* get the cpu time info, of all cpus and then of each one */
+	if ((len = sysfd_read(SYSFILE_STAT, stat_buffer, stat_buffer_size)) > 0)
+	{
+		stat_buffer[len] = '\0';
+		p = skip_token(stat_buffer);	/* "cpu" */
+		p = parse_cpu_times(p, cp_time);
+
+		/* convert cp_time counts to percentages */
+		percentages(ncpustates, cpu_states, cp_time, cp_old, cp_diff);
+
+		/* cpus that are offline have no line, and all their states at 0 */
+		memset(pcpu_cpu_states, 0, ncpus * ncpustates * sizeof(int64_t));
+		while ((p = strchr(p, '\n')) != NULL && strncmp(++p, "cpu", 3) == 0)
+		{
+			/* a line cut short by the end of the buffer is left alone */
+			if (strchr(p, '\n') == NULL)
+				break;
+			cpu = strtol(p + 3, &p, 10);
+			if (cpu < 0 || cpu >= ncpus)
+				continue;
+			i = cpu * ncpustates;
+			p = parse_cpu_times(p, &pcpu_cp_time[i]);
+			percentages(ncpustates, &pcpu_cpu_states[i], &pcpu_cp_time[i],
+						&pcpu_cp_old[i], &pcpu_cp_diff[i]);
+		}
+	}
+
+	/*
+	 * get the share of the time since the last sample that tasks stalled,
+	 * or the kernel's own average for the first
+	 */
+	if (show_pressure)
+	{
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sample_pressure(SYSFILE_PRESSURE, pressure_total, pressure_stats,
+						pressure_time.tv_sec == 0 ? 0 :
+						((now.tv_sec - pressure_time.tv_sec) * 1e6 +
+						 (now.tv_nsec - pressure_time.tv_nsec) / 1e3));
+		pressure_time = now;
+	}
+
+	/* and those of the server's cgroup, once it has been found */
+	if (cgroup_found && cgroup_sample() == -1)
+		cgroup_found = 0;
+
+	/* get system wide memory usage */
+	if ((len = sysfd_read(SYSFILE_MEMINFO, buffer, sizeof(buffer) - 1)) > 0)
+	{
+		int			mem = 0;
+		int			swap = 0;
+		unsigned long memtotal = 0;
+		unsigned long memfree = 0;
+		unsigned long swaptotal = 0;
+		unsigned long long v[6];
+		const char *end = buffer + len;
+		const char *eol;
+		const char *r;
+
+		buffer[len] = '\0';
+
+		/* iterate thru the lines */
+		for (p = buffer; p < end; p = (char *) eol + 1)
+		{
+			if ((eol = memchr(p, '\n', end - p)) == NULL)
+				eol = end;
+
+			if (p[0] == ' ' || p[0] == '\t')
+			{
+				/* skip */
+			}
+			else if (strncmp(p, "Mem:", 4) == 0)
+			{
+				/* total, used, free, shared, buffers and cached in bytes */
+				r = p + 4;
+				if (scan_number(&r, eol, &v[0]) == 0 &&
+					scan_number(&r, eol, &v[1]) == 0 &&
+					scan_number(&r, eol, &v[2]) == 0 &&
+					scan_number(&r, eol, &v[3]) == 0 &&
+					scan_number(&r, eol, &v[4]) == 0 &&
+					scan_number(&r, eol, &v[5]) == 0)
 				{
-					p = skip_token(p);	/* "Mem:" */
-					p = skip_token(p);	/* total memory */
-					memory_stats[MEMUSED] = strtoul(p, &p, 10);
-					memory_stats[MEMFREE] = strtoul(p, &p, 10);
-					memory_stats[MEMSHARED] = strtoul(p, &p, 10);
-					memory_stats[MEMBUFFERS] = strtoul(p, &p, 10);
-					memory_stats[MEMCACHED] = strtoul(p, &p, 10);
-					memory_stats[MEMUSED] = bytetok(memory_stats[MEMUSED]);
-					memory_stats[MEMFREE] = bytetok(memory_stats[MEMFREE]);
-					memory_stats[MEMSHARED] = bytetok(memory_stats[MEMSHARED]);
-					memory_stats[MEMBUFFERS] =
-						bytetok(memory_stats[MEMBUFFERS]);
-					memory_stats[MEMCACHED] = bytetok(memory_stats[MEMCACHED]);
+					memory_stats[MEMUSED] = bytetok(v[1]);
+					memory_stats[MEMFREE] = bytetok(v[2]);
+					memory_stats[MEMSHARED] = bytetok(v[3]);
+					memory_stats[MEMBUFFERS] = bytetok(v[4]);
+					memory_stats[MEMCACHED] = bytetok(v[5]);
 					mem = 1;
 				}
-				else if (strncmp(p, "Swap:", 5) == 0)
+			}
+			else if (strncmp(p, "Swap:", 5) == 0)
+			{
+				/* total, used and free in bytes */
+				r = p + 5;
+				if (scan_number(&r, eol, &v[0]) == 0 &&
+					scan_number(&r, eol, &v[1]) == 0 &&
+					scan_number(&r, eol, &v[2]) == 0)
 				{
-					p = skip_token(p);	/* "Swap:" */
-					p = skip_token(p);	/* total swap */
-					swap_stats[SWAPUSED] = strtoul(p, &p, 10);
-					swap_stats[SWAPFREE] = strtoul(p, &p, 10);
-					swap_stats[SWAPUSED] = bytetok(swap_stats[SWAPUSED]);
-					swap_stats[SWAPFREE] = bytetok(swap_stats[SWAPFREE]);
+					swap_stats[SWAPUSED] = bytetok(v[1]);
+					swap_stats[SWAPFREE] = bytetok(v[2]);
 					swap = 1;
 				}
-				else if (!mem && strncmp(p, "MemTotal:", 9) == 0)
-				{
-					p = skip_token(p);
-					memtotal = strtoul(p, &p, 10);
-				}
-				else if (!mem && memtotal > 0 && strncmp(p, "MemFree:", 8) == 0)
-				{
-					p = skip_token(p);
-					memfree = strtoul(p, &p, 10);
-					memory_stats[MEMUSED] = memtotal - memfree;
-					memory_stats[MEMFREE] = memfree;
-				}
-				else if (!mem && strncmp(p, "MemShared:", 10) == 0)
-				{
-					p = skip_token(p);
-					memory_stats[MEMSHARED] = strtoul(p, &p, 10);
-				}
-				else if (!mem && strncmp(p, "Buffers:", 8) == 0)
-				{
-					p = skip_token(p);
-					memory_stats[MEMBUFFERS] = strtoul(p, &p, 10);
-				}
-				else if (!mem && strncmp(p, "Cached:", 7) == 0)
-				{
-					p = skip_token(p);
-					memory_stats[MEMCACHED] = strtoul(p, &p, 10);
-				}
-				else if (!swap && strncmp(p, "SwapTotal:", 10) == 0)
-				{
-					p = skip_token(p);
-					swaptotal = strtoul(p, &p, 10);
-				}
-				else if (!swap && swaptotal > 0 && strncmp(p, "SwapFree:", 9) == 0)
-				{
-					p = skip_token(p);
-					memfree = strtoul(p, &p, 10);
-					swap_stats[SWAPUSED] = swaptotal - memfree;
-					swap_stats[SWAPFREE] = memfree;
-				}
-				else if (!mem && strncmp(p, "SwapCached:", 11) == 0)
-				{
-					p = skip_token(p);
-					swap_stats[SWAPCACHED] = strtoul(p, &p, 10);
-				}
+			}
+			else if (!mem && strncmp(p, "MemTotal:", 9) == 0)
+			{
+				memtotal = meminfo_value(p, eol, 9);
+			}
+			else if (!mem && memtotal > 0 && strncmp(p, "MemFree:", 8) == 0)
+			{
+				memfree = meminfo_value(p, eol, 8);
+				memory_stats[MEMUSED] = memtotal - memfree;
+				memory_stats[MEMFREE] = memfree;
+			}
+			else if (!mem && strncmp(p, "MemShared:", 10) == 0)
+			{
+				memory_stats[MEMSHARED] = meminfo_value(p, eol, 10);
+			}
+			else if (!mem && strncmp(p, "Buffers:", 8) == 0)
+			{
+				memory_stats[MEMBUFFERS] = meminfo_value(p, eol, 8);
+			}
+			else if (!mem && strncmp(p, "Cached:", 7) == 0)
+			{
+				memory_stats[MEMCACHED] = meminfo_value(p, eol, 7);
+			}
+			else if (!swap && strncmp(p, "SwapTotal:", 10) == 0)
+			{
+				swaptotal = meminfo_value(p, eol, 10);
+			}
+			else if (!swap && swaptotal > 0 && strncmp(p, "SwapFree:", 9) == 0)
+			{
+				memfree = meminfo_value(p, eol, 9);
+				swap_stats[SWAPUSED] = swaptotal - memfree;
+				swap_stats[SWAPFREE] = memfree;
+			}
+			else if (!mem && strncmp(p, "SwapCached:", 11) == 0)
+			{
+				swap_stats[SWAPCACHED] = meminfo_value(p, eol, 11);
+			}
+		}
+	}
+
+	/* get swap activity */
+	if ((len = sysfd_read(SYSFILE_VMSTAT, buffer, sizeof(buffer) - 1)) > 0)
+	{
+		unsigned long swpin = -1;
+		unsigned long swpout = -1;
+
+		buffer[len] = '\0';
+		p = buffer - 1;
+		while (p != NULL)
+		{
+			p++;
+
+			if (swpin == -1 && strncmp(p, "pswpin", 6) == 0)
+			{
+				p = skip_token(p);
+				swpin = strtoul(p, &p, 10);
+			}
+			else if (swpout == -1 && strncmp(p, "pswpout", 7) == 0)
+			{
+				p = skip_token(p);
+				swpout = strtoul(p, &p, 10);
+			}
+
+			if (swpin != -1 && swpout != -1)
+			{
+				swap_activity.in[swap_activity.index] = swpin;
+				swap_activity.out[swap_activity.index] = swpout;
 
-				/* move to the next line */
-				p = strchr(p, '\n');
+				swap_stats[SWAPIN] = diff_stat(swap_activity.in,
+						swap_activity.index);
+				swap_stats[SWAPOUT] = diff_stat(swap_activity.out,
+						swap_activity.index);
+
+
+				swap_activity.index = (swap_activity.index + 1) % 2;
+				break;
 			}
+
+			/* move to the next line */
+			p = strchr(p, '\n');
 		}
+	}
+	else
+	{
+		swap_activity.in[swap_activity.index] = -1;
+		swap_activity.out[swap_activity.index] = -1;
+	}
+
+	/* set arrays and strings */
+	info->cpustates = cpu_states;
+	info->percpu_cpustates = ncpus > 0 ? pcpu_cpu_states : NULL;
+	info->pressure = show_pressure ? pressure_stats : NULL;
+	info->cgroup = cgroup_found ? cgroup_stats : NULL;
+	info->memory = memory_stats;
+	info->swap = swap_stats;
+}
+
+/*
+ * read_one_proc_stat - sample /proc/<pid>/{cmdline,stat,schedstat,io} into
+ * the columns.  When ts has the taskstats of the pid, those are used instead
+ * of schedstat and io.
+ * Returns -1 if the stat file could not be read or parsed, in which case the
+ * previous sample of the pid is left as it was.
+ */
+
+static int
+read_one_proc_stat(struct top_proc *proc, struct process_select *sel,
+				   const struct taskstats *ts)
+{
+	char		buffer[4096];
+	int			len;
+	int			fullcmd;
+	struct stat_fields stat;
+	unsigned long long io[NIOFIELDS];
+
+	int			slot = proc->slot;
+	int			c;
+
+	/* full cmd handling */
+	fullcmd = sel->fullcmd;
+	if (fullcmd == 1)
+	{
+		/* read command line data */
+		/* (theres no sense in reading more than we can fit) */
+		if ((len = pidfd_read(proc, PIDFILE_CMDLINE, buffer, MAX_COLS)) > 1)
+		{
+			buffer[len] = '\0';
+			xfrm_cmdline(buffer, len);
+			update_str(&proc->name, buffer);
+			printable(proc->name);
+		}
+		else
+		{
+			fullcmd = 0;
+		}
+	}
+
+	/* grab the proc stat info in one go */
+	if ((len = pidfd_read(proc, PIDFILE_STAT, buffer,
+						  sizeof(buffer) - 1)) <= 0)
+	{
+		pidfd_evict(proc);
+		return -1;
+	}
+	buffer[len] = '\0';
+
+	if (parse_stat(buffer, len, &stat) != 0)
+		return -1;
+
+	/* set the procname */
+	if (!fullcmd)
+	{
+		update_str(&proc->name, stat.comm);
+		printable(proc->name);
+	}
+
+	switch (stat.state)
+	{
+		case 'R':
+			col.state[slot] = 1;
+			break;
+		case 'S':
+			col.state[slot] = 2;
+			break;
+		case 'D':
+			col.state[slot] = 3;
+			break;
+		case 'Z':
+			col.state[slot] = 4;
+			break;
+		case 'T':
+			col.state[slot] = 5;
+			break;
+		case 'W':
+			col.state[slot] = 6;
+			break;
+		default:
+			col.state[slot] = 0;
+			break;
+	}
+
+	col.time[slot] = stat.utime + stat.stime;
+	if (col.start_time[slot] != 0 && col.start_time[slot] != stat.start_time)
+	{
+		/*
+		 * The pid has been reused since the last sample.  Anything we still
+		 * have open or have counted belongs to the old process.
+		 */
+		pidfd_close(proc, PIDFILE_CMDLINE);
+		pidfd_close(proc, PIDFILE_IO);
+		pidfd_close(proc, PIDFILE_SCHEDSTAT);
+		for (c = 0; c < NIOCOUNTERS; c++)
+		{
+			col.io[c][slot] = 0;
+			col.io_last[c][slot] = 0;
+		}
+	}
+	col.start_time[slot] = stat.start_time;
+	col.size[slot] = bytetok(stat.vsize);
+	col.rss[slot] = pagetok(stat.rss);
+
+	if (ts != NULL)
+	{
+		col.blkio[slot] = ts->blkio_delay_total;
+		col.io[IO_SYSCR][slot] = ts->read_syscalls;
+		col.io[IO_SYSCW][slot] = ts->write_syscalls;
+		col.io[IO_IOPS][slot] = ts->read_syscalls + ts->write_syscalls;
+		col.io[IO_READ_BYTES][slot] = ts->read_bytes;
+		col.io[IO_WRITE_BYTES][slot] =
+			ts->write_bytes - ts->cancelled_write_bytes;
+
+		/*
+		 * Some kernels only fill in the cpu times with delay accounting on,
+		 * which is plain when the ticks in stat say otherwise.
+		 */
+		if (ts->cpu_run_virtual_total != 0 || col.time[slot] == 0)
+		{
+			col.run_ns[slot] = ts->cpu_run_virtual_total;
+			col.wait_ns[slot] = ts->cpu_delay_total;
+			col.schedstat[slot] = 1;
+			return 0;
+		}
+	}
+	else
+		col.blkio[slot] = stat.blkio * (1000000000 / HZ);
+
+	/* without CONFIG_SCHED_INFO there is no schedstat */
+	col.schedstat[slot] = 0;
+	if ((len = pidfd_read(proc, PIDFILE_SCHEDSTAT, buffer,
+						  sizeof(buffer) - 1)) > 0)
+	{
+		const char *p = buffer;
+		unsigned long long run_ns,
+					wait_ns;
+
+		if (scan_number(&p, buffer + len, &run_ns) == 0 &&
+			scan_number(&p, buffer + len, &wait_ns) == 0)
+		{
+			col.run_ns[slot] = run_ns;
+			col.wait_ns[slot] = wait_ns;
+			col.schedstat[slot] = 1;
+		}
+	}
+
+	/* Get the io stats. */
+	if (ts != NULL)
+		return 0;
+	if ((len = pidfd_read(proc, PIDFILE_IO, buffer, sizeof(buffer) - 1)) <= 0)
+	{
+		/*
+		 * CONFIG_TASK_IO_ACCOUNTING is not enabled in the Linux kernel or
+		 * this version of Linux may not support collecting i/o statistics per
+		 * pid.
+		 */
+		return 0;
+	}
+
+	if (parse_io(buffer, len, io) == 0)
+	{
+		col.io[IO_SYSCR][slot] = io[IOF_SYSCR];
+		col.io[IO_SYSCW][slot] = io[IOF_SYSCW];
+		col.io[IO_IOPS][slot] = io[IOF_SYSCR] + io[IOF_SYSCW];
+		col.io[IO_READ_BYTES][slot] = io[IOF_READ_BYTES];
+		col.io[IO_WRITE_BYTES][slot] =
+			io[IOF_WRITE_BYTES] - io[IOF_CANCELLED_WRITE_BYTES];
+	}
+	return 0;
+}
+
+/* taskstats_open - a generic netlink socket, -1 if there is none */
+
+static int
+taskstats_open()
+{
+	struct sockaddr_nl addr;
+	struct timeval tv = {1, 0};
+	int			bufsize = 1 << 20;
+	int			fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+					 NETLINK_GENERIC)) == -1)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
 		close(fd);
+		return -1;
 	}
 
-	/* get swap activity */
-	if ((fd = open("vmstat", O_RDONLY)) != -1)
+	/* room for the answers to a whole batch, and never wait forever */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/* NLA_* are only in the kernel's own headers */
+#define TS_ALIGN(len)	(((len) + 3) & ~3)
+#define TS_ATTR(nla)	((char *) (nla) + NLA_HDRLEN)
+
+/*
+ * taskstats_answer - file away the stats in one answer to a batch sent by
+ * taskstats_fetch().  A pid that has gone away gets an error instead, and is
+ * left to be read from /proc.
+ */
+
+static void
+taskstats_answer(struct taskstats_conn *conn, struct nlmsghdr *n, int first,
+				 int count)
+{
+	struct nlattr *na;
+	struct nlattr *nested;
+	int			len,
+				nlen;
+	int			i = (int) n->nlmsg_seq - first;
+
+	if (i < 0 || i >= count || n->nlmsg_type != taskstats_family)
+		return;
+
+	len = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	na = (struct nlattr *) ((char *) NLMSG_DATA(n) + GENL_HDRLEN);
+	while (len >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN &&
+		   na->nla_len <= len)
+	{
+		if (na->nla_type == TASKSTATS_TYPE_AGGR_PID)
+		{
+			nlen = na->nla_len - NLA_HDRLEN;
+			nested = (struct nlattr *) TS_ATTR(na);
+			while (nlen >= NLA_HDRLEN && nested->nla_len >= NLA_HDRLEN &&
+				   nested->nla_len <= nlen)
+			{
+				if (nested->nla_type == TASKSTATS_TYPE_STATS)
+				{
+					/* the struct only ever grows at the end */
+					size_t		size = nested->nla_len - NLA_HDRLEN;
+
+					memset(&conn->stats[first + i], 0,
+						   sizeof(struct taskstats));
+					memcpy(&conn->stats[first + i], TS_ATTR(nested),
+						   size < sizeof(struct taskstats) ? size :
+						   sizeof(struct taskstats));
+					conn->found[first + i] = 1;
+				}
+				nlen -= TS_ALIGN(nested->nla_len);
+				nested = (struct nlattr *) ((char *) nested +
+											TS_ALIGN(nested->nla_len));
+			}
+		}
+		len -= TS_ALIGN(na->nla_len);
+		na = (struct nlattr *) ((char *) na + TS_ALIGN(na->nla_len));
+	}
+}
+
+/*
+ * taskstats_fetch - ask for the taskstats of every pid in work, a batch of
+ * requests to each send and as many answers as are waiting to each receive.
+ * Whatever does not get an answer is left to be read from /proc.
+ */
+
+static void
+taskstats_fetch(struct taskstats_conn *conn, struct top_proc **work, int n)
+{
+	struct
+	{
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		struct nlattr na;
+		uint32_t	pid;
+	}			req[TASKSTATS_BATCH];
+	struct mmsghdr msgs[TASKSTATS_BATCH];
+	struct iovec iov[TASKSTATS_BATCH];
+	int			first,
+				count,
+				pending,
+				got,
+				i;
+
+	if (n > conn->size)
+	{
+		void	   *stats = realloc(conn->stats, n * sizeof(struct taskstats));
+		void	   *found = realloc(conn->found, n);
+
+		if (stats != NULL)
+			conn->stats = stats;
+		if (found != NULL)
+			conn->found = found;
+		if (stats == NULL || found == NULL)
+			return;
+		conn->size = n;
+	}
+	memset(conn->found, 0, n);
+
+	if (conn->answers == NULL &&
+		(conn->answers = malloc(TASKSTATS_BATCH *
+								TASKSTATS_ANSWER_SIZE)) == NULL)
+		return;
+	if (conn->fd == -1 && (conn->fd = taskstats_open()) == -1)
+		return;
+
+	memset(req, 0, sizeof(req));
+	for (first = 0; first < n; first += count)
 	{
-		unsigned long swpin = -1;
-		unsigned long swpout = -1;
+		count = n - first < TASKSTATS_BATCH ? n - first : TASKSTATS_BATCH;
+		for (i = 0; i < count; i++)
+		{
+			req[i].n.nlmsg_len = sizeof(req[i]);
+			req[i].n.nlmsg_type = taskstats_family;
+			req[i].n.nlmsg_flags = NLM_F_REQUEST;
+			req[i].n.nlmsg_seq = first + i;
+			req[i].g.cmd = TASKSTATS_CMD_GET;
+			req[i].g.version = TASKSTATS_GENL_VERSION;
+			req[i].na.nla_type = TASKSTATS_CMD_ATTR_PID;
+			req[i].na.nla_len = NLA_HDRLEN + sizeof(uint32_t);
+			req[i].pid = work[first + i]->pid;
+		}
+		if (send(conn->fd, req, count * sizeof(req[0]), 0) == -1)
+			return;
 
-		if ((len = read(fd, buffer, sizeof(buffer) - 1)) > 0)
+		/* there is one answer, or one error, to each request */
+		for (pending = count; pending > 0; pending -= got)
 		{
-			buffer[len] = '\0';
-			p = buffer - 1;
-			while (p != NULL)
+			for (i = 0; i < pending; i++)
 			{
-				p++;
-
-				if (swpin == -1 && strncmp(p, "pswpin", 6) == 0)
-				{
-					p = skip_token(p);
-					swpin = strtoul(p, &p, 10);
-				}
-				else if (swpout == -1 && strncmp(p, "pswpout", 7) == 0)
-				{
-					p = skip_token(p);
-					swpout = strtoul(p, &p, 10);
-				}
+				iov[i].iov_base = conn->answers + i * TASKSTATS_ANSWER_SIZE;
+				iov[i].iov_len = TASKSTATS_ANSWER_SIZE;
+				memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			if ((got = recvmmsg(conn->fd, msgs, pending, MSG_WAITFORONE,
+								NULL)) <= 0)
+			{
+				/* lost answers would come back with the next batch */
+				close(conn->fd);
+				conn->fd = -1;
+				return;
+			}
+			for (i = 0; i < got; i++)
+			{
+				struct nlmsghdr *nh = (struct nlmsghdr *) iov[i].iov_base;
 
-				if (swpin != -1 && swpout != -1)
-				{
-					swap_activity.in[swap_activity.index] = swpin;
-					swap_activity.out[swap_activity.index] = swpout;
+				if (NLMSG_OK(nh, msgs[i].msg_len))
+					taskstats_answer(conn, nh, first, count);
+			}
+		}
+	}
+}
 
-					swap_stats[SWAPIN] = diff_stat(swap_activity.in,
-							swap_activity.index);
-					swap_stats[SWAPOUT] = diff_stat(swap_activity.out,
-							swap_activity.index);
+/*
+ * taskstats_init - look up the id of the TASKSTATS family, and whether this
+ * process may use it.  Leaves taskstats_family 0 when not.
+ */
 
+static void
+taskstats_init()
+{
+	struct
+	{
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char		buf[256];
+	}			req;
+	struct nlattr *na;
+	char		answer[1024];
+	struct nlmsghdr *n = (struct nlmsghdr *) answer;
+	int			fd,
+				len,
+				i;
+	int			family = 0;
 
-					swap_activity.index = (swap_activity.index + 1) % 2;
-					break;
-				}
+	for (i = 0; i < MAX_COLLECTORS; i++)
+		taskstats_conns[i].fd = -1;
+	if ((fd = taskstats_open()) == -1)
+		return;
 
-				/* move to the next line */
-				p = strchr(p, '\n');
-			}
-		}
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_type = GENL_ID_CTRL;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = 1;
+	req.g.cmd = CTRL_CMD_GETFAMILY;
+	req.g.version = 1;
+	na = (struct nlattr *) req.buf;
+	na->nla_type = CTRL_ATTR_FAMILY_NAME;
+	na->nla_len = NLA_HDRLEN + sizeof(TASKSTATS_GENL_NAME);
+	strcpy(TS_ATTR(na), TASKSTATS_GENL_NAME);
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + TS_ALIGN(na->nla_len));
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) == -1 ||
+		(len = recv(fd, answer, sizeof(answer), 0)) == -1 ||
+		!NLMSG_OK(n, len) || n->nlmsg_type == NLMSG_ERROR)
+	{
 		close(fd);
+		return;
 	}
-	else
+
+	len = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	na = (struct nlattr *) ((char *) NLMSG_DATA(n) + GENL_HDRLEN);
+	while (len >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN &&
+		   na->nla_len <= len)
 	{
-		swap_activity.in[swap_activity.index] = -1;
-		swap_activity.out[swap_activity.index] = -1;
+		if (na->nla_type == CTRL_ATTR_FAMILY_ID)
+			family = *(uint16_t *) TS_ATTR(na);
+		len -= TS_ALIGN(na->nla_len);
+		na = (struct nlattr *) ((char *) na + TS_ALIGN(na->nla_len));
 	}
 
-	/* set arrays and strings */
-	info->cpustates = cpu_states;
-	info->memory = memory_stats;
-	info->swap = swap_stats;
+	/* the first collector keeps the socket */
+	taskstats_conns[0].fd = fd;
+
+	/* see whether we are allowed to ask, about ourselves */
+	if (family != 0)
+	{
+		struct top_proc self;
+		struct top_proc *work = &self;
+
+		taskstats_family = family;
+		self.pid = getpid();
+		taskstats_fetch(&taskstats_conns[0], &work, 1);
+		if (taskstats_conns[0].size == 0 || !taskstats_conns[0].found[0])
+			taskstats_family = 0;
+	}
 }
 
+/*
+ * collect_shard - read /proc for one share of the current job and work out
+ * the cpu percentage of each pid in it
+ */
+
 static void
-read_one_proc_stat(struct top_proc *proc, struct process_select *sel)
+collect_shard(int id)
 {
-	char		buffer[4096],
-			   *p,
-			   *q;
-	int			fd,
-				len;
-	int			fullcmd;
-	char		value[BUFFERLEN + 1];
-
-	long long	tmp;
-
-	/* if anything goes wrong, we return with proc->state == 0 */
-	proc->state = 0;
-
-	/* full cmd handling */
-	fullcmd = sel->fullcmd;
-	if (fullcmd == 1)
+	int			i;
+	int			begin = (long) job.nwork * id / job.nshards;
+	int			end = (long) job.nwork * (id + 1) / job.nshards;
+	struct taskstats_conn *conn = &taskstats_conns[id];
+	int			taskstats = taskstats_family != 0;
+	int			c,
+				slot;
+	unsigned long otime;
+	unsigned long ostart;
+	unsigned long long oblkio;
+	unsigned long long orun_ns;
+	unsigned long long owait_ns;
+	int			oschedstat;
+	double		elapsed;
+	double		elapsed_ns;
+
+	if (taskstats)
+		taskstats_fetch(conn, job.work + begin, end - begin);
+	taskstats = taskstats && conn->size >= end - begin;
+
+	for (i = begin; i < end; i++)
 	{
-		sprintf(buffer, "%d/cmdline", proc->pid);
-		if ((fd = open(buffer, O_RDONLY)) != -1)
+		slot = job.work[i]->slot;
+		otime = col.time[slot];
+		ostart = col.start_time[slot];
+		oblkio = col.blkio[slot];
+		oschedstat = col.schedstat[slot];
+		orun_ns = col.run_ns[slot];
+		owait_ns = col.wait_ns[slot];
+		for (c = 0; c < NIOCOUNTERS; c++)
+			col.io_last[c][slot] = col.io[c][slot];
+
+		read_one_proc_stat(job.work[i], job.sel,
+						   taskstats && conn->found[i - begin] ?
+						   &conn->stats[i - begin] : NULL);
+		if (col.start_time[slot] != ostart)
+		{
+			/*
+			 * A new or reused pid, or one that the server has not sent for a
+			 * while.  Without an earlier sample, the average since it
+			 * started is the best there is.
+			 */
+			otime = 0;
+			oblkio = 0;
+			orun_ns = owait_ns = 0;
+			oschedstat = 1;
+			elapsed = job.uptime - col.start_time[slot];
+			if (elapsed < job.tickdiff)
+				elapsed = job.tickdiff;
+		}
+		else
+		{
+			/* not every pid is read on every sample */
+			elapsed = job.uptime - col.read_at[slot];
+		}
+		col.read_at[slot] = job.uptime;
+		col.elapsed[slot] = elapsed;
+
+		if (job.tickdiff > 0.0 && elapsed > 0.0)
 		{
-			/* read command line data */
-			/* (theres no sense in reading more than we can fit) */
-			if ((len = read(fd, buffer, MAX_COLS)) > 1)
+			/*
+			 * Nanoseconds from schedstat do not round a short interval to
+			 * whole ticks, which reads as either 0% or 100%.
+			 */
+			elapsed_ns = elapsed * (1e9 / HZ);
+			if (col.schedstat[slot] && oschedstat)
 			{
-				buffer[len] = '\0';
-				xfrm_cmdline(buffer, len);
-				update_str(&proc->name, buffer);
-				printable(proc->name);
+				col.pcpu[slot] = (col.run_ns[slot] - orun_ns) / elapsed_ns;
+				col.prqwait[slot] = (col.wait_ns[slot] - owait_ns) /
+					elapsed_ns;
 			}
 			else
 			{
-				fullcmd = 0;
+				col.pcpu[slot] = (col.time[slot] - otime) / elapsed;
+				col.prqwait[slot] = 0;
+			}
+			if (col.pcpu[slot] < 0.0001)
+				col.pcpu[slot] = 0;
+			if (col.prqwait[slot] < 0.0001)
+				col.prqwait[slot] = 0;
+
+			/* without task_delayacct these stay 0 */
+			if ((col.piowait[slot] = (col.blkio[slot] - oblkio) /
+				 elapsed_ns) < 0.0001)
+			{
+				col.piowait[slot] = 0;
 			}
-			close(fd);
-		}
-		else
-		{
-			fullcmd = 0;
 		}
 	}
+}
 
-	/* grab the proc stat info in one go */
-	sprintf(buffer, "%d/stat", proc->pid);
+static void *
+collector_main(void *arg)
+{
+	int			id = (int) (intptr_t) arg;
+	unsigned int round = 0;
 
-	fd = open(buffer, O_RDONLY);
-	len = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
+	pthread_mutex_lock(&collect_lock);
+	for (;;)
+	{
+		while (collect_round == round)
+			pthread_cond_wait(&collect_start, &collect_lock);
+		round = collect_round;
+		pthread_mutex_unlock(&collect_lock);
 
-	buffer[len] = '\0';
+		collect_shard(id);
+
+		pthread_mutex_lock(&collect_lock);
+		if (--collect_pending == 0)
+			pthread_cond_signal(&collect_done);
+	}
+
+	return NULL;
+}
+
+/*
+ * collect_procs - read /proc for every pid in work, spread across the
+ * collector threads if more than one was asked for
+ */
+
+static void
+collect_procs(struct top_proc **work, int nwork, struct process_select *sel,
+			  double tickdiff, double uptime)
+{
+	static int	started = 0;
+	int			i;
 
-	/* parse out the status, described in 'man proc' */
+	job.work = work;
+	job.nwork = nwork;
+	job.sel = sel;
+	job.tickdiff = tickdiff;
+	job.uptime = uptime;
 
-	/* skip pid and locate command, which is in parentheses */
-	if ((p = strchr(buffer, '(')) == NULL)
+	/* start the pool the first time through */
+	if (!started)
 	{
-		return;
+		started = 1;
+		ncollectors = sel->collectors;
+		if (ncollectors > MAX_COLLECTORS)
+			ncollectors = MAX_COLLECTORS;
+		for (i = 1; i < ncollectors; i++)
+		{
+			if (pthread_create(&collectors[i], NULL, collector_main,
+							   (void *) (intptr_t) i) != 0)
+			{
+				break;
+			}
+		}
+		ncollectors = i > 1 ? i : 1;
 	}
-	if ((q = strrchr(++p, ')')) == NULL)
+
+	/* not worth waking anybody up for a handful of pids */
+	if (ncollectors == 1 || nwork < ncollectors)
 	{
+		job.nshards = 1;
+		collect_shard(0);
 		return;
 	}
+	job.nshards = ncollectors;
 
-	/* set the procname */
-	*q = '\0';
-	if (!fullcmd)
-	{
-		update_str(&proc->name, p);
-		printable(proc->name);
-	}
+	pthread_mutex_lock(&collect_lock);
+	collect_pending = ncollectors - 1;
+	collect_round++;
+	pthread_cond_broadcast(&collect_start);
+	pthread_mutex_unlock(&collect_lock);
 
-	/* scan the rest of the line */
-	p = q + 1;
-	p = skip_ws(p);
-	switch (*p++)				/* state */
-	{
-		case 'R':
-			proc->state = 1;
-			break;
-		case 'S':
-			proc->state = 2;
-			break;
-		case 'D':
-			proc->state = 3;
-			break;
-		case 'Z':
-			proc->state = 4;
-			break;
-		case 'T':
-			proc->state = 5;
-			break;
-		case 'W':
-			proc->state = 6;
-			break;
-		case '\0':
-			return;
-	}
+	collect_shard(0);
 
-	p = skip_token(p);			/* skip ppid */
-	p = skip_token(p);			/* skip pgrp */
-	p = skip_token(p);			/* skip session */
-	p = skip_token(p);			/* skip tty nr */
-	p = skip_token(p);			/* skip tty pgrp */
-	p = skip_token(p);			/* skip flags */
-	p = skip_token(p);			/* skip min flt */
-	p = skip_token(p);			/* skip cmin flt */
-	p = skip_token(p);			/* skip maj flt */
-	p = skip_token(p);			/* skip cmaj flt */
-
-	proc->time = strtoul(p, &p, 10);	/* utime */
-	proc->time += strtoul(p, &p, 10);	/* stime */
-
-	p = skip_token(p);			/* skip cutime */
-	p = skip_token(p);			/* skip cstime */
-	p = skip_token(p);			/* skip priority */
-	p = skip_token(p);			/* skip nice */
-	p = skip_token(p);			/* skip num_threads */
-	p = skip_token(p);			/* skip itrealvalue, 0 */
-	proc->start_time = strtoul(p, &p, 10);	/* start_time */
-	proc->size = bytetok(strtoul(p, &p, 10));	/* vsize */
-	proc->rss = pagetok(strtoul(p, &p, 10));	/* rss */
+	pthread_mutex_lock(&collect_lock);
+	while (collect_pending > 0)
+		pthread_cond_wait(&collect_done, &collect_lock);
+	pthread_mutex_unlock(&collect_lock);
+}
 
-#if 0
-	/* for the record, here are the rest of the fields */
-	p = skip_token(p);			/* skip rlim */
-	p = skip_token(p);			/* skip start_code */
-	p = skip_token(p);			/* skip end_code */
-	p = skip_token(p);			/* skip start_stack */
-	p = skip_token(p);			/* skip esp */
-	p = skip_token(p);			/* skip eip */
-	p = skip_token(p);			/* skip signal */
-	p = skip_token(p);			/* skip sigblocked */
-	p = skip_token(p);			/* skip sigignore */
-	p = skip_token(p);			/* skip sigcatch */
-	p = skip_token(p);			/* skip wchan */
-	p = skip_token(p);			/* skip nswap, not maintained */
-	p = skip_token(p);			/* exit signal */
-	p = skip_token(p);			/* processor */
-	p = skip_token(p);			/* rt_priority */
-	p = skip_token(p);			/* policy */
-	p = skip_token(p);			/* delayacct_blkio_ticks */
-#endif
+/*
+ * io_diffs - work out how much every io counter moved since the last sample,
+ * one column at a time
+ */
 
-	/* Get the io stats. */
-	sprintf(buffer, "%d/io", proc->pid);
-	fd = open(buffer, O_RDONLY);
-	if (fd == -1)
+static void
+io_diffs()
+{
+	int			c,
+				slot;
+
+	for (c = 0; c < NIOCOUNTERS; c++)
 	{
-		/*
-		 * CONFIG_TASK_IO_ACCOUNTING is not enabled in the Linux kernel or
-		 * this version of Linux may not support collecting i/o statistics per
-		 * pid.
-		 */
-		return;
+		long long  *now = col.io[c];
+		long long  *last = col.io_last[c];
+		long long  *diff = col.io_diff[c];
+
+		for (slot = 0; slot < nslots; slot++)
+			diff[slot] = now[slot] - last[slot];
 	}
-	len = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
+}
 
-	buffer[len] = '\0';
-	p = buffer;
+/*
+ * Sort keys for sort_top(), in the same order as proc_compares.  Each is the
+ * first of the ORDERKEYs used by that comparison routine, as an integer.
+ * Names have no such key.
+ */
+
+#define SORTKEY(name, expr) \
+static uint64_t \
+key_##name(const void *v) \
+{ \
+	const struct top_proc *p = (const struct top_proc *) v; \
+\
+	return (expr); \
+}
 
-	p = skip_token(p);			/* rchar */
-	p = skip_token(p);			/* wchar */
+SORTKEY(cpu, sort_key_double(col.pcpu[p->slot], 1))
+SORTKEY(iops, sort_key_int(col.io_diff[IO_IOPS][p->slot], 1))
+SORTKEY(iowait, sort_key_double(col.piowait[p->slot], 1))
+SORTKEY(lag_flush, sort_key_int(col.flush_lag[p->slot], 1))
+SORTKEY(lag_replay, sort_key_int(col.replay_lag[p->slot], 1))
+SORTKEY(lag_sent, sort_key_int(col.sent_lag[p->slot], 1))
+SORTKEY(lag_write, sort_key_int(col.write_lag[p->slot], 1))
+SORTKEY(locks, sort_key_int(col.locks[p->slot], 1))
+SORTKEY(qtime, sort_key_int(col.qtime[p->slot], 1))
+SORTKEY(reads, sort_key_int(col.io_diff[IO_READ_BYTES][p->slot], 1))
+SORTKEY(res, sort_key_int(col.rss[p->slot], 1))
+SORTKEY(rqwait, sort_key_double(col.prqwait[p->slot], 1))
+SORTKEY(size, sort_key_int(col.size[p->slot], 1))
+SORTKEY(syscr, sort_key_int(col.io_diff[IO_SYSCR][p->slot], 1))
+SORTKEY(syscw, sort_key_int(col.io_diff[IO_SYSCW][p->slot], 1))
+SORTKEY(writes, sort_key_int(col.io_diff[IO_WRITE_BYTES][p->slot], 1))
+SORTKEY(xtime, sort_key_int(col.xtime[p->slot], 1))
+
+static sort_key_fn proc_keys[] =
+{
+	key_cpu,
+		key_size,
+		key_res,
+		key_xtime,
+		key_qtime,
+		key_iops,
+		key_syscr,
+		key_syscw,
+		key_reads,
+		key_writes,
+		key_locks,
+		NULL,
+		key_lag_flush,
+		key_lag_replay,
+		key_lag_sent,
+		key_lag_write,
+		key_rqwait,
+		key_iowait
+};
 
-	GET_VALUE(tmp);				/* syscr */
-	proc->syscr[proc->index] = tmp;
-	proc->iops[proc->index] = tmp;
+/*
+ * sort_from_db - whether the processes are put in order by what the database
+ * sends alone, so that nothing from /proc is needed to pick the top ones
+ */
 
-	GET_VALUE(tmp);				/* syscw */
-	proc->syscw[proc->index] = tmp;
-	proc->iops[proc->index] += tmp;
+static int
+sort_from_db(struct process_select *sel, int compare_index)
+{
+	int			(*compare) () = compare_index >= 0 ?
+		proc_compares[compare_index] : NULL;
 
-	GET_VALUE(tmp);				/* read_bytes */
-	proc->read_bytes[proc->index] = tmp;
+	return compare == compare_xtime || compare == compare_qtime ||
+		compare == compare_locks ||
+		(compare == compare_cmd && sel->fullcmd == 2);
+}
 
-	GET_VALUE(tmp);				/* write_bytes */
-	proc->write_bytes[proc->index] = tmp;
+/*
+ * sample_filter - leave it to the server to drop the backends sel hides, and
+ * when sorting on a column it sends, to pick the ones to show.
+ */
 
-	GET_VALUE(tmp);				/* cancelled_write_bytes */
-	proc->write_bytes[proc->index] -= tmp;
+static void
+sample_filter(struct pg_sample_filter *filter, struct process_select *sel,
+			  int compare_index)
+{
+	int			(*compare) () = compare_index >= 0 ?
+		proc_compares[compare_index] : NULL;
+
+	filter->show_idle = sel->idle;
+	filter->usename = sel->usename;
+	filter->limit = sel->topn;
+	filter->tiebreak = 0;
+	if (compare == compare_xtime)
+		filter->order = PROC_XSTART + 1;
+	else if (compare == compare_qtime)
+		filter->order = PROC_QSTART + 1;
+	else if (compare == compare_locks && sel->lock_waits)
+	{
+		/* most backends wait on no lock: the rest go by query time */
+		filter->order = PROC_LOCK_WAIT + 1;
+		filter->tiebreak = PROC_QSTART + 1;
+	}
+	else
+		filter->order = 0;
 }
 
 caddr_t
@@ -782,61 +2432,128 @@ get_process_info(struct system_info *si,
 				 struct process_select *sel,
 				 int compare_index, struct pg_conninfo_ctx *conninfo, int mode)
 {
-	struct timeval thistime;
+	struct timespec thistime;
+	struct timespec sinceboot;
 	double		tickdiff;
-
-	/* calculate the time difference since our last check */
-	gettimeofday(&thistime, 0);
+	double		uptime;
+	int			lazy;
+	int			i,
+				nwork;
+
+	/*
+	 * Calculate the time difference since our last check, on a clock that
+	 * the wall clock being set cannot move.  The time since boot is on the
+	 * same clock as the start times of the processes.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &thistime);
 	if (lasttime.tv_sec)
 	{
 		timediff = ((thistime.tv_sec - lasttime.tv_sec) +
-					(thistime.tv_usec - lasttime.tv_usec) * 1e-6);
+					(thistime.tv_nsec - lasttime.tv_nsec) * 1e-9);
 	}
 	else
 	{
 		timediff = 0;
 	}
-	lasttime = thistime;
 
 	tickdiff = timediff * HZ;				/* convert to ticks */
+	clock_gettime(CLOCK_BOOTTIME, &sinceboot);
+	uptime = (sinceboot.tv_sec + sinceboot.tv_nsec * 1e-9) * HZ;
+
+	/*
+	 * When the order comes from the database alone, only the rows that will
+	 * be shown need reading from /proc, once they have been picked.
+	 */
+	lazy = mode == MODE_PROCESSES && sort_from_db(sel, compare_index);
 
 	/* read the process information */
 	{
 		int			total_procs = 0;
 		int			active_procs = 0;
 
-		int			show_idle = sel->idle;
-
-		int			i;
+		int			j;
 		int			rows;
+		int			nmissing;
+		int			pgstate;
 		PGresult   *pgresult = NULL;
+		struct pg_sample_filter filter;
 
-		struct top_proc *n,
-				   *p;
-
-		memset(process_states, 0, sizeof(process_states));
+		struct top_proc *n;
+		void	  **slot;
+		void	  **p;
+		pid_t		pid;
 
 		connect_to_db(conninfo);
 		if (conninfo->connection != NULL)
 		{
+			/* the cgroup is looked for again with each new connection */
+			if (cgroup_mount[0] != '\0' &&
+				PQbackendPID(conninfo->connection) != cgroup_backend)
+			{
+				cgroup_backend = PQbackendPID(conninfo->connection);
+				cgroup_found = cgroup_find(cgroup_backend) == 0;
+			}
+
 			if (mode == MODE_REPLICATION)
 			{
-				pgresult = pg_replication(conninfo->connection);
+				pgresult = pg_replication(conninfo);
 			}
 			else
 			{
-				pgresult = pg_processes(conninfo->connection);
+				/*
+				 * The query text is only sent when it has changed since the
+				 * last sample, unless that asked for a different width.
+				 */
+				sample_filter(&filter, sel, compare_index);
+				filter.width = sel->fullcmd == 2 ? sel->width : 0;
+				filter.since = filter.width == sent_width &&
+					mode == last_mode ? sampled_at : "";
+				pgresult = pg_processes(conninfo, &filter);
 			}
-			rows = PQntuples(pgresult);
 		}
-		else
+
+		/*
+		 * Without an answer from the database keep the last sample on the
+		 * screen until the connection comes back, unless it was taken in the
+		 * other mode.
+		 */
+		if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
+		{
+			PQclear(pgresult);
+			if (mode != last_mode)
+			{
+				memset(process_states, 0, sizeof(process_states));
+				si->p_active = si->p_total = 0;
+			}
+			si->procstates = process_states;
+			proc_index = 0;
+			return (caddr_t) 0;
+		}
+		rows = PQntuples(pgresult);
+		lasttime = thistime;
+		last_mode = mode;
+		sent_width = mode == MODE_REPLICATION ? -1 : filter.width;
+		nmissing = 0;
+
+		memset(process_states, 0, sizeof(process_states));
+		generation++;
+
+		/* The backends in each state are counted in the last rows. */
+		while (mode != MODE_REPLICATION && rows > 0 &&
+			   PQgetisnull(pgresult, rows - 1, PROC_PID))
 		{
-			rows = 0;
+			rows--;
+			pgstate = STATE_UNDEFINED;
+			update_state(&pgstate, PQgetvalue(pgresult, rows, PROC_STATE));
+			process_states[pgstate] += pg_getint(pgresult, rows, PROC_COUNT);
+			total_procs += pg_getint(pgresult, rows, PROC_COUNT);
+			strncpy(sampled_at, PQgetvalue(pgresult, rows, PROC_SAMPLED_AT),
+					sizeof(sampled_at) - 1);
 		}
 
 		if (rows > 0)
 		{
-			p = reallocarray(pgtable, rows, sizeof(struct top_proc));
+			p = reallocarray(pgtable, rows, sizeof(void *));
 			if (p == NULL)
 			{
 				fprintf(stderr, "reallocarray error\n");
@@ -847,13 +2564,43 @@ get_process_info(struct system_info *si,
 			}
 			pgtable = p;
 		}
+		if (rows > workset_size)
+		{
+			struct top_proc **w;
+			int		   *m;
+
+			w = reallocarray(workset, rows * 2, sizeof(struct top_proc *));
+			if (w == NULL)
+			{
+				fprintf(stderr, "reallocarray error\n");
+				if (pgresult != NULL)
+					PQclear(pgresult);
+				disconnect_from_db(conninfo);
+				exit(1);
+			}
+			workset = w;
+			workset_size = rows;
+
+			if ((m = reallocarray(missing, rows, sizeof(int))) == NULL)
+			{
+				fprintf(stderr, "reallocarray error\n");
+				PQclear(pgresult);
+				disconnect_from_db(conninfo);
+				exit(1);
+			}
+			missing = m;
+		}
 
+		/*
+		 * First find the node for every row.  The tree and the list of pids
+		 * are only ever touched from this thread.
+		 */
+		nwork = 0;
 		for (i = 0; i < rows; i++)
 		{
-			unsigned long otime;
-
-			n = malloc(sizeof(struct top_proc));
-			if (n == NULL)
+			pid = pg_getint(pgresult, i, 0);
+			slot = pid_hash_enter(&proc_hash, pid);
+			if (slot == NULL)
 			{
 				fprintf(stderr, "malloc error\n");
 				if (pgresult != NULL)
@@ -861,89 +2608,160 @@ get_process_info(struct system_info *si,
 				disconnect_from_db(conninfo);
 				exit(1);
 			}
-			memset(n, 0, sizeof(struct top_proc));
-			n->pid = atoi(PQgetvalue(pgresult, i, 0));
-			p = RB_INSERT(pgproc, &head_proc, n);
-			if (p != NULL)
+			n = *slot;
+			if (n == NULL)
 			{
-				free(n);
-				n = p;
+				n = pool_alloc(&proc_pool);
+				if (n == NULL)
+				{
+					fprintf(stderr, "malloc error\n");
+					if (pgresult != NULL)
+						PQclear(pgresult);
+					disconnect_from_db(conninfo);
+					exit(1);
+				}
+				if ((n->slot = slot_alloc()) < 0)
+				{
+					fprintf(stderr, "malloc error\n");
+					if (pgresult != NULL)
+						PQclear(pgresult);
+					disconnect_from_db(conninfo);
+					exit(1);
+				}
+				n->pid = pid;
+				for (j = 0; j < NPIDFILES; j++)
+					n->fd[j] = -1;
+				*slot = n;
 			}
-			else
+
+			workset[i] = n;
+			if (n->generation != generation)
 			{
-				n->time = 0;
+				lru_touch(n);
+				if (mode != MODE_REPLICATION)
+					workset[rows + nwork++] = n;
 			}
+		}
+
+		/* Drop the backends that have exited since the last sample. */
+		reap_procs();
 
-			otime = n->time;
+		/* Then read /proc for the rest, possibly in parallel. */
+		if (nwork > 0 && !lazy)
+		{
+			collect_procs(&workset[rows], nwork, sel, tickdiff, uptime);
+			io_diffs();
+		}
+
+		/* Finally merge in the database side in result order. */
+		for (i = 0; i < rows; i++)
+		{
+			n = workset[i];
 
 			if (mode == MODE_REPLICATION)
 			{
-				update_str(&n->usename, PQgetvalue(pgresult, i, REP_USENAME));
-				update_str(&n->application_name,
-						PQgetvalue(pgresult, i, REP_APPLICATION_NAME));
-				update_str(&n->client_addr,
-						PQgetvalue(pgresult, i, REP_CLIENT_ADDR));
-				update_str(&n->repstate, PQgetvalue(pgresult, i, REP_STATE));
-				update_str(&n->primary,
-						PQgetvalue(pgresult, i, REP_WAL_INSERT));
-				update_str(&n->sent, PQgetvalue(pgresult, i, REP_SENT));
-				update_str(&n->write, PQgetvalue(pgresult, i, REP_WRITE));
-				update_str(&n->flush, PQgetvalue(pgresult, i, REP_FLUSH));
-				update_str(&n->replay, PQgetvalue(pgresult, i, REP_REPLAY));
-				n->sent_lag = atol(PQgetvalue(pgresult, i, REP_SENT_LAG));
-				n->write_lag = atol(PQgetvalue(pgresult, i, REP_WRITE_LAG));
-				n->flush_lag = atol(PQgetvalue(pgresult, i, REP_FLUSH_LAG));
-				n->replay_lag = atol(PQgetvalue(pgresult, i, REP_REPLAY_LAG));
-
-				memcpy(&pgtable[active_procs++], n, sizeof(struct top_proc));
+				struct top_proc_rep *rep = n->rep;
+
+				if (rep == NULL &&
+					(rep = n->rep = calloc(1, sizeof(*rep))) == NULL)
+				{
+					fprintf(stderr, "malloc error\n");
+					if (pgresult != NULL)
+						PQclear(pgresult);
+					disconnect_from_db(conninfo);
+					exit(1);
+				}
+				if ((n->usename =
+					 intern(PQgetvalue(pgresult, i, REP_USENAME))) == NULL ||
+					(rep->application_name =
+					 intern(PQgetvalue(pgresult, i, REP_APPLICATION_NAME))) == NULL ||
+					(rep->client_addr =
+					 intern(PQgetvalue(pgresult, i, REP_CLIENT_ADDR))) == NULL ||
+					(rep->repstate =
+					 intern(PQgetvalue(pgresult, i, REP_STATE))) == NULL)
+				{
+					fprintf(stderr, "malloc error\n");
+					PQclear(pgresult);
+					disconnect_from_db(conninfo);
+					exit(1);
+				}
+				rep->primary = pg_getlsn(pgresult, i, REP_WAL_INSERT);
+				rep->sent = pg_getlsn(pgresult, i, REP_SENT);
+				rep->write = pg_getlsn(pgresult, i, REP_WRITE);
+				rep->flush = pg_getlsn(pgresult, i, REP_FLUSH);
+				rep->replay = pg_getlsn(pgresult, i, REP_REPLAY);
+				col.sent_lag[n->slot] = pg_getint(pgresult, i, REP_SENT_LAG);
+				col.write_lag[n->slot] = pg_getint(pgresult, i, REP_WRITE_LAG);
+				col.flush_lag[n->slot] = pg_getint(pgresult, i, REP_FLUSH_LAG);
+				col.replay_lag[n->slot] =
+					pg_getint(pgresult, i, REP_REPLAY_LAG);
+
+				pgtable[active_procs++] = n;
 			}
 			else
 			{
-				read_one_proc_stat(n, sel);
-				if (sel->fullcmd == 2)
+				/* made printable when it is formatted */
+				if (sel->fullcmd != 2)
 				{
-					update_str(&n->name, PQgetvalue(pgresult, i, PROC_QUERY));
-					printable(n->name);
+					free(n->query);
+					n->query = NULL;
 				}
-				update_state(&n->pgstate, PQgetvalue(pgresult, i, PROC_STATE));
-				update_str(&n->usename, PQgetvalue(pgresult, i, PROC_USENAME));
-				n->xtime = atol(PQgetvalue(pgresult, i, PROC_XSTART));
-				n->qtime = atol(PQgetvalue(pgresult, i, PROC_QSTART));
-				n->locks = atoi(PQgetvalue(pgresult, i, PROC_LOCKS));
+				else if (!PQgetisnull(pgresult, i, PROC_QUERY))
+					update_str(&n->query, PQgetvalue(pgresult, i, PROC_QUERY));
+				else if (n->query == NULL)
+					missing[nmissing++] = n->pid;
+				update_state(&col.pgstate[n->slot],
+							 PQgetvalue(pgresult, i, PROC_STATE));
+				n->usename = pg_role_name(conninfo,
+										  pg_getint(pgresult, i, PROC_USESYSID));
+				col.xtime[n->slot] = pg_getint(pgresult, i, PROC_XSTART);
+				col.qtime[n->slot] = pg_getint(pgresult, i, PROC_QSTART);
+				if (sel->lock_waits)
+					col.locks[n->slot] = pg_getint(pgresult, i, PROC_LOCK_WAIT);
+
+				pgtable[active_procs++] = n;
+			}
+		}
+		if (mode == MODE_REPLICATION)
+			total_procs = rows;
 
-				process_states[n->pgstate]++;
+		/*
+		 * Counting pg_locks is expensive on a busy server, so it is only done
+		 * every lock_interval seconds, or every time when it is the sort key.
+		 */
+		if (mode != MODE_REPLICATION && !sel->lock_waits &&
+			((compare_index >= 0 &&
+			  proc_compares[compare_index] == compare_locks) ||
+			 locks_counted == 0 ||
+			 thistime.tv_sec - locks_counted >= sel->lock_interval))
+			count_locks(conninfo, rows, thistime.tv_sec);
 
-				if (tickdiff > 0.0)
-				{
-					if ((n->pcpu = (n->time - otime) / tickdiff) < 0.0001)
-					{
-						n->pcpu = 0;
-					}
-				}
+		/* Backends new to us have to ask for the query they are running. */
+		if (nmissing > 0)
+			fetch_query_texts(conninfo, nmissing, sel->width);
 
-				if ((show_idle || n->pgstate != STATE_IDLE) &&
-					(sel->usename[0] == '\0' ||
-					 strcmp(n->usename, sel->usename) == 0))
-					memcpy(&pgtable[active_procs++], n,
-						   sizeof(struct top_proc));
-			}
-			n->index = (n->index + 1) % 2;
-			total_procs++;
-		}
-		if (pgresult != NULL)
-			PQclear(pgresult);
-		disconnect_from_db(conninfo);
+		PQclear(pgresult);
 
 		si->p_active = active_procs;
 		si->p_total = total_procs;
 		si->procstates = process_states;
 	}
 
-	/* if requested, sort the "active" procs */
+	/* if requested, sort the "active" procs that are going to be shown */
 	if (compare_index >= 0 && si->p_active)
 	{
-		qsort(pgtable, si->p_active, sizeof(struct top_proc),
-			  proc_compares[compare_index]);
+		sort_top(pgtable, si->p_active, sel->topn,
+				 proc_compares[compare_index], proc_keys[compare_index]);
+	}
+
+	/* and read /proc for those that made it to the screen */
+	if (lazy)
+	{
+		nwork = si->p_active < sel->topn ? si->p_active : sel->topn;
+		for (i = 0; i < nwork; i++)
+			workset[i] = pgtable[i];
+		if (nwork > 0)
+			collect_procs(workset, nwork, sel, tickdiff, uptime);
 	}
 
 	/* don't even pretend that the return value thing here isn't bogus */
@@ -965,69 +2783,79 @@ format_header(char *uname_field)
 }
 
 char *
-format_next_io(caddr_t handle)
+format_next_io(caddr_t handle, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
+	struct top_proc *p = pgtable[proc_index++];
+	double		secs = col.elapsed[p->slot] / HZ;	/* since the last read */
+	char		read_bytes[FORMAT_SIZE];
+	char		write_bytes[FORMAT_SIZE];
 
-	snprintf(fmt, sizeof(fmt),
-			"%5d %7.0f %7.0f %7.0f %5s %6s %s",
+	snprintf(fmt, MAX_COLS,
+			"%5d %7.0f %7.0f %7.0f %5s %6s %7.1f %s",
 			p->pid,
-			diff_stat(p->iops, p->index) / timediff,
-			diff_stat(p->syscr, p->index) / timediff,
-			diff_stat(p->syscw, p->index) / timediff,
-			format_b(diff_stat(p->read_bytes, p->index) / timediff),
-			format_b(diff_stat(p->write_bytes, p->index) / timediff),
-			p->name);
-
-	return (fmt);
+			col.io_diff[IO_IOPS][p->slot] / secs,
+			col.io_diff[IO_SYSCR][p->slot] / secs,
+			col.io_diff[IO_SYSCW][p->slot] / secs,
+			format_b(col.io_diff[IO_READ_BYTES][p->slot] / secs, read_bytes),
+			format_b(col.io_diff[IO_WRITE_BYTES][p->slot] / secs,
+					 write_bytes),
+			col.piowait[p->slot] * 100.0,
+			proc_command(p));
+
+	return (printable(fmt));
 }
 
 char *
-format_next_process(caddr_t handle)
+format_next_process(caddr_t handle, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
-
-	snprintf(fmt, sizeof(fmt),
-			 "%7d %-10.8s %5s %5s %-6s %5s %5s %5.1f %5d %s",
+	struct top_proc *p = pgtable[proc_index++];
+	char		size[FORMAT_SIZE];
+	char		rss[FORMAT_SIZE];
+	char		xtime[FORMAT_SIZE];
+	char		qtime[FORMAT_SIZE];
+
+	snprintf(fmt, MAX_COLS,
+			 "%7d %-10.8s %5s %5s %-6s %5s %5s %5.1f %7.1f %7.1f %5d %s",
 			 p->pid,
 			 p->usename,
-			 format_k(p->size),
-			 format_k(p->rss),
-			 backendstatenames[p->pgstate],
-			 format_time(p->xtime),
-			 format_time(p->qtime),
-			 p->pcpu * 100.0,
-			 p->locks,
-			 p->name);
+			 format_k(col.size[p->slot], size),
+			 format_k(col.rss[p->slot], rss),
+			 backendstatenames[col.pgstate[p->slot]],
+			 format_time(col.xtime[p->slot], xtime),
+			 format_time(col.qtime[p->slot], qtime),
+			 col.pcpu[p->slot] * 100.0,
+			 col.prqwait[p->slot] * 100.0,
+			 col.piowait[p->slot] * 100.0,
+			 col.locks[p->slot],
+			 proc_command(p));
 
 	/* return the result */
-	return (fmt);
+	return (printable(fmt));
 }
 
 char *
-format_next_replication(caddr_t handle)
+format_next_replication(caddr_t handle, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc *p = &pgtable[proc_index++];
+	struct top_proc *p = pgtable[proc_index++];
+	char		lsn[5][FORMAT_SIZE];
+	char		lag[4][FORMAT_SIZE];
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			 "%5d %-8.8s %-11.11s %15s %-9.9s %-10.10s %-10.10s %-10.10s %-10.10s %-10.10s %5s %5s %5s %5s",
 			 p->pid,
 			 p->usename,
-			 p->application_name,
-			 p->client_addr,
-			 p->repstate,
-			 p->primary,
-			 p->sent,
-			 p->write,
-			 p->flush,
-			 p->replay,
-			 format_b(p->sent_lag),
-			 format_b(p->write_lag),
-			 format_b(p->flush_lag),
-			 format_b(p->replay_lag));
+			 p->rep->application_name,
+			 p->rep->client_addr,
+			 p->rep->repstate,
+			 format_lsn(p->rep->primary, lsn[0]),
+			 format_lsn(p->rep->sent, lsn[1]),
+			 format_lsn(p->rep->write, lsn[2]),
+			 format_lsn(p->rep->flush, lsn[3]),
+			 format_lsn(p->rep->replay, lsn[4]),
+			 format_b(col.sent_lag[p->slot], lag[0]),
+			 format_b(col.write_lag[p->slot], lag[1]),
+			 format_b(col.flush_lag[p->slot], lag[2]),
+			 format_b(col.replay_lag[p->slot], lag[3]));
 
 	/* return the result */
 	return (fmt);
@@ -1052,29 +2880,45 @@ format_next_replication(caddr_t handle)
    desired ordering.
  */
 
-#define ORDERKEY_IOPS   if ((result = diff_stat(p2->iops, p2->index) - \
-			                          diff_stat(p1->iops, p1->index)) == 0)
-#define ORDERKEY_LAG_FLUSH  if ((result = p2->flush_lag - p1->flush_lag) == 0)
-#define ORDERKEY_LAG_REPLAY if ((result = p2->replay_lag - \
-                                          p1->replay_lag) == 0)
-#define ORDERKEY_LAG_SENT   if ((result = p2->sent_lag - p1->sent_lag) == 0)
-#define ORDERKEY_LAG_WRITE  if ((result = p2->write_lag - p1->write_lag) == 0)
-#define ORDERKEY_LOCKS   if ((result = p2->locks - p1->locks) == 0)
-#define ORDERKEY_MEM     if ((result = p2->size - p1->size) == 0)
-#define ORDERKEY_NAME    if ((result = strcmp(p1->name, p2->name)) == 0)
-#define ORDERKEY_PCTCPU  if ((result = (int)(p2->pcpu - p1->pcpu)) == 0)
-#define ORDERKEY_QTIME   if ((result = p2->qtime - p1->qtime) == 0)
-#define ORDERKEY_READS   if ((result = diff_stat(p2->read_bytes, p2->index) - \
-			                           diff_stat(p1->read_bytes, p1->index)) == 0)
-#define ORDERKEY_RSSIZE  if ((result = p2->rss - p1->rss) == 0)
-#define ORDERKEY_STATE   if ((result = p1->pgstate < p2->pgstate))
-#define ORDERKEY_SYSCR   if ((result = diff_stat(p2->syscr, p2->index) - \
-                                       diff_stat(p1->syscr, p1->index)) == 0)
-#define ORDERKEY_SYSCW   if ((result = diff_stat(p2->syscw, p2->index) - \
-                                       diff_stat(p1->syscw, p1->index)) == 0)
-#define ORDERKEY_WRITES  if ((result = diff_stat(p2->write_bytes, p2->index) - \
-			                           diff_stat(p1->write_bytes, p1->index)) == 0)
-#define ORDERKEY_XTIME   if ((result = p2->xtime - p1->xtime) == 0)
+#define ORDERKEY_IOPS   if ((result = compare_value(col.io_diff[IO_IOPS][p2->slot], \
+			                          col.io_diff[IO_IOPS][p1->slot])) == 0)
+#define ORDERKEY_IOWAIT  if ((result = compare_value(col.piowait[p2->slot], \
+                                       col.piowait[p1->slot])) == 0)
+#define ORDERKEY_LAG_FLUSH  if ((result = compare_value(col.flush_lag[p2->slot], \
+                                          col.flush_lag[p1->slot])) == 0)
+#define ORDERKEY_LAG_REPLAY if ((result = compare_value(col.replay_lag[p2->slot], \
+                                          col.replay_lag[p1->slot])) == 0)
+#define ORDERKEY_LAG_SENT   if ((result = compare_value(col.sent_lag[p2->slot], \
+                                          col.sent_lag[p1->slot])) == 0)
+#define ORDERKEY_LAG_WRITE  if ((result = compare_value(col.write_lag[p2->slot], \
+                                          col.write_lag[p1->slot])) == 0)
+#define ORDERKEY_LOCKS   if ((result = compare_value(col.locks[p2->slot], \
+                                       col.locks[p1->slot])) == 0)
+#define ORDERKEY_MEM     if ((result = compare_value(col.size[p2->slot], \
+                                       col.size[p1->slot])) == 0)
+#define ORDERKEY_NAME    if ((result = strcmp(proc_command(p1), \
+												  proc_command(p2))) == 0)
+#define ORDERKEY_PCTCPU  if ((result = compare_value(col.pcpu[p2->slot], \
+                                       col.pcpu[p1->slot])) == 0)
+#define ORDERKEY_QTIME   if ((result = compare_value(col.qtime[p2->slot], \
+                                       col.qtime[p1->slot])) == 0)
+#define ORDERKEY_READS   if ((result = compare_value(col.io_diff[IO_READ_BYTES][p2->slot], \
+			                           col.io_diff[IO_READ_BYTES][p1->slot])) == 0)
+#define ORDERKEY_RQWAIT  if ((result = compare_value(col.prqwait[p2->slot], \
+                                       col.prqwait[p1->slot])) == 0)
+#define ORDERKEY_RSSIZE  if ((result = compare_value(col.rss[p2->slot], \
+                                       col.rss[p1->slot])) == 0)
+#define ORDERKEY_STATE   if ((result = compare_value(col.pgstate[p2->slot], \
+                                       col.pgstate[p1->slot])) == 0)
+#define ORDERKEY_SYSCR   if ((result = compare_value(col.io_diff[IO_SYSCR][p2->slot], \
+                                       col.io_diff[IO_SYSCR][p1->slot])) == 0)
+#define ORDERKEY_SYSCW   if ((result = compare_value(col.io_diff[IO_SYSCW][p2->slot], \
+                                       col.io_diff[IO_SYSCW][p1->slot])) == 0)
+#define ORDERKEY_WRITES  if ((result = compare_value(col.io_diff[IO_WRITE_BYTES][p2->slot], \
+			                           col.io_diff[IO_WRITE_BYTES][p1->slot])) == 0)
+#define ORDERKEY_XTIME   if ((result = compare_value(col.xtime[p2->slot], \
+                                       col.xtime[p1->slot])) == 0)
+
 
 /* compare_cmd - the comparison function for sorting by command name */
 
@@ -1133,6 +2977,25 @@ compare_iops(const void *v1, const void *v2)
 	return (result);
 }
 
+/* compare_iowait - the comparison function for sorting by block io wait */
+
+static int
+compare_iowait(const void *v1, const void *v2)
+{
+	struct top_proc *p1 = (struct top_proc *) v1;
+	struct top_proc *p2 = (struct top_proc *) v2;
+	int			result;
+
+	ORDERKEY_IOWAIT
+		ORDERKEY_PCTCPU
+		ORDERKEY_STATE
+		ORDERKEY_RSSIZE
+		ORDERKEY_MEM
+		;
+
+	return (result);
+}
+
 static int
 compare_lag_flush(const void *v1, const void *v2)
 {
@@ -1278,6 +3141,25 @@ compare_res(const void *v1, const void *v2)
 	return (result);
 }
 
+/* compare_rqwait - the comparison function for sorting by run queue wait */
+
+static int
+compare_rqwait(const void *v1, const void *v2)
+{
+	struct top_proc *p1 = (struct top_proc *) v1;
+	struct top_proc *p2 = (struct top_proc *) v2;
+	int			result;
+
+	ORDERKEY_RQWAIT
+		ORDERKEY_PCTCPU
+		ORDERKEY_STATE
+		ORDERKEY_RSSIZE
+		ORDERKEY_MEM
+		;
+
+	return (result);
+}
+
 /* compare_size - the comparison function for sorting by total memory usage */
 
 static int
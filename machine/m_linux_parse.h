@@ -0,0 +1,189 @@
+/*
+ * machine/m_linux_parse.h
+ *
+ * Parsers for the files m_linux.c reads under /proc/<pid>, kept apart so
+ * that bench/ and fuzz/ can build them on their own.
+ */
+
+#ifndef _M_LINUX_PARSE_H_
+#define _M_LINUX_PARSE_H_
+
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * The files read for every backend on every sample are parsed in place, in a
+ * single pass, without calling into the C library for each field.  Nothing in
+ * here trusts the input: every helper stops at end and reports a malformed
+ * buffer by returning NULL or -1.
+ */
+
+/*
+ * skip_fields - return the start of the field n fields after the one at p,
+ * where fields are separated by exactly one space as in /proc/<pid>/stat
+ */
+
+static inline const char *
+skip_fields(const char *p, const char *end, int n)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+	const __m128i space = _mm_set1_epi8(' ');
+
+	/* count the separators sixteen bytes at a time */
+	while (end - p >= 16)
+	{
+		__m128i		chunk = _mm_loadu_si128((const __m128i *) p);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space));
+		int			count = __builtin_popcount(mask);
+
+		if (count >= n)
+		{
+			while (--n > 0)
+				mask &= mask - 1;
+			return p + __builtin_ctz(mask) + 1;
+		}
+		n -= count;
+		p += 16;
+	}
+#endif
+
+	for (; p < end; p++)
+	{
+		if (*p == ' ' && --n == 0)
+			return p + 1;
+	}
+	return NULL;
+}
+
+/*
+ * scan_number - read the unsigned decimal number at *pp, after any blanks,
+ * and leave *pp just past it.  Returns -1 if there is no number there.
+ */
+
+static inline int
+scan_number(const char **pp, const char *end, unsigned long long *value)
+{
+	const char *p = *pp;
+	unsigned long long v = 0;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p >= end || (unsigned char) (*p - '0') > 9)
+		return -1;
+	do
+	{
+		v = v * 10 + (*p++ - '0');
+	} while (p < end && (unsigned char) (*p - '0') <= 9);
+
+	*pp = p;
+	*value = v;
+	return 0;
+}
+
+/* longest command shown in /proc/<pid>/stat, see proc_task_name() */
+#define COMM_MAX	64
+
+/* the fields of /proc/<pid>/stat that we use, see proc(5) */
+struct stat_fields
+{
+	char	   *comm;			/* terminated in place in the buffer */
+	char		state;
+	unsigned long long utime;
+	unsigned long long stime;
+	unsigned long long start_time;
+	unsigned long long vsize;
+	unsigned long long rss;
+	unsigned long long blkio;	/* delayacct_blkio_ticks, 0 if not there */
+};
+
+/* parse_stat - pick the fields we want out of /proc/<pid>/stat */
+
+static inline int
+parse_stat(char *buffer, int len, struct stat_fields *f)
+{
+	char	   *end = buffer + len;
+	char	   *q;
+	const char *p;
+
+	/*
+	 * The command is in parentheses and may itself contain spaces and
+	 * parentheses, so look for the last ')'.  Nothing after the command can
+	 * contain one, so it is enough to look back from where the longest
+	 * command could end.
+	 */
+	if ((p = memchr(buffer, '(', len)) == NULL)
+		return -1;
+	q = end - p > COMM_MAX + 2 ? (char *) p + COMM_MAX + 1 : end - 1;
+	for (; q > p && *q != ')'; q--)
+		;
+	if (q == p || end - q < 4)
+		return -1;
+	*q = '\0';
+	f->comm = (char *) p + 1;
+
+	/* from here on the fields are separated by single spaces */
+	p = q + 2;
+	f->state = *p;
+
+	/* utime is field 14, counting the pid as 1 */
+	if ((p = skip_fields(p, end, 11)) == NULL ||
+		scan_number(&p, end, &f->utime) != 0 ||
+		scan_number(&p, end, &f->stime) != 0)
+		return -1;
+
+	/* then starttime, vsize and rss are fields 22 to 24 */
+	if ((p = skip_fields(p + 1, end, 6)) == NULL ||
+		scan_number(&p, end, &f->start_time) != 0 ||
+		scan_number(&p, end, &f->vsize) != 0 ||
+		scan_number(&p, end, &f->rss) != 0)
+		return -1;
+
+	/*
+	 * delayacct_blkio_ticks is field 42.  Kernels older than 2.6.18 stop
+	 * before it.
+	 */
+	if ((p = skip_fields(p + 1, end, 17)) == NULL ||
+		scan_number(&p, end, &f->blkio) != 0)
+		f->blkio = 0;
+
+	return 0;
+}
+
+enum io_field
+{
+	IOF_RCHAR,
+	IOF_WCHAR,
+	IOF_SYSCR,
+	IOF_SYSCW,
+	IOF_READ_BYTES,
+	IOF_WRITE_BYTES,
+	IOF_CANCELLED_WRITE_BYTES,
+	NIOFIELDS
+};
+
+/*
+ * parse_io - read the values of /proc/<pid>/io, which come one per line as
+ * "name: value" in the order of enum io_field
+ */
+
+static inline int
+parse_io(const char *buffer, int len, unsigned long long values[NIOFIELDS])
+{
+	const char *end = buffer + len;
+	const char *p = buffer;
+	int			i;
+
+	for (i = 0; i < NIOFIELDS; i++)
+	{
+		if ((p = memchr(p, ':', end - p)) == NULL)
+			return -1;
+		p++;
+		if (scan_number(&p, end, &values[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+#endif							/* _M_LINUX_PARSE_H_ */
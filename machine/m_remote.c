@@ -3,15 +3,9 @@
  */
 
 #include <stdlib.h>
-#ifdef __FreeBSD__
-#include <sys/tree.h>
-#endif /* __FreeBSD__*/
-#ifdef __linux__
-#include <bsd/stdlib.h>
-#include <bsd/sys/tree.h>
-#endif							/* __linux__ */
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <libpq-fe.h>
 
@@ -33,51 +27,39 @@
 		"       swapused, swapfree, swapcached\n" \
 		"FROM pg_memusage()"
 
-#define QUERY_PROCTAB \
-		"WITH lock_activity AS\n" \
-		"(\n" \
-		"     SELECT pid, count(*) AS lock_count\n" \
-		"     FROM pg_locks\n" \
-		"     WHERE relation IS NOT NULL\n" \
-		"     GROUP BY pid\n" \
-		")\n" \
-		"SELECT a.pid, comm, fullcomm, a.state, utime, stime,\n" \
-		"       starttime, vsize, rss, usename, rchar, wchar,\n" \
-		"       syscr, syscw, reads, writes, cwrites, b.state,\n" \
-		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
-		"                              xact_start))::BIGINT,\n" \
-		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
-		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
-		"FROM pg_proctab() a LEFT OUTER JOIN pg_stat_activity b\n" \
-		"                    ON a.pid = b.pid\n" \
-		"     LEFT OUTER JOIN lock_activity c\n" \
-		"  ON a.pid = c.pid;"
-
-#define QUERY_PROCTAB_QUERY \
-		"WITH lock_activity AS\n" \
-		"(\n" \
-		"     SELECT pid, count(*) AS lock_count\n" \
-		"     FROM pg_locks\n" \
-		"     GROUP BY pid\n" \
-		")\n" \
-		"SELECT a.pid, comm, query, a.state, utime, stime,\n" \
-		"       starttime, vsize, rss, usename, rchar, wchar,\n" \
-		"       syscr, syscw, reads, writes, cwrites, b.state,\n" \
+/*
+ * The lock counts are not joined in here; see count_locks_r().  command is
+ * the column shown as the command, cut to the width pg_sample() binds to $1,
+ * lock_wait flags a backend waiting on a lock.  pg_sample() filters and
+ * sorts these on the server; the last column is only set in the rows that
+ * count the backends in each state.
+ */
+#define QUERY_PROCTAB_SELECT(command, lock_wait) \
+		"SELECT a.pid, comm, left(" command ", $1), a.state, utime, stime,\n" \
+		"       starttime, vsize, rss, b.usesysid, rchar, wchar,\n" \
+		"       syscr, syscw, reads, writes, cwrites,\n" \
+		"       b.state AS backend_state,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              xact_start))::BIGINT,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
+		"       " lock_wait ",\n" \
+		"       NULL::INTEGER\n" \
 		"FROM pg_proctab() a LEFT OUTER JOIN pg_stat_activity b\n" \
-		"                    ON a.pid = b.pid\n" \
-		"     LEFT OUTER JOIN lock_activity c\n" \
-		"  ON a.pid = c.pid;"
+		"                    ON a.pid = b.pid"
+
+#define LOCK_WAIT "(wait_event_type = 'Lock')::INTEGER"
+#define LOCK_WAIT_9_5 "waiting::INTEGER"
+
+#define QUERY_PROCTAB QUERY_PROCTAB_SELECT("fullcomm", LOCK_WAIT)
+#define QUERY_PROCTAB_9_5 QUERY_PROCTAB_SELECT("fullcomm", LOCK_WAIT_9_5)
+#define QUERY_PROCTAB_QUERY QUERY_PROCTAB_SELECT("query", LOCK_WAIT)
+#define QUERY_PROCTAB_QUERY_9_5 QUERY_PROCTAB_SELECT("query", LOCK_WAIT_9_5)
 
-#define QUERY_PG_PROC \
-		"SELECT COUNT(*)\n" \
-		"FROM pg_catalog.pg_proc\n" \
-		"WHERE proname = '%s'"
+#define PROCTAB_COUNT \
+		"NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,\n" \
+		"       NULL, NULL, NULL, NULL, NULL, NULL, NULL, backend_state,\n" \
+		"       NULL, NULL, NULL, count(*)::INTEGER"
 
 enum column_cputime
 {
@@ -96,9 +78,9 @@ enum column_memusage
 enum column_proctab
 {
 	c_pid, c_comm, c_fullcomm, c_state, c_utime, c_stime,
-	c_starttime, c_vsize, c_rss, c_username,
+	c_starttime, c_vsize, c_rss, c_usesysid,
 	c_rchar, c_wchar, c_syscr, c_syscw, c_reads, c_writes, c_cwrites,
-	c_pgstate, c_xtime, c_qtime, c_locks
+	c_pgstate, c_xtime, c_qtime, c_lock_wait, c_count
 };
 
 #define bytetok(x)  (((x) + 512) >> 10)
@@ -123,10 +105,12 @@ enum column_proctab
 
 struct top_proc_r
 {
-	RB_ENTRY(top_proc_r) entry;
 	pid_t		pid;
-	char	   *name;
-	char	   *usename;
+	unsigned int generation;	/* last sample this pid was seen in */
+	struct top_proc_r *lru_prev;
+	struct top_proc_r *lru_next;
+	const char *name;			/* points into shown_result */
+	const char *usename;		/* interned */
 	unsigned long size;
 	unsigned long rss;			/* in k */
 	int			state;
@@ -156,15 +140,15 @@ struct top_proc_r
 	long long	write_bytes;
 	long long	cancelled_write_bytes;
 
-	/* Replication data */
-	char	   *application_name;
-	char	   *client_addr;
-	char	   *repstate;
-	char	   *primary;
-	char	   *sent;
-	char	   *write;
-	char	   *flush;
-	char	   *replay;
+	/* Replication data, interned */
+	const char *application_name;
+	const char *client_addr;
+	const char *repstate;
+	uint64_t	primary;
+	uint64_t	sent;
+	uint64_t	write;
+	uint64_t	flush;
+	uint64_t	replay;
 	long long	sent_lag;
 	long long	write_lag;
 	long long	flush_lag;
@@ -172,14 +156,22 @@ struct top_proc_r
 };
 
 static time_t boottime = -1;
-static struct top_proc_r *pgrtable;
+static void **pgrtable;			/* the nodes to display, in order */
 static int	proc_r_index;
+static int	last_mode = -1;		/* mode of the last sample taken */
+static PGresult *shown_result;	/* the sample on the screen */
+static time_t locks_counted;	/* when pg_locks was last counted, on
+								 * CLOCK_MONOTONIC */
 
-int			topprocrcmp(struct top_proc_r *, struct top_proc_r *);
-
-RB_HEAD(pgprocr, top_proc_r) head_proc_r = RB_INITIALIZER(&head_proc_r);
-RB_PROTOTYPE(pgprocr, top_proc_r, entry, topprocrcmp)
-RB_GENERATE(pgprocr, top_proc_r, entry, topprocrcmp)
+/*
+ * Every pid we know about is kept on a list in the order it was last
+ * sampled, so the ones that have gone away can be reaped from the tail.
+ */
+static struct top_proc_r *lru_head;
+static struct top_proc_r *lru_tail;
+static unsigned int generation;
+static struct node_pool proc_r_pool = NODE_POOL_INITIALIZER(struct top_proc_r);
+static struct pid_hash proc_r_hash = PID_HASH_INITIALIZER;
 
 static char *cpustatenames[NCPUSTATES + 1] =
 {
@@ -231,34 +223,94 @@ static long memory_stats[NMEMSTATS];
 static int	process_states[NPROCSTATES];
 static long swap_stats[NSWAPSTATS];
 
-static struct timeval lasttime;
+static struct timespec lasttime;
 
 static int64_t cp_time[NCPUSTATES];
 static int64_t cp_old[NCPUSTATES];
 static int64_t cp_diff[NCPUSTATES];
 
-#define ORDERKEY_PCTCPU  if ((result = (int)(p2->pcpu - p1->pcpu)) == 0)
-#define ORDERKEY_STATE	 if ((result = p1->pgstate < p2->pgstate))
-#define ORDERKEY_RSSIZE  if ((result = p2->rss - p1->rss) == 0)
-#define ORDERKEY_LAG_FLUSH  if ((result = p2->flush_lag - p1->flush_lag) == 0)
-#define ORDERKEY_LAG_REPLAY if ((result = p2->replay_lag - \
-                                          p1->replay_lag) == 0)
-#define ORDERKEY_LAG_SENT   if ((result = p2->sent_lag - p1->sent_lag) == 0)
-#define ORDERKEY_LAG_WRITE  if ((result = p2->write_lag - p1->write_lag) == 0)
-#define ORDERKEY_MEM	 if ((result = p2->size - p1->size) == 0)
+#define ORDERKEY_PCTCPU  if ((result = compare_value(p2->pcpu, p1->pcpu)) == 0)
+#define ORDERKEY_STATE	 if ((result = compare_value(p2->pgstate, p1->pgstate)) == 0)
+#define ORDERKEY_RSSIZE  if ((result = compare_value(p2->rss, p1->rss)) == 0)
+#define ORDERKEY_LAG_FLUSH  if ((result = compare_value(p2->flush_lag, \
+                                          p1->flush_lag)) == 0)
+#define ORDERKEY_LAG_REPLAY if ((result = compare_value(p2->replay_lag, \
+                                          p1->replay_lag)) == 0)
+#define ORDERKEY_LAG_SENT   if ((result = compare_value(p2->sent_lag, \
+                                          p1->sent_lag)) == 0)
+#define ORDERKEY_LAG_WRITE  if ((result = compare_value(p2->write_lag, \
+                                          p1->write_lag)) == 0)
+#define ORDERKEY_MEM	 if ((result = compare_value(p2->size, p1->size)) == 0)
 #define ORDERKEY_NAME	if ((result = strcmp(p1->name, p2->name)) == 0)
-#define ORDERKEY_RCHAR	 if ((result = p1->rchar - p2->rchar) == 0)
-#define ORDERKEY_WCHAR	 if ((result = p1->wchar - p2->wchar) == 0)
-#define ORDERKEY_SYSCR	 if ((result = p1->syscr - p2->syscr) == 0)
-#define ORDERKEY_SYSCW	 if ((result = p1->syscw - p2->syscw) == 0)
-#define ORDERKEY_READS	 if ((result = p1->read_bytes - p2->read_bytes) == 0)
-#define ORDERKEY_WRITES	 if ((result = p1->write_bytes - p2->write_bytes) == 0)
-#define ORDERKEY_CWRITES if ((result = p1->cancelled_write_bytes - p2->cancelled_write_bytes) == 0)
-#define ORDERKEY_XTIME if ((result = p2->xtime - p1->xtime) == 0)
-#define ORDERKEY_QTIME if ((result = p2->qtime - p1->qtime) == 0)
-#define ORDERKEY_LOCKS if ((result = p2->locks - p1->locks) == 0)
-
-int			check_for_function(PGconn *, char *);
+#define ORDERKEY_RCHAR	 if ((result = compare_value(p1->rchar, p2->rchar)) == 0)
+#define ORDERKEY_WCHAR	 if ((result = compare_value(p1->wchar, p2->wchar)) == 0)
+#define ORDERKEY_SYSCR	 if ((result = compare_value(p1->syscr, p2->syscr)) == 0)
+#define ORDERKEY_SYSCW	 if ((result = compare_value(p1->syscw, p2->syscw)) == 0)
+#define ORDERKEY_READS	 if ((result = compare_value(p1->read_bytes, \
+                                         p2->read_bytes)) == 0)
+#define ORDERKEY_WRITES	 if ((result = compare_value(p1->write_bytes, \
+                                         p2->write_bytes)) == 0)
+#define ORDERKEY_CWRITES if ((result = compare_value(p1->cancelled_write_bytes, \
+                                         p2->cancelled_write_bytes)) == 0)
+#define ORDERKEY_XTIME if ((result = compare_value(p2->xtime, p1->xtime)) == 0)
+#define ORDERKEY_QTIME if ((result = compare_value(p2->qtime, p1->qtime)) == 0)
+#define ORDERKEY_LOCKS if ((result = compare_value(p2->locks, p1->locks)) == 0)
+
+/*
+ * Sort keys for sort_top(), in the same order as proc_compares_r.  Each is
+ * the first of the ORDERKEYs used by that comparison routine, as an integer.
+ * Names have no such key.
+ */
+
+#define SORTKEY(name, expr) \
+static uint64_t \
+key_##name(const void *v) \
+{ \
+	const struct top_proc_r *p = (const struct top_proc_r *) v; \
+\
+	return (expr); \
+}
+
+SORTKEY(cpu, sort_key_double(p->pcpu, 1))
+SORTKEY(cwrites, sort_key_int(p->cancelled_write_bytes, 0))
+SORTKEY(lag_flush, sort_key_int(p->flush_lag, 1))
+SORTKEY(lag_replay, sort_key_int(p->replay_lag, 1))
+SORTKEY(lag_sent, sort_key_int(p->sent_lag, 1))
+SORTKEY(lag_write, sort_key_int(p->write_lag, 1))
+SORTKEY(locks, sort_key_int(p->locks, 1))
+SORTKEY(qtime, sort_key_int(p->qtime, 1))
+SORTKEY(rchar, sort_key_int(p->rchar, 0))
+SORTKEY(reads, sort_key_int(p->read_bytes, 0))
+SORTKEY(res, sort_key_int(p->rss, 1))
+SORTKEY(size, sort_key_int(p->size, 1))
+SORTKEY(syscr, sort_key_int(p->syscr, 0))
+SORTKEY(syscw, sort_key_int(p->syscw, 0))
+SORTKEY(wchar, sort_key_int(p->wchar, 0))
+SORTKEY(writes, sort_key_int(p->write_bytes, 0))
+SORTKEY(xtime, sort_key_int(p->xtime, 1))
+
+static sort_key_fn proc_keys_r[] =
+{
+	key_cpu,
+		key_size,
+		key_res,
+		key_xtime,
+		key_qtime,
+		key_rchar,
+		key_wchar,
+		key_syscr,
+		key_syscw,
+		key_reads,
+		key_writes,
+		key_cwrites,
+		key_locks,
+		NULL,
+		key_lag_flush,
+		key_lag_replay,
+		key_lag_sent,
+		key_lag_write
+};
+
 static int	compare_cmd_r(const void *, const void *);
 static int	compare_cpu_r(const void *, const void *);
 static int	compare_cwrites_r(const void *, const void *);
@@ -278,32 +330,89 @@ static int	compare_wchar_r(const void *, const void *);
 static int	compare_writes_r(const void *, const void *);
 static int	compare_xtime_r(const void *, const void *);
 
-int
-check_for_function(PGconn *pgconn, char *procname)
+static void
+lru_unlink(struct top_proc_r *proc)
 {
-	PGresult   *pgresult = NULL;
-	int			rows = 0;
-	int			count;
-	char		sql[128];
+	if (proc->lru_prev != NULL)
+		proc->lru_prev->lru_next = proc->lru_next;
+	else
+		lru_head = proc->lru_next;
+	if (proc->lru_next != NULL)
+		proc->lru_next->lru_prev = proc->lru_prev;
+	else
+		lru_tail = proc->lru_prev;
+	proc->lru_prev = proc->lru_next = NULL;
+}
 
-	sprintf(sql, QUERY_PG_PROC, procname);
-	pgresult = PQexec(pgconn, sql);
-	rows = PQntuples(pgresult);
-	/* Don't need to clean up on error, the program will exit shortly after. */
-	if (rows == 0)
+/* lru_touch - move proc to the head of the list, marking it as seen */
+
+static void
+lru_touch(struct top_proc_r *proc)
+{
+	proc->generation = generation;
+	if (lru_head == proc)
+		return;
+	if (proc->lru_prev != NULL || lru_tail == proc)
+		lru_unlink(proc);
+	proc->lru_next = lru_head;
+	if (lru_head != NULL)
+		lru_head->lru_prev = proc;
+	lru_head = proc;
+	if (lru_tail == NULL)
+		lru_tail = proc;
+}
+
+/*
+ * reap_procs_r - forget every pid that is not part of the current sample,
+ * returning its node to the pool
+ */
+
+static void
+reap_procs_r()
+{
+	struct top_proc_r *n;
+
+	while ((n = lru_tail) != NULL && n->generation != generation)
 	{
-		fprintf(stderr, "Error executing '%s'.\n", sql);
-		return -1;
+		lru_unlink(n);
+		pid_hash_remove(&proc_r_hash, n->pid);
+
+		pool_free(&proc_r_pool, n);
 	}
-	count = atoi(PQgetvalue(pgresult, 0, 0));
-	if (count == 0)
+}
+
+/*
+ * count_locks_r - refresh the lock count of every backend in the sample from
+ * pg_locks.  Between refreshes a backend keeps the count it was last given; a
+ * failed query leaves them all as they were.  Only called after the reaping,
+ * when every node on the list is part of the sample.  now is the time of the
+ * sample, on the monotonic clock that it is compared on.
+ */
+
+static void
+count_locks_r(struct pg_conninfo_ctx *conninfo, time_t now)
+{
+	PGresult   *pgresult;
+	struct top_proc_r *n;
+	int			i;
+
+	pgresult = pg_lock_counts(conninfo);
+	if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
 	{
-		fprintf(stderr, "Stored function '%s' is missing.\n", procname);
-		return -1;
-	}
-	if (pgresult != NULL)
 		PQclear(pgresult);
-	return 0;
+		return;
+	}
+
+	for (n = lru_head; n != NULL; n = n->lru_next)
+		n->locks = 0;
+	for (i = 0; i < PQntuples(pgresult); i++)
+	{
+		n = pid_hash_lookup(&proc_r_hash, pg_getint(pgresult, i, LOCK_PID));
+		if (n != NULL)
+			n->locks = pg_getint(pgresult, i, LOCK_COUNT);
+	}
+	PQclear(pgresult);
+	locks_counted = now;
 }
 
 int			(*proc_compares_r[]) () =
@@ -329,6 +438,36 @@ int			(*proc_compares_r[]) () =
 		NULL
 };
 
+/*
+ * sample_filter_r - leave it to the server to drop the backends sel hides,
+ * and when sorting on a column it sends, to pick the ones to show.
+ */
+
+static void
+sample_filter_r(struct pg_sample_filter *filter, struct process_select *sel,
+				int compare_index)
+{
+	int			(*compare) () = compare_index >= 0 ?
+		proc_compares_r[compare_index] : NULL;
+
+	filter->show_idle = sel->idle;
+	filter->usename = sel->usename;
+	filter->limit = sel->topn;
+	filter->tiebreak = 0;
+	if (compare == compare_xtime_r)
+		filter->order = c_xtime + 1;
+	else if (compare == compare_qtime_r)
+		filter->order = c_qtime + 1;
+	else if (compare == compare_locks_r && sel->lock_waits)
+	{
+		/* most backends wait on no lock: the rest go by query time */
+		filter->order = c_lock_wait + 1;
+		filter->tiebreak = c_qtime + 1;
+	}
+	else
+		filter->order = 0;
+}
+
 /* The comparison function for sorting by command name. */
 
 static int
@@ -683,41 +822,44 @@ format_header_r(char *uname_field)
 }
 
 char *
-format_next_io_r(caddr_t handler)
+format_next_io_r(caddr_t handler, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+	char		bytes[5][FORMAT_SIZE];
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			"%5d %5s %5s %7lld %7lld %5s %6s %7s %s",
 			(int) p->pid,
-			format_b(p->rchar_diff),
-			format_b(p->wchar_diff),
+			format_b(p->rchar_diff, bytes[0]),
+			format_b(p->wchar_diff, bytes[1]),
 			p->syscr_diff,
 			p->syscw_diff,
-			format_b(p->read_bytes_diff),
-			format_b(p->write_bytes_diff),
-			format_b(p->cancelled_write_bytes_diff),
+			format_b(p->read_bytes_diff, bytes[2]),
+			format_b(p->write_bytes_diff, bytes[3]),
+			format_b(p->cancelled_write_bytes_diff, bytes[4]),
 			p->name);
 
 	return (fmt);
 }
 
 char *
-format_next_process_r(caddr_t handler)
+format_next_process_r(caddr_t handler, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+	char		size[FORMAT_SIZE];
+	char		rss[FORMAT_SIZE];
+	char		xtime[FORMAT_SIZE];
+	char		qtime[FORMAT_SIZE];
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			 "%5d %-8.8s %5s %5s %-6s %5s %5s %5.1f %5d %s",
 			 (int) p->pid,		/* Some OS's need to cast pid_t to int. */
 			 p->usename,
-			 format_k(p->size),
-			 format_k(p->rss),
+			 format_k(p->size, size),
+			 format_k(p->rss, rss),
 			 backendstatenames[p->pgstate],
-			 format_time(p->xtime),
-			 format_time(p->qtime),
+			 format_time(p->xtime, xtime),
+			 format_time(p->qtime, qtime),
 			 p->pcpu * 100.0,
 			 p->locks,
 			 p->name);
@@ -726,27 +868,28 @@ format_next_process_r(caddr_t handler)
 }
 
 char *
-format_next_replication_r(caddr_t handle)
+format_next_replication_r(caddr_t handle, char *fmt)
 {
-	static char fmt[MAX_COLS];	/* static area where result is built */
-	struct top_proc_r *p = &pgrtable[proc_r_index++];
+	struct top_proc_r *p = pgrtable[proc_r_index++];
+	char		lsn[5][FORMAT_SIZE];
+	char		lag[4][FORMAT_SIZE];
 
-	snprintf(fmt, sizeof(fmt),
+	snprintf(fmt, MAX_COLS,
 			 "%5d %-8.8s %-11.11s %15s %-9.9s %9s %9s %9s %9s %9s %5s %5s %5s %5s",
 			 p->pid,
 			 p->usename,
 			 p->application_name,
 			 p->client_addr,
 			 p->repstate,
-			 p->primary,
-			 p->sent,
-			 p->write,
-			 p->flush,
-			 p->replay,
-			 format_b(p->sent_lag),
-			 format_b(p->write_lag),
-			 format_b(p->flush_lag),
-			 format_b(p->replay_lag));
+			 format_lsn(p->primary, lsn[0]),
+			 format_lsn(p->sent, lsn[1]),
+			 format_lsn(p->write, lsn[2]),
+			 format_lsn(p->flush, lsn[3]),
+			 format_lsn(p->replay, lsn[4]),
+			 format_b(p->sent_lag, lag[0]),
+			 format_b(p->write_lag, lag[1]),
+			 format_b(p->flush_lag, lag[2]),
+			 format_b(p->replay_lag, lag[3]));
 
 	/* return the result */
 	return (fmt);
@@ -755,39 +898,34 @@ format_next_replication_r(caddr_t handle)
 void
 get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 {
-	PGresult   *pgresult = NULL;
-	int			rows = 0;
+	PGresult   *pgresult;
+
+	info->cpustates = cpu_states;
+	info->memory = memory_stats;
+	info->swap = swap_stats;
 
+	/*
+	 * Each figure keeps its last value if the database cannot be asked for a
+	 * new one.
+	 */
 	connect_to_db(conninfo);
-	if (conninfo->connection != NULL)
-	{
-		pgresult = PQexec(conninfo->connection, QUERY_LOADAVG);
-		rows = PQntuples(pgresult);
-	}
+	if (conninfo->connection == NULL)
+		return;
 
 	/* Get load averages. */
-	if (rows > 0)
+	pgresult = pg_exec_sample(conninfo->connection, QUERY_LOADAVG, 0);
+	if (PQntuples(pgresult) > 0)
 	{
 		info->load_avg[0] = atof(PQgetvalue(pgresult, 0, c_load1));
 		info->load_avg[1] = atof(PQgetvalue(pgresult, 0, c_load5));
 		info->load_avg[2] = atof(PQgetvalue(pgresult, 0, c_load15));
 		info->last_pid = atoi(PQgetvalue(pgresult, 0, c_last_pid));
 	}
-	else
-	{
-		info->load_avg[0] = 0;
-		info->load_avg[1] = 0;
-		info->load_avg[2] = 0;
-		info->last_pid = 0;
-	}
+	PQclear(pgresult);
 
 	/* Get processor time info. */
-	if (conninfo->connection != NULL)
-	{
-		pgresult = PQexec(conninfo->connection, QUERY_CPUTIME);
-		rows = PQntuples(pgresult);
-	}
-	if (rows > 0)
+	pgresult = pg_exec_sample(conninfo->connection, QUERY_CPUTIME, 0);
+	if (PQntuples(pgresult) > 0)
 	{
 		cp_time[0] = atol(PQgetvalue(pgresult, 0, c_cpu_user));
 		cp_time[1] = atol(PQgetvalue(pgresult, 0, c_cpu_nice));
@@ -798,22 +936,11 @@ get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 		/* convert cp_time counts to percentages */
 		percentages(NCPUSTATES, cpu_states, cp_time, cp_old, cp_diff);
 	}
-	else
-	{
-		cpu_states[0] = 0;
-		cpu_states[1] = 0;
-		cpu_states[2] = 0;
-		cpu_states[3] = 0;
-		cpu_states[4] = 0;
-	}
+	PQclear(pgresult);
 
 	/* Get system wide memory usage. */
-	if (conninfo->connection != NULL)
-	{
-		pgresult = PQexec(conninfo->connection, QUERY_MEMUSAGE);
-		rows = PQntuples(pgresult);
-	}
-	if (rows > 0)
+	pgresult = pg_exec_sample(conninfo->connection, QUERY_MEMUSAGE, 0);
+	if (PQntuples(pgresult) > 0)
 	{
 		memory_stats[MEMUSED] = atol(PQgetvalue(pgresult, 0, c_memused));
 		memory_stats[MEMFREE] = atol(PQgetvalue(pgresult, 0, c_memfree));
@@ -824,25 +951,7 @@ get_system_info_r(struct system_info *info, struct pg_conninfo_ctx *conninfo)
 		swap_stats[SWAPFREE] = atol(PQgetvalue(pgresult, 0, c_swapfree));
 		swap_stats[SWAPCACHED] = atol(PQgetvalue(pgresult, 0, c_swapcached));
 	}
-	else
-	{
-		memory_stats[MEMUSED] = 0;
-		memory_stats[MEMFREE] = 0;
-		memory_stats[MEMSHARED] = 0;
-		memory_stats[MEMBUFFERS] = 0;
-		memory_stats[MEMCACHED] = 0;
-		swap_stats[SWAPUSED] = 0;
-		swap_stats[SWAPFREE] = 0;
-		swap_stats[SWAPCACHED] = 0;
-	}
-
-	info->cpustates = cpu_states;
-	info->memory = memory_stats;
-	info->swap = swap_stats;
-
-	if (pgresult != NULL)
-		PQclear(pgresult);
-	disconnect_from_db(conninfo);
+	PQclear(pgresult);
 }
 
 caddr_t
@@ -852,33 +961,33 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 	int			i;
 
 	PGresult   *pgresult = NULL;
+	const char *sql;
+	struct pg_sample_filter filter;
 	int			rows;
+	int			pgstate;
 
-	struct timeval thistime;
+	struct timespec thistime;
 	double		timediff;
 
 	int			active_procs = 0;
 	int			total_procs = 0;
 
-	int			show_idle = sel->idle;
-
-	struct top_proc_r *n,
-			   *p;
-
-	memset(process_states, 0, sizeof(process_states));
+	struct top_proc_r *n;
+	void	  **slot;
+	void	  **p;
+	pid_t		pid;
 
 	/* Calculate the time difference since our last check. */
-	gettimeofday(&thistime, 0);
+	clock_gettime(CLOCK_MONOTONIC, &thistime);
 	if (lasttime.tv_sec)
 	{
 		timediff = ((thistime.tv_sec - lasttime.tv_sec) +
-					(thistime.tv_usec - lasttime.tv_usec) * 1e-6);
+					(thistime.tv_nsec - lasttime.tv_nsec) * 1e-9);
 	}
 	else
 	{
 		timediff = 0;
 	}
-	lasttime = thistime;
 
 	timediff *= HZ;				/* Convert to ticks. */
 
@@ -888,28 +997,59 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 		switch (mode)
 		{
 			case MODE_REPLICATION:
-				pgresult = pg_replication(conninfo->connection);
+				pgresult = pg_replication(conninfo);
 				break;
 			default:
-				if (sel->fullcmd == 2)
-				{
-					pgresult = PQexec(conninfo->connection, QUERY_PROCTAB_QUERY);
-				}
+				if (conninfo->caps.version >= 906)
+					sql = sel->fullcmd == 2 ? QUERY_PROCTAB_QUERY :
+						QUERY_PROCTAB;
 				else
-				{
-					pgresult = PQexec(conninfo->connection, QUERY_PROCTAB);
-				}
+					sql = sel->fullcmd == 2 ? QUERY_PROCTAB_QUERY_9_5 :
+						QUERY_PROCTAB_9_5;
+				sample_filter_r(&filter, sel, compare_index);
+				filter.width = sel->width;
+				filter.since = "";
+				pgresult = pg_sample(conninfo, sql, PROCTAB_COUNT, &filter);
 		}
-		rows = PQntuples(pgresult);
 	}
-	else
+
+	/*
+	 * Without an answer from the database keep the last sample on the screen
+	 * until the connection comes back, unless it was taken in the other mode.
+	 */
+	if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
 	{
-		rows = 0;
+		PQclear(pgresult);
+		if (mode != last_mode)
+		{
+			memset(process_states, 0, sizeof(process_states));
+			si->p_active = si->p_total = 0;
+		}
+		si->procstates = process_states;
+		proc_r_index = 0;
+		return 0;
+	}
+	rows = PQntuples(pgresult);
+	lasttime = thistime;
+	last_mode = mode;
+
+	memset(process_states, 0, sizeof(process_states));
+	generation++;
+
+	/* The backends in each state are counted in the last rows. */
+	while (mode != MODE_REPLICATION && rows > 0 &&
+		   PQgetisnull(pgresult, rows - 1, c_pid))
+	{
+		rows--;
+		pgstate = STATE_UNDEFINED;
+		update_state(&pgstate, PQgetvalue(pgresult, rows, c_pgstate));
+		process_states[pgstate] += pg_getint(pgresult, rows, c_count);
+		total_procs += pg_getint(pgresult, rows, c_count);
 	}
 
 	if (rows > 0)
 	{
-		p = reallocarray(pgrtable, rows, sizeof(struct top_proc_r));
+		p = reallocarray(pgrtable, rows, sizeof(void *));
 		if (p == NULL)
 		{
 			fprintf(stderr, "reallocarray error\n");
@@ -924,10 +1064,13 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 	for (i = 0; i < rows; i++)
 	{
 		unsigned long otime;
+		unsigned long start_time;
 		long long	value;
+		int			fresh;
 
-		n = malloc(sizeof(struct top_proc_r));
-		if (n == NULL)
+		pid = pg_getint(pgresult, i, c_pid);
+		slot = pid_hash_enter(&proc_r_hash, pid);
+		if (slot == NULL)
 		{
 			fprintf(stderr, "malloc error\n");
 			if (pgresult != NULL)
@@ -935,45 +1078,57 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 			disconnect_from_db(conninfo);
 			exit(1);
 		}
-		memset(n, 0, sizeof(struct top_proc_r));
-		n->pid = atoi(PQgetvalue(pgresult, i, c_pid));
-		p = RB_INSERT(pgprocr, &head_proc_r, n);
-		if (p != NULL)
-		{
-			free(n);
-			n = p;
-		}
-		else
+		n = *slot;
+		if (n == NULL)
 		{
-			n->time = 0;
+			n = pool_alloc(&proc_r_pool);
+			if (n == NULL)
+			{
+				fprintf(stderr, "malloc error\n");
+				if (pgresult != NULL)
+					PQclear(pgresult);
+				disconnect_from_db(conninfo);
+				exit(1);
+			}
+			n->pid = pid;
+			*slot = n;
 		}
+		lru_touch(n);
 
 		otime = n->time;
 
 		switch (mode)
 		{
 			case MODE_REPLICATION:
-				update_str(&n->usename, PQgetvalue(pgresult, i, 1));
-				update_str(&n->application_name, PQgetvalue(pgresult, i, 2));
-				update_str(&n->client_addr, PQgetvalue(pgresult, i, 3));
-				update_str(&n->repstate, PQgetvalue(pgresult, i, 4));
-				update_str(&n->primary, PQgetvalue(pgresult, i, 5));
-				update_str(&n->sent, PQgetvalue(pgresult, i, 6));
-				update_str(&n->write, PQgetvalue(pgresult, i, 7));
-				update_str(&n->flush, PQgetvalue(pgresult, i, 8));
-				update_str(&n->replay, PQgetvalue(pgresult, i, 9));
-				n->sent_lag = atol(PQgetvalue(pgresult, i, 10));
-				n->write_lag = atol(PQgetvalue(pgresult, i, 11));
-				n->flush_lag = atol(PQgetvalue(pgresult, i, 12));
-				n->replay_lag = atol(PQgetvalue(pgresult, i, 13));
-
-				memcpy(&pgrtable[active_procs++], n, sizeof(struct top_proc_r));
+				if ((n->usename = intern(PQgetvalue(pgresult, i, 1))) == NULL ||
+					(n->application_name =
+					 intern(PQgetvalue(pgresult, i, 2))) == NULL ||
+					(n->client_addr = intern(PQgetvalue(pgresult, i, 3))) == NULL ||
+					(n->repstate = intern(PQgetvalue(pgresult, i, 4))) == NULL)
+				{
+					fprintf(stderr, "malloc error\n");
+					PQclear(pgresult);
+					disconnect_from_db(conninfo);
+					exit(1);
+				}
+				n->name = "";	/* not in this result */
+				n->primary = pg_getlsn(pgresult, i, 5);
+				n->sent = pg_getlsn(pgresult, i, 6);
+				n->write = pg_getlsn(pgresult, i, 7);
+				n->flush = pg_getlsn(pgresult, i, 8);
+				n->replay = pg_getlsn(pgresult, i, 9);
+				n->sent_lag = pg_getint(pgresult, i, 10);
+				n->write_lag = pg_getint(pgresult, i, 11);
+				n->flush_lag = pg_getint(pgresult, i, 12);
+				n->replay_lag = pg_getint(pgresult, i, 13);
+
+				pgrtable[active_procs++] = n;
 				break;
 			default:
 				if (sel->fullcmd && PQgetvalue(pgresult, i, c_fullcomm))
-					update_str(&n->name, PQgetvalue(pgresult, i, c_fullcomm));
+					n->name = PQgetvalue(pgresult, i, c_fullcomm);
 				else
-					update_str(&n->name, PQgetvalue(pgresult, i, c_comm));
+					n->name = PQgetvalue(pgresult, i, c_comm);
 
 				switch (PQgetvalue(pgresult, i, c_state)[0])
 				{
@@ -1000,78 +1155,110 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 				}
 				update_state(&n->pgstate, PQgetvalue(pgresult, i, c_pgstate));
 
-				n->time = (unsigned long) atol(PQgetvalue(pgresult, i, c_utime));
-				n->time += (unsigned long) atol(PQgetvalue(pgresult, i, c_stime));
-				n->start_time = (unsigned long)
-					atol(PQgetvalue(pgresult, i, c_starttime));
-				n->size = bytetok((unsigned long)
-								  atol(PQgetvalue(pgresult, i, c_vsize)));
-				n->rss = bytetok((unsigned long)
-								 atol(PQgetvalue(pgresult, i, c_rss)));
+				start_time = pg_getint(pgresult, i, c_starttime);
+				fresh = n->start_time == 0;
+				if (n->start_time != 0 && n->start_time != start_time)
+				{
+					/* The pid has been reused, start counting afresh. */
+					otime = 0;
+					n->rchar = 0;
+					n->wchar = 0;
+					n->syscr = 0;
+					n->syscw = 0;
+					n->read_bytes = 0;
+					n->write_bytes = 0;
+					n->cancelled_write_bytes = 0;
+				}
+				n->start_time = start_time;
 
-				update_str(&n->usename, PQgetvalue(pgresult, i, c_username));
+				n->time = pg_getint(pgresult, i, c_utime);
+				n->time += pg_getint(pgresult, i, c_stime);
+				n->size = bytetok(pg_getint(pgresult, i, c_vsize));
+				n->rss = bytetok(pg_getint(pgresult, i, c_rss));
 
-				n->xtime = atol(PQgetvalue(pgresult, i, c_xtime));
-				n->qtime = atol(PQgetvalue(pgresult, i, c_qtime));
+				n->usename = pg_role_name(conninfo,
+										  pg_getint(pgresult, i, c_usesysid));
 
-				n->locks = atol(PQgetvalue(pgresult, i, c_locks));
+				n->xtime = pg_getint(pgresult, i, c_xtime);
+				n->qtime = pg_getint(pgresult, i, c_qtime);
 
-				value = atoll(PQgetvalue(pgresult, i, c_rchar));
+				if (sel->lock_waits)
+					n->locks = pg_getint(pgresult, i, c_lock_wait);
+
+				value = pg_getint(pgresult, i, c_rchar);
 				n->rchar_diff = value - n->rchar;
 				n->rchar = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_wchar));
+				value = pg_getint(pgresult, i, c_wchar);
 				n->wchar_diff = value - n->wchar;
 				n->wchar = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_syscr));
+				value = pg_getint(pgresult, i, c_syscr);
 				n->syscr_diff = value - n->syscr;
 				n->syscr = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_syscw));
+				value = pg_getint(pgresult, i, c_syscw);
 				n->syscw_diff = value - n->syscw;
 				n->syscw = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_reads));
+				value = pg_getint(pgresult, i, c_reads);
 				n->read_bytes_diff = value - n->read_bytes;
 				n->read_bytes = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_writes));
+				value = pg_getint(pgresult, i, c_writes);
 				n->write_bytes_diff = value - n->write_bytes;
 				n->write_bytes = value;
 
-				value = atoll(PQgetvalue(pgresult, i, c_cwrites));
+				value = pg_getint(pgresult, i, c_cwrites);
 				n->cancelled_write_bytes_diff = value - n->cancelled_write_bytes;
 				n->cancelled_write_bytes = value;
 
-				++total_procs;
-				++process_states[n->pgstate];
-
-				if (timediff > 0.0)
+				/*
+				 * A backend the server has not sent before may have been
+				 * running for long, hidden by the filters.  Its cpu time
+				 * cannot be spread over the last interval.
+				 */
+				if (fresh)
+					n->pcpu = 0;
+				else if (timediff > 0.0)
 				{
 					if ((n->pcpu = (n->time - otime) / timediff) < 0.0001)
 						n->pcpu = 0;
 				}
 
-				if ((show_idle || n->pgstate != STATE_IDLE) &&
-					(sel->usename[0] == '\0' ||
-					 strcmp(n->usename, sel->usename) == 0))
-					memcpy(&pgrtable[active_procs++], n, sizeof(struct top_proc_r));
+				pgrtable[active_procs++] = n;
 		}
 	}
 
-	if (pgresult != NULL)
-		PQclear(pgresult);
-	disconnect_from_db(conninfo);
+	/*
+	 * The command names point into this result, so it is kept until the next
+	 * sample has been merged in.
+	 */
+	PQclear(shown_result);
+	shown_result = pgresult;
+
+	/* Drop the backends that have exited since the last sample. */
+	reap_procs_r();
+
+	/*
+	 * Counting pg_locks is expensive on a busy server, so it is only done
+	 * every lock_interval seconds, or every time when it is the sort key.
+	 */
+	if (mode != MODE_REPLICATION && !sel->lock_waits &&
+		((compare_index >= 0 &&
+		  proc_compares_r[compare_index] == compare_locks_r) ||
+		 locks_counted == 0 ||
+		 thistime.tv_sec - locks_counted >= sel->lock_interval))
+		count_locks_r(conninfo, thistime.tv_sec);
 
 	si->p_active = active_procs;
 	si->p_total = total_procs;
 	si->procstates = process_states;
 
-	/* Sort the "active" procs if specified. */
+	/* Sort the "active" procs that are going to be shown if specified. */
 	if (compare_index >= 0 && si->p_active)
-		qsort(pgrtable, si->p_active, sizeof(struct top_proc_r),
-			  proc_compares_r[compare_index]);
+		sort_top(pgrtable, si->p_active, sel->topn,
+				 proc_compares_r[compare_index], proc_keys_r[compare_index]);
 
 	/* don't even pretend that the return value thing here isn't bogus */
 	proc_r_index = 0;
@@ -1081,7 +1268,7 @@ get_process_info_r(struct system_info *si, struct process_select *sel,
 int
 machine_init_r(struct statics *statics, struct pg_conninfo_ctx *conninfo)
 {
-	/* Make sure the remote system has the stored function installed. */
+	/* Make sure the remote system has the stored functions installed. */
 	connect_to_db(conninfo);
 	if (conninfo->connection == NULL)
 	{
@@ -1089,15 +1276,12 @@ machine_init_r(struct statics *statics, struct pg_conninfo_ctx *conninfo)
 		return -1;
 	}
 
-	if (check_for_function(conninfo->connection, "pg_cputime") != 0)
-		return -1;
-	if (check_for_function(conninfo->connection, "pg_loadavg") != 0)
-		return -1;
-	if (check_for_function(conninfo->connection, "pg_memusage") != 0)
-		return -1;
-	if (check_for_function(conninfo->connection, "pg_proctab") != 0)
+	if (!(conninfo->caps.flags & PG_CAP_PG_PROCTAB))
+	{
+		fprintf(stderr, "Stored functions pg_cputime, pg_loadavg, "
+				"pg_memusage and pg_proctab are missing.\n");
 		return -1;
-	disconnect_from_db(conninfo);
+	}
 
 	/* fill in the statics information */
 	statics->procstate_names = procstatenames;
@@ -1111,9 +1295,3 @@ machine_init_r(struct statics *statics, struct pg_conninfo_ctx *conninfo)
 
 	return 0;
 }
-
-int
-topprocrcmp(struct top_proc_r *e1, struct top_proc_r *e2)
-{
-	return (e1->pid < e2->pid ? -1 : e1->pid > e2->pid);
-}
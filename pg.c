@@ -1,72 +1,126 @@
 /*	Copyright (c) 2007-2019, Mark Wong */
 
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #include "display.h"
 #include "pg.h"
 #include "pg_top.h"
 
+/* type oids of the binary columns decoded here */
+#define INT2OID		21
+#define INT4OID		23
+#define INT8OID		20
+#define OIDOID		26
+#define TEXTOID		25
+#define TIMESTAMPTZOID	1184
+#define LSNOID		3220
+
+/*
+ * The lock counts are not part of the processes query: counting pg_locks
+ * takes every lock manager partition lock on the server, so it is done by
+ * LOCK_COUNTS on its own, slower, cadence.  Whether a backend is waiting on a
+ * lock comes for free with pg_stat_activity.
+ *
+ * pg_sample() filters and sorts these on the server, and binds $1 to the
+ * width the query is cut to, and $2 to the time of the last sample: only the
+ * queries that have changed since then are sent.  The last two columns are
+ * only set in the rows that count the backends in each state.
+ */
 #define QUERY_PROCESSES \
-		"WITH lock_activity AS\n" \
-		"(\n" \
-		"     SELECT pid, count(*) AS lock_count\n" \
-		"     FROM pg_locks\n" \
-		"     WHERE relation IS NOT NULL\n" \
-		"     GROUP BY pid\n" \
-		")\n" \
-		"SELECT a.pid, query, state, usename,\n" \
+		"SELECT pid,\n" \
+		"       CASE WHEN greatest(query_start, state_change) >\n" \
+		"                 $2 - INTERVAL '1 second'\n" \
+		"            THEN left(query, $1) END,\n" \
+		"       state AS backend_state, usesysid,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              xact_start))::BIGINT,\n" \
 		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
 		"                              query_start))::BIGINT,\n" \
-		"       coalesce(lock_count, 0) AS lock_count\n" \
-		"FROM pg_stat_activity a LEFT OUTER JOIN lock_activity b\n" \
-		"  ON a.pid = b.pid;"
+		"       (wait_event_type = 'Lock')::INTEGER,\n" \
+		"       NULL::INTEGER, NULL::TEXT\n" \
+		"FROM pg_stat_activity"
+
+#define QUERY_PROCESSES_9_5 \
+		"SELECT pid,\n" \
+		"       CASE WHEN greatest(query_start, state_change) >\n" \
+		"                 $2 - INTERVAL '1 second'\n" \
+		"            THEN left(query, $1) END,\n" \
+		"       state AS backend_state, usesysid,\n" \
+		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
+		"                              xact_start))::BIGINT,\n" \
+		"       extract(EPOCH FROM age(clock_timestamp(),\n" \
+		"                              query_start))::BIGINT,\n" \
+		"       waiting::INTEGER,\n" \
+		"       NULL::INTEGER, NULL::TEXT\n" \
+		"FROM pg_stat_activity"
+
+#define SAMPLE_QUERY \
+		"WITH sample AS (\n%s\n)\n" \
+		"(SELECT * FROM sample WHERE TRUE%s%s)\n" \
+		"UNION ALL\n" \
+		"SELECT %s\n" \
+		"FROM sample GROUP BY backend_state;"
 
-#define QUERY_PROCESSES_9_1 \
-		"SELECT procpid, current_query\n" \
-		"FROM pg_stat_activity;"
+#define PROCESSES_COUNT \
+		"NULL, NULL, backend_state, NULL, NULL, NULL, NULL, count(*)::INTEGER,\n" \
+		"       statement_timestamp()::TEXT"
+
+/* the query text of the backends a sample did not send it for */
+#define QUERY_TEXTS \
+		"SELECT pid, left(query, $1)\n" \
+		"FROM pg_stat_activity\n" \
+		"WHERE pid = ANY ($2::INTEGER[]);"
+
+#define QUERY_ROLES \
+		"SELECT oid, rolname\n" \
+		"FROM pg_roles;"
+
+#define LOCK_COUNTS \
+		"SELECT pid, count(*)\n" \
+		"FROM pg_locks\n" \
+		"WHERE relation IS NOT NULL\n" \
+		"GROUP BY pid;"
 
 #define CURRENT_QUERY \
 		"SELECT query\n" \
 		"FROM pg_stat_activity\n" \
 		"WHERE pid = %d;"
 
-#define CURRENT_QUERY_9_1 \
-		"SELECT current_query\n" \
-		"FROM pg_stat_activity\n" \
-		"WHERE procpid = %d;"
-
 #define REPLICATION \
-		"SELECT pid, usename, application_name, client_addr, state,\n" \
+		"SELECT pid, usename, application_name, client_addr::text, state,\n" \
 		"       pg_current_wal_insert_lsn() AS primary,\n" \
 		"       sent_lsn, write_lsn, flush_lsn,\n" \
 		"       replay_lsn, \n" \
 		"       pg_wal_lsn_diff(pg_current_wal_insert_lsn(),\n" \
-		"                       sent_lsn) as sent_lag,\n" \
+		"                       sent_lsn)::bigint as sent_lag,\n" \
 		"       pg_wal_lsn_diff(pg_current_wal_insert_lsn(),\n" \
-		"                       write_lsn) as write_lag,\n" \
+		"                       write_lsn)::bigint as write_lag,\n" \
 		"       pg_wal_lsn_diff(pg_current_wal_insert_lsn(),\n" \
-		"                       flush_lsn) as flush_lag,\n" \
+		"                       flush_lsn)::bigint as flush_lag,\n" \
 		"       pg_wal_lsn_diff(pg_current_wal_insert_lsn(),\n" \
-		"                       replay_lsn) as replay_lag\n" \
+		"                       replay_lsn)::bigint as replay_lag\n" \
 		"       FROM pg_stat_replication;"
 
 #define REPLICATION_9_6 \
-		"SELECT pid, usename, application_name, client_addr, state,\n" \
+		"SELECT pid, usename, application_name, client_addr::text, state,\n" \
 		"       pg_current_xlog_insert_location() AS primary,\n" \
 		"       sent_location, write_location, flush_location,\n" \
 		"       replay_location, \n" \
 		"       pg_xlog_location_diff(pg_current_xlog_insert_location(),\n" \
-		"                             sent_location) as sent_lag,\n" \
+		"                             sent_location)::bigint as sent_lag,\n" \
 		"       pg_xlog_location_diff(pg_current_xlog_insert_location(),\n" \
-		"                             write_location) as write_lag,\n" \
+		"                             write_location)::bigint as write_lag,\n" \
 		"       pg_xlog_location_diff(pg_current_xlog_insert_location(),\n" \
-		"                             flush_location) as flush_lag,\n" \
+		"                             flush_location)::bigint as flush_lag,\n" \
 		"       pg_xlog_location_diff(pg_current_xlog_insert_location(),\n" \
-		"                             replay_location) as replay_lag\n" \
+		"                             replay_location)::bigint as replay_lag\n" \
 		"       FROM pg_stat_replication;"
 
 #define GET_LOCKS \
@@ -84,142 +138,684 @@
 		"  AND pg_stat_activity.pid = pg_locks.pid\n" \
 		"  AND relation IS NOT NULL;"
 
-#define GET_LOCKS_9_1 \
-		"SELECT datname, nspname, r.relname, i.relname, mode, granted\n" \
-		"FROM pg_stat_activity, pg_locks\n" \
-		"LEFT OUTER JOIN pg_class r \n" \
-		"  ON relation = r.oid\n"\
-		" AND r.relkind = 'r'\n" \
-		"LEFT OUTER JOIN pg_class i \n" \
-		"  ON relation = i.oid\n"\
-		" AND i.relkind = 'i'\n" \
-		"LEFT OUTER JOIN pg_namespace nsp\n" \
-		"  ON coalesce(r.relnamespace, i.relnamespace) = nsp.oid\n" \
-		"WHERE procpid = %d\n" \
-		"  AND procpid = pid\n" \
-		"  AND relation IS NOT NULL;"
+/*
+ * The timeout keeps a sample from hanging on a busy server.  It is only set
+ * on the connection samples are taken on: the commands, EXPLAIN ANALYZE
+ * among them, may take as long as they need.
+ */
+#define SAMPLER_SETTINGS "SET statement_timeout = '2s';\n"
+
+/*
+ * One round trip at connect time tells everything pg_top needs to know about
+ * the server.  The session settings ride along; only the last result of a
+ * multi-statement string is returned.
+ */
+#define QUERY_CAPABILITIES \
+		"SET SESSION CHARACTERISTICS AS TRANSACTION ISOLATION LEVEL " \
+		"READ UNCOMMITTED;\n" \
+		"SELECT pg_is_in_recovery(),\n" \
+		"       r.rolsuper OR EXISTS (\n" \
+		"           SELECT 1\n" \
+		"           FROM pg_roles m\n" \
+		"           WHERE m.rolname IN ('pg_monitor', 'pg_read_all_stats')\n" \
+		"             AND pg_has_role(m.oid, 'MEMBER')),\n" \
+		"       (SELECT count(DISTINCT proname) = 4\n" \
+		"        FROM pg_proc\n" \
+		"        WHERE proname IN ('pg_cputime', 'pg_loadavg', 'pg_memusage',\n" \
+		"                          'pg_proctab')),\n" \
+		"       EXISTS (SELECT 1 FROM pg_extension\n" \
+		"               WHERE extname = 'pg_stat_statements'),\n" \
+		"       EXISTS (SELECT 1 FROM pg_extension\n" \
+		"               WHERE extname = 'pg_buffercache')\n" \
+		"FROM pg_roles r\n" \
+		"WHERE r.rolname = current_user;"
 
-int			pg_version(PGconn *);
+/* the PG_CAP_* flag for each column of QUERY_CAPABILITIES */
+static const int capability_flags[] = {
+	PG_CAP_IN_RECOVERY,
+	PG_CAP_MONITOR,
+	PG_CAP_PG_PROCTAB,
+	PG_CAP_PG_STAT_STATEMENTS,
+	PG_CAP_PG_BUFFERCACHE
+};
 
+struct query_template
+{
+	enum pg_query_id id;
+	int			min_version;	/* oldest server the text works with */
+	const char *sql;
+};
+
+/*
+ * The oldest server that the texts below work with.  Before 9.2 the columns
+ * of pg_stat_activity were named differently and there was no state.
+ */
+#define MIN_SERVER_VERSION 902
+
+/* newest first: a server gets the first text of each kind it can run */
+static const struct query_template query_templates[] = {
+	{PGQ_PROCESSES, 906, QUERY_PROCESSES},
+	{PGQ_PROCESSES, 0, QUERY_PROCESSES_9_5},
+	{PGQ_REPLICATION, 1000, REPLICATION},
+	{PGQ_REPLICATION, 0, REPLICATION_9_6},
+	{PGQ_LOCKS, 0, GET_LOCKS},
+	{PGQ_LOCK_COUNTS, 0, LOCK_COUNTS},
+	{PGQ_CURRENT_QUERY, 0, CURRENT_QUERY}
+};
+
+/* seconds spent waiting for the last sampling query */
+double		query_latency;
+
+/* input on this descriptor abandons a sampling query; -1 for none */
+int			pg_interrupt_fd = -1;
+
+/*
+ * wait_for_result - wait until libpq has the next result, or until there is
+ * input on pg_interrupt_fd.  Returns 1 in the latter case, otherwise 0.
+ */
+static int
+wait_for_result(PGconn *pgconn)
+{
+	struct pollfd fds[2];
+
+	while (PQisBusy(pgconn))
+	{
+		fds[0].fd = PQsocket(pgconn);
+		fds[0].events = POLLIN;
+		fds[1].fd = pg_interrupt_fd;	/* ignored by poll() if negative */
+		fds[1].events = POLLIN;
+
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (fds[1].revents & POLLIN)
+			return 1;
+		if (!PQconsumeInput(pgconn))
+			return 0;			/* PQgetResult() reports the error */
+	}
+	return 0;
+}
+
+/* interrupt_pending - whether there is input on pg_interrupt_fd */
+static int
+interrupt_pending(void)
+{
+	struct pollfd fds;
+
+	fds.fd = pg_interrupt_fd;	/* ignored by poll() if negative */
+	fds.events = POLLIN;
+	return poll(&fds, 1, 0) > 0 && (fds.revents & POLLIN);
+}
+
+/*
+ * get_rows - collect the results of the query sent on pgconn and return the
+ * first one with rows or an error.  If there is input on pg_interrupt_fd
+ * before the server is done, the query is cancelled, and whatever arrived
+ * before the cancellation is returned, usually an error.
+ */
+static PGresult *
+get_rows(PGconn *pgconn)
+{
+	PGresult   *pgresult;
+	PGresult   *rows = NULL;
+	PGcancel   *cancel;
+	char		errbuf[256];
+	int			interrupted = 0;
+
+	for (;;)
+	{
+		if (!interrupted && wait_for_result(pgconn))
+		{
+			interrupted = 1;
+			if ((cancel = PQgetCancel(pgconn)) != NULL)
+			{
+				PQcancel(cancel, errbuf, sizeof(errbuf));
+				PQfreeCancel(cancel);
+			}
+		}
+		if ((pgresult = PQgetResult(pgconn)) == NULL)
+			break;
+
+		if (rows == NULL && (PQresultStatus(pgresult) == PGRES_TUPLES_OK ||
+							 PQresultStatus(pgresult) == PGRES_FATAL_ERROR))
+			rows = pgresult;
+		else
+			PQclear(pgresult);
+	}
+	return rows;
+}
+
+/*
+ * pg_exec_sample_params - run a query and return its result.  With binary
+ * set the rows come back in binary format, to be read with pg_getint() and
+ * pg_getlsn(); the text columns read the same either way.
+ *
+ * The socket is not blocked on: a byte written to the collector's interrupt
+ * pipe, which pg_interrupt_fd reads, cancels the query while the server is
+ * still working on it.  A new request or quitting then does not have to
+ * wait for a slow server.
+ */
+static PGresult *
+pg_exec_sample_params(PGconn *pgconn, const char *sql, int nparams,
+					  const Oid *types, const char *const *params, int binary)
+{
+	PGresult   *pgresult;
+	PGresult   *rows;
+	struct timespec start,
+				end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Throw away anything left over from a query that was jumped out of. */
+	if (PQtransactionStatus(pgconn) == PQTRANS_ACTIVE)
+		while ((pgresult = PQgetResult(pgconn)) != NULL)
+			PQclear(pgresult);
+
+	/* Don't start a query that would be cancelled straight away. */
+	if (interrupt_pending())
+		return NULL;
+
+	if (!PQsendQueryParams(pgconn, sql, nparams, types, params, NULL, NULL,
+						   binary))
+		return NULL;
+	rows = get_rows(pgconn);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	query_latency = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	return rows;
+}
+
+PGresult *
+pg_exec_sample(PGconn *pgconn, const char *sql, int binary)
+{
+	return pg_exec_sample_params(pgconn, sql, 0, NULL, NULL, binary);
+}
+
+/*
+ * pg_sample - run the sampling query sample, a SELECT that has backend_state
+ * and usesysid among its columns, asking only for the backends filter lets
+ * through, and for only the first of them if it sorts them.  Following those
+ * rows, and with a null first column, come one row per backend_state with
+ * the columns of count, counting every backend in the sample.  The result is
+ * in binary.
+ */
+PGresult *
+pg_sample(struct pg_conninfo_ctx *conninfo, const char *sample,
+		  const char *count, const struct pg_sample_filter *filter)
+{
+	static const Oid types[] = {INT4OID, TIMESTAMPTZOID, TEXTOID};
+	const char *params[3];
+	char		width[12];
+	char	   *sql;
+	char		where[128];
+	char		order[96];
+	size_t		len;
+	PGresult   *pgresult;
+
+	snprintf(width, sizeof(width), "%d", filter->width);
+	params[0] = width;
+	params[1] = filter->since[0] != '\0' ? filter->since : "-infinity";
+	params[2] = filter->usename;
+
+	where[0] = '\0';
+	if (!filter->show_idle)
+		strcat(where, " AND backend_state IS DISTINCT FROM 'idle'");
+	if (filter->usename[0] != '\0')
+		strcat(where,
+			   " AND usesysid IN (SELECT oid FROM pg_roles WHERE rolname = $3)");
+
+	order[0] = '\0';
+	if (filter->order > 0 && filter->tiebreak > 0)
+		snprintf(order, sizeof(order),
+				 "\nORDER BY %d DESC NULLS LAST, %d DESC NULLS LAST LIMIT %d",
+				 filter->order, filter->tiebreak, filter->limit);
+	else if (filter->order > 0)
+		snprintf(order, sizeof(order), "\nORDER BY %d DESC NULLS LAST LIMIT %d",
+				 filter->order, filter->limit);
+
+	len = strlen(SAMPLE_QUERY) + strlen(sample) + strlen(where) +
+		strlen(order) + strlen(count);
+	if ((sql = (char *) malloc(len)) == NULL)
+		return NULL;
+	snprintf(sql, len, SAMPLE_QUERY, sample, where, order, count);
+
+	pgresult = pg_exec_sample_params(conninfo->connection, sql, 3, types,
+									 params, 1);
+	free(sql);
+	return pgresult;
+}
+
+/*
+ * pg_query_texts - fetch the query text, cut to width, of the npids backends
+ * in pids.  The rows are pid and query, in binary.
+ */
+PGresult *
+pg_query_texts(struct pg_conninfo_ctx *conninfo, const int *pids, int npids,
+			   int width)
+{
+	static const Oid types[] = {INT4OID, TEXTOID};
+	const char *params[2];
+	char		buf[12];
+	char	   *list;
+	size_t		len = 0;
+	int			i;
+	PGresult   *pgresult;
+
+	if ((list = (char *) malloc(npids * 12 + 3)) == NULL)
+		return NULL;
+	list[len++] = '{';
+	for (i = 0; i < npids; i++)
+		len += sprintf(list + len, i == 0 ? "%d" : ",%d", pids[i]);
+	list[len++] = '}';
+	list[len] = '\0';
+
+	snprintf(buf, sizeof(buf), "%d", width);
+	params[0] = buf;
+	params[1] = list;
+	pgresult = pg_exec_sample_params(conninfo->connection, QUERY_TEXTS, 2,
+									 types, params, 1);
+	free(list);
+	return pgresult;
+}
+
+/*
+ * Role names are sent as oids and looked up in this map, sorted by oid.  It
+ * is loaded from pg_roles when an oid is missing from it, at most once a
+ * second, so that new roles are found.
+ */
+struct role_name
+{
+	unsigned int oid;
+	const char *name;			/* interned */
+};
+
+static struct role_name *roles;
+static int	nroles;
+static time_t roles_loaded;
+
+static int
+role_name_compare(const void *v1, const void *v2)
+{
+	const struct role_name *r1 = (const struct role_name *) v1;
+	const struct role_name *r2 = (const struct role_name *) v2;
+
+	return r1->oid < r2->oid ? -1 : r1->oid > r2->oid;
+}
+
+static void
+load_roles(struct pg_conninfo_ctx *conninfo)
+{
+	PGresult   *pgresult;
+	struct role_name *r;
+	struct timespec now;
+	int			i,
+				rows;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (roles != NULL && now.tv_sec - roles_loaded < 1)
+		return;
+	roles_loaded = now.tv_sec;
+
+	pgresult = pg_exec_sample(conninfo->connection, QUERY_ROLES, 1);
+	if (PQresultStatus(pgresult) != PGRES_TUPLES_OK)
+	{
+		PQclear(pgresult);
+		return;
+	}
+
+	rows = PQntuples(pgresult);
+	if ((r = (struct role_name *) reallocarray(roles, rows + 1,
+											   sizeof(*r))) == NULL)
+	{
+		fprintf(stderr, "reallocarray error\n");
+		PQclear(pgresult);
+		disconnect_from_db(conninfo);
+		exit(1);
+	}
+	roles = r;
+	for (i = 0; i < rows; i++)
+	{
+		roles[i].oid = pg_getint(pgresult, i, 0);
+		if ((roles[i].name = intern(PQgetvalue(pgresult, i, 1))) == NULL)
+		{
+			fprintf(stderr, "malloc error\n");
+			PQclear(pgresult);
+			disconnect_from_db(conninfo);
+			exit(1);
+		}
+	}
+	nroles = rows;
+	qsort(roles, nroles, sizeof(*roles), role_name_compare);
+	PQclear(pgresult);
+}
+
+/* pg_role_name - the name of the role with the given oid, "" if unknown */
+const char *
+pg_role_name(struct pg_conninfo_ctx *conninfo, unsigned int oid)
+{
+	struct role_name key,
+			   *r = NULL;
+
+	if (oid == 0)
+		return "";
+
+	key.oid = oid;
+	if (roles != NULL)
+		r = bsearch(&key, roles, nroles, sizeof(*roles), role_name_compare);
+	if (r == NULL)
+	{
+		load_roles(conninfo);
+		if (roles != NULL)
+			r = bsearch(&key, roles, nroles, sizeof(*roles),
+						role_name_compare);
+	}
+	return r != NULL ? r->name : "";
+}
+
+/*
+ * exec_setup - run sql, statements that set up a new connection, and return
+ * the result with rows.  On the sampler's connection they are cut short like
+ * a sample, and NULL is returned.
+ */
+static PGresult *
+exec_setup(struct pg_conninfo_ctx *conninfo, const char *sql)
+{
+	if (!conninfo->sampler)
+		return PQexec(conninfo->connection, sql);
+
+	if (interrupt_pending() || !PQsendQuery(conninfo->connection, sql))
+		return NULL;
+	return get_rows(conninfo->connection);
+}
+
+/*
+ * probe_capabilities - fill in conninfo->caps for a new connection.  Returns
+ * -1 if the server is too old to be sampled, and 1 if the probe was cut
+ * short.
+ */
+static int
+probe_capabilities(struct pg_conninfo_ctx *conninfo)
+{
+	struct pg_capabilities *caps = &conninfo->caps;
+	PGresult   *pgresult;
+	int			i;
+
+	memset(caps, 0, sizeof(struct pg_capabilities));
+	caps->version = PQserverVersion(conninfo->connection) / 100;
+	if (caps->version < MIN_SERVER_VERSION)
+		return -1;
+
+	for (i = 0; i < sizeof(query_templates) / sizeof(query_templates[0]); i++)
+		if (caps->queries[query_templates[i].id] == NULL &&
+			caps->version >= query_templates[i].min_version)
+			caps->queries[query_templates[i].id] = query_templates[i].sql;
+
+	pgresult = exec_setup(conninfo, conninfo->sampler ?
+						  SAMPLER_SETTINGS QUERY_CAPABILITIES :
+						  QUERY_CAPABILITIES);
+	if (pgresult == NULL)
+		return 1;
+	if (PQntuples(pgresult) > 0)
+		for (i = 0; i < sizeof(capability_flags) / sizeof(int); i++)
+			if (PQgetvalue(pgresult, 0, i)[0] == 't')
+				caps->flags |= capability_flags[i];
+	PQclear(pgresult);
+	return 0;
+}
+
+/* longest wait between attempts to restore a lost connection */
+#define MAX_BACKOFF 60
+
+/*
+ * open_connection - connect with the parameters in conninfo, as
+ * PQconnectdbParams() does.  The sampler's connection is made without
+ * blocking, and given up as soon as there is input on pg_interrupt_fd, in
+ * which case NULL is returned.
+ */
+static PGconn *
+open_connection(struct pg_conninfo_ctx *conninfo, const char *const *keywords)
+{
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+	PGconn	   *pgconn;
+	struct pollfd fds[2];
+
+	if (!conninfo->sampler)
+		return PQconnectdbParams(keywords, conninfo->values, 1);
+
+	pgconn = PQconnectStartParams(keywords, conninfo->values, 1);
+	if (pgconn == NULL || PQstatus(pgconn) == CONNECTION_BAD)
+		return pgconn;
+
+	while (status != PGRES_POLLING_OK && status != PGRES_POLLING_FAILED)
+	{
+		fds[0].fd = PQsocket(pgconn);
+		fds[0].events = status == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		fds[1].fd = pg_interrupt_fd;
+		fds[1].events = POLLIN;
+
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;				/* PQstatus() reports the failure */
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			PQfinish(pgconn);
+			return NULL;
+		}
+		status = PQconnectPoll(pgconn);
+	}
+	return pgconn;
+}
+
+/*
+ * connect_to_db - make sure there is a connection to the database
+ *
+ * The connection is kept open for the whole session.  If it has broken since
+ * it was last used, it is closed and opened again, waiting exponentially
+ * longer between failed attempts so that an unreachable server is not
+ * hammered on every refresh.  conninfo->connection is NULL while there is no
+ * connection.
+ */
 void
 connect_to_db(struct pg_conninfo_ctx *conninfo)
 {
-	int			i;
 	const char *keywords[6] = {"host", "port", "user", "password", "dbname",
 	NULL};
+	struct timespec now;
+	int			probe;
+
+	if (conninfo->connection != NULL)
+	{
+		if (PQstatus(conninfo->connection) == CONNECTION_OK &&
+			PQsocket(conninfo->connection) >= 0)
+			return;
+
+		new_message(MT_standout | MT_delayed, " Connection lost: %s",
+					PQerrorMessage(conninfo->connection));
+		PQfinish(conninfo->connection);
+		conninfo->connection = NULL;
+	}
 
-	if (conninfo->persistent && PQsocket(conninfo->connection) >= 0)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < conninfo->retry_at)
 		return;
 
-	conninfo->connection = PQconnectdbParams(keywords, conninfo->values, 1);
+	/* cut short: tried again on the next sample, without waiting */
+	if ((conninfo->connection = open_connection(conninfo, keywords)) == NULL)
+		return;
 	if (PQstatus(conninfo->connection) != CONNECTION_OK)
 	{
-		new_message(MT_standout | MT_delayed, " %s",
-					PQerrorMessage(conninfo->connection));
+		if (conninfo->backoff == 0)
+			conninfo->backoff = 1;
+		else if (conninfo->backoff * 2 <= MAX_BACKOFF)
+			conninfo->backoff *= 2;
+		else
+			conninfo->backoff = MAX_BACKOFF;
+		conninfo->retry_at = now.tv_sec + conninfo->backoff;
+
+		new_message(MT_standout | MT_delayed, " Retrying in %ds: %s",
+					conninfo->backoff, PQerrorMessage(conninfo->connection));
 
 		PQfinish(conninfo->connection);
 		conninfo->connection = NULL;
 		return;
 	}
+	conninfo->backoff = 0;
+	conninfo->retry_at = 0;
 
-	if (conninfo->persistent)
-		for (i = 0; i < 5; i++)
-			if (conninfo->values[i] != NULL)
-				free((void *) conninfo->values[i]);
+	/* an old server is only tried again as often as an unreachable one */
+	probe = probe_capabilities(conninfo);
+	if (probe == -1)
+	{
+		conninfo->backoff = MAX_BACKOFF;
+		conninfo->retry_at = now.tv_sec + conninfo->backoff;
+
+		new_message(MT_standout | MT_delayed,
+					" PostgreSQL %d.%d is not supported, %d.%d or later is needed",
+					conninfo->caps.version / 100, conninfo->caps.version % 100,
+					MIN_SERVER_VERSION / 100, MIN_SERVER_VERSION % 100);
 
-	PQexec(conninfo->connection,
-			"SET SESSION CHARACTERISTICS AS TRANSACTION ISOLATION LEVEL " \
-			"READ UNCOMMITTED;");
+		PQfinish(conninfo->connection);
+		conninfo->connection = NULL;
+	}
+	else if (probe == 1)
+		disconnect_from_db(conninfo);
 }
 
 void
 disconnect_from_db(struct pg_conninfo_ctx *conninfo)
 {
-	if (conninfo->persistent)
-		return;
 	PQfinish(conninfo->connection);
+	conninfo->connection = NULL;
+}
+
+/*
+ * pg_set_sampler - take samples on conninfo from now on, with the timeout
+ * that the other connections go without
+ */
+void
+pg_set_sampler(struct pg_conninfo_ctx *conninfo)
+{
+	conninfo->sampler = 1;
+	if (conninfo->connection != NULL)
+		PQclear(exec_setup(conninfo, SAMPLER_SETTINGS));
 }
 
 PGresult *
-pg_locks(PGconn *pgconn, int procpid)
+pg_locks(struct pg_conninfo_ctx *conninfo, int procpid)
 {
+	const char *query = conninfo->caps.queries[PGQ_LOCKS];
 	char	   *sql;
 	PGresult   *pgresult;
 
-	if (pg_version(pgconn) >= 902)
-	{
-		sql = (char *) malloc(strlen(GET_LOCKS) + 7);
-		sprintf(sql, GET_LOCKS, procpid);
-	}
-	else
-	{
-		sql = (char *) malloc(strlen(GET_LOCKS) + 7);
-		sprintf(sql, GET_LOCKS_9_1, procpid);
-	}
-	pgresult = PQexec(pgconn, sql);
+	sql = (char *) malloc(strlen(query) + 7);
+	sprintf(sql, query, procpid);
+	pgresult = PQexec(conninfo->connection, sql);
 	free(sql);
 	return pgresult;
 }
 
 PGresult *
-pg_processes(PGconn *pgconn)
+pg_processes(struct pg_conninfo_ctx *conninfo,
+			 const struct pg_sample_filter *filter)
 {
-	PGresult   *pgresult;
-
-	PQexec(pgconn, "BEGIN;");
-	PQexec(pgconn, "SET statement_timeout = '2s';");
-	if (pg_version(pgconn) >= 902)
-	{
-		pgresult = PQexec(pgconn, QUERY_PROCESSES);
-	}
-	else
-	{
-		pgresult = PQexec(pgconn, QUERY_PROCESSES_9_1);
-	}
-	PQexec(pgconn, "ROLLBACK;;");
-	return pgresult;
+	return pg_sample(conninfo, conninfo->caps.queries[PGQ_PROCESSES],
+					 PROCESSES_COUNT, filter);
 }
 
 PGresult *
-pg_replication(PGconn *pgconn)
+pg_lock_counts(struct pg_conninfo_ctx *conninfo)
 {
-	PGresult   *pgresult;
+	return pg_exec_sample(conninfo->connection,
+						  conninfo->caps.queries[PGQ_LOCK_COUNTS], 1);
+}
 
-	PQexec(pgconn, "BEGIN;");
-	PQexec(pgconn, "SET statement_timeout = '2s';");
-	if (pg_version(pgconn) >= 1000) {
-		pgresult = PQexec(pgconn, REPLICATION);
-	} else {
-		pgresult = PQexec(pgconn, REPLICATION_9_6);
-	}
-	PQexec(pgconn, "ROLLBACK;");
-	return pgresult;
+PGresult *
+pg_replication(struct pg_conninfo_ctx *conninfo)
+{
+	return pg_exec_sample(conninfo->connection,
+						  conninfo->caps.queries[PGQ_REPLICATION], 1);
 }
 
 PGresult *
-pg_query(PGconn *pgconn, int procpid)
+pg_query(struct pg_conninfo_ctx *conninfo, int procpid)
 {
+	const char *query = conninfo->caps.queries[PGQ_CURRENT_QUERY];
 	char	   *sql;
 	PGresult   *pgresult;
 
-	if (pg_version(pgconn) >= 902)
-	{
-		sql = (char *) malloc(strlen(CURRENT_QUERY) + 7);
-		sprintf(sql, CURRENT_QUERY, procpid);
-	}
-	else
-	{
-		sql = (char *) malloc(strlen(CURRENT_QUERY_9_1) + 7);
-		sprintf(sql, CURRENT_QUERY_9_1, procpid);
-	}
-	pgresult = PQexec(pgconn, sql);
+	sql = (char *) malloc(strlen(query) + 7);
+	sprintf(sql, query, procpid);
+	pgresult = PQexec(conninfo->connection, sql);
 	free(sql);
 
 	return pgresult;
 }
 
-int
-pg_version(PGconn *pgconn)
+static uint32_t
+get_be32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+		(uint32_t) p[2] << 8 | p[3];
+}
+
+/*
+ * pg_getint - the value of an integer column, in either format.  NULL reads
+ * as 0.
+ */
+long long
+pg_getint(const PGresult *pgresult, int row, int col)
+{
+	const unsigned char *p;
+
+	if (PQgetisnull(pgresult, row, col))
+		return 0;
+
+	p = (const unsigned char *) PQgetvalue(pgresult, row, col);
+	if (PQfformat(pgresult, col) == 0)
+		return atoll((const char *) p);
+
+	switch (PQftype(pgresult, col))
+	{
+		case INT2OID:
+			return (int16_t) (p[0] << 8 | p[1]);
+		case INT4OID:
+			return (int32_t) get_be32(p);
+		case INT8OID:
+			return (int64_t) ((uint64_t) get_be32(p) << 32 | get_be32(p + 4));
+		case OIDOID:
+			return get_be32(p);
+	}
+	return 0;
+}
+
+/*
+ * pg_getlsn - the value of a WAL location column, whether it is a pg_lsn in
+ * binary or text in the X/X form older servers use.  NULL reads as 0, which
+ * is never a valid location.
+ */
+uint64_t
+pg_getlsn(const PGresult *pgresult, int row, int col)
 {
-	return PQserverVersion(pgconn) / 100;
+	const unsigned char *p;
+	unsigned int hi,
+				lo;
+
+	if (PQgetisnull(pgresult, row, col))
+		return 0;
+
+	p = (const unsigned char *) PQgetvalue(pgresult, row, col);
+	if (PQfformat(pgresult, col) == 1 && PQftype(pgresult, col) == LSNOID)
+		return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+
+	if (sscanf((const char *) p, "%X/%X", &hi, &lo) != 2)
+		return 0;
+	return (uint64_t) hi << 32 | lo;
 }
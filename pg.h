@@ -3,22 +3,81 @@
 #ifndef _PG_H_
 #define _PG_H_
 
+#include <stdint.h>
+#include <time.h>
 #include <libpq-fe.h>
 
+/* what the server allows, found out once for each connection */
+#define PG_CAP_IN_RECOVERY			0x01	/* server is a standby */
+#define PG_CAP_MONITOR				0x02	/* may see every backend's query */
+#define PG_CAP_PG_PROCTAB			0x04	/* pg_proctab functions installed */
+#define PG_CAP_PG_STAT_STATEMENTS	0x08	/* extensions installed */
+#define PG_CAP_PG_BUFFERCACHE		0x10
+
+/* queries that differ between server versions */
+enum pg_query_id
+{
+	PGQ_PROCESSES,
+	PGQ_REPLICATION,
+	PGQ_LOCKS,
+	PGQ_LOCK_COUNTS,
+	PGQ_CURRENT_QUERY,
+	NPGQUERIES
+};
+
+struct pg_capabilities
+{
+	int			version;		/* major version, e.g. 906 or 1600 */
+	int			flags;			/* PG_CAP_* */
+	const char *queries[NPGQUERIES];	/* the query text for this server */
+};
+
 struct pg_conninfo_ctx
 {
 	PGconn	   *connection;
-	int			persistent;
+	struct pg_capabilities caps;
 	const char *values[6];
+	int			backoff;		/* seconds to wait before reconnecting */
+	time_t		retry_at;		/* monotonic time of the next attempt */
+	int			sampler;		/* samples are taken on it, with a timeout */
+};
+
+/*
+ * The backends a sample asks the server for.  With order set to a column
+ * number, only the limit backends with the highest values in it are sent,
+ * ties going to the highest in tiebreak if that is set too.
+ */
+struct pg_sample_filter
+{
+	int			show_idle;		/* include idle backends */
+	const char *usename;		/* only this user, unless empty */
+	int			order;			/* column to pick the top rows by, or 0 */
+	int			tiebreak;		/* column to break ties in order by, or 0 */
+	int			limit;			/* rows to send when order is set */
+	int			width;			/* characters of query text to send */
+	const char *since;			/* server time of the last sample, or "" */
 };
 
 void		connect_to_db(struct pg_conninfo_ctx *);
 void		disconnect_from_db(struct pg_conninfo_ctx *);
+void		pg_set_sampler(struct pg_conninfo_ctx *);
+
+PGresult   *pg_exec_sample(PGconn *, const char *, int);
+long long	pg_getint(const PGresult *, int, int);
+uint64_t	pg_getlsn(const PGresult *, int, int);
+PGresult   *pg_locks(struct pg_conninfo_ctx *, int);
+PGresult   *pg_lock_counts(struct pg_conninfo_ctx *);
+PGresult   *pg_processes(struct pg_conninfo_ctx *,
+						 const struct pg_sample_filter *);
+PGresult   *pg_replication(struct pg_conninfo_ctx *);
+PGresult   *pg_query(struct pg_conninfo_ctx *, int);
+PGresult   *pg_query_texts(struct pg_conninfo_ctx *, const int *, int, int);
+const char *pg_role_name(struct pg_conninfo_ctx *, unsigned int);
+PGresult   *pg_sample(struct pg_conninfo_ctx *, const char *, const char *,
+					  const struct pg_sample_filter *);
 
-PGresult   *pg_locks(PGconn *, int);
-PGresult   *pg_processes(PGconn *);
-PGresult   *pg_replication(PGconn *);
-PGresult   *pg_query(PGconn *, int);
+extern double query_latency;
+extern int	pg_interrupt_fd;
 
 enum BackendState
 {
@@ -36,10 +95,18 @@ enum pg_stat_activity
 	PROC_PID = 0,
 	PROC_QUERY,
 	PROC_STATE,
-	PROC_USENAME,
+	PROC_USESYSID,
 	PROC_XSTART,
 	PROC_QSTART,
-	PROC_LOCKS
+	PROC_LOCK_WAIT,
+	PROC_COUNT,
+	PROC_SAMPLED_AT
+};
+
+enum pg_lock_counts
+{
+	LOCK_PID = 0,
+	LOCK_COUNT
 };
 
 enum pg_stat_replication
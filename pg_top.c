@@ -35,6 +35,7 @@ char	   *copyright =
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 
 /* determine which type of signal functions to use */
 #ifdef HAVE_SIGACTION
@@ -59,6 +60,7 @@ char	   *copyright =
 #include "color.h"
 #endif
 #include "port.h"
+#include "snapshot.h"
 
 /* Size of the stdio buffer given to stdout */
 #define Buffersize	2048
@@ -80,6 +82,7 @@ extern int	overstrike;
 
 /* values which need to be accessed by signal handlers */
 int			max_topn;			/* maximum displayable processes */
+static volatile sig_atomic_t leaving;	/* set by the INT handler */
 
 /* miscellaneous things */
 char	   *myname = "pg_top";
@@ -96,10 +99,12 @@ static struct option long_options[] = {
 	{"batch", no_argument, NULL, 'b'},
 	{"show-command", no_argument, NULL, 'c'},
 	{"color-mode", no_argument, NULL, 'C'},
+	{"host-view", no_argument, NULL, 'G'},
 	{"interactive", no_argument, NULL, 'i'},
 	{"hide-idle", no_argument, NULL, 'I'},
 	{"non-interactive", no_argument, NULL, 'n'},
 	{"order-field", required_argument, NULL, 'o'},
+	{"per-cpu", no_argument, NULL, 'P'},
 	{"remote-mode", no_argument, NULL, 'r'},
 	{"set-delay", required_argument, NULL, 's'},
 	{"show-tags", no_argument, NULL, 'T'},
@@ -112,6 +117,11 @@ static struct option long_options[] = {
 	{"port", required_argument, NULL, 'p'},
 	{"username", required_argument, NULL, 'U'},
 	{"password", no_argument, NULL, 'W'},
+	{"collector-threads", required_argument, NULL, 1},
+	{"lock-interval", required_argument, NULL, 2},
+	{"lock-waits", no_argument, NULL, 3},
+	{"sample-interval", required_argument, NULL, 4},
+	{"debug", no_argument, NULL, 'D'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -124,6 +134,8 @@ void		(*d_procstates) (int, int *) = i_procstates;
 void		(*d_cpustates) (int64_t *) = i_cpustates;
 void		(*d_memory) (long *) = i_memory;
 void		(*d_swap) (long *) = i_swap;
+void		(*d_pressure) (int64_t *) = i_pressure;
+void		(*d_cgroup) (int64_t *) = i_cgroup;
 void		(*d_message) () = i_message;
 void		(*d_process) (int, char *) = i_process;
 
@@ -140,13 +152,15 @@ usage(const char *progname)
 	printf("  -b, --batch               use batch mode\n");
 	printf("  -c, --show-command        display command name of each process\n");
 	printf("  -C, --color-mode          turn off color mode\n");
+	printf("  -G, --host-view           show the host's figures, not the cgroup's\n");
 	printf("  -i, --interactive         use interactive mode\n");
 	printf("  -I, --hide-idle           hide idle processes\n");
 	printf("  -n, --non-interactive     use non-interactive mode\n");
 	printf("  -o, --order-field=FIELD   select sort order\n");
+	printf("  -P, --per-cpu             show the cpu states of each cpu\n");
 	printf("  -r, --remote-mode         activate remote mode\n");
 	printf("  -R                        display replication stats\n");
-	printf("  -s, --set-delay=SECOND    set delay between screen updates\n");
+	printf("  -s, --set-delay=SECONDS   set delay between screen updates\n");
 	printf("  -T, --show-tags           show color tags\n");
 	printf("  -V, --version             output version information, then exit\n");
 	printf("  -x, --set-display=COUNT   set maximum number of displays\n");
@@ -154,21 +168,58 @@ usage(const char *progname)
 	printf("  -X                        display i/o stats\n");
 	printf("  -z, --show-username=NAME  display only processes owned by given\n");
 	printf("                            username\n");
+	printf("  --collector-threads=COUNT use COUNT threads to gather process stats\n");
+	printf("  --lock-interval=SECONDS   count the locks of each process every SECONDS\n");
+	printf("  --lock-waits              only show whether a process waits on a lock\n");
+	printf("  --sample-interval=SECONDS sample every SECONDS between screen updates\n");
+	printf("  -D, --debug               show how long each update takes\n");
 	printf("  -?, --help                show this help, then exit\n");
 	printf("\nConnection options:\n");
 	printf("  -d, --dbname=DBNAME       database to connect to\n");
 	printf("  -h, --host=HOSTNAME       database server host or socket directory\n");
 	printf("  -p, --port=PORT           database server port\n");
 	printf("  -U, --username=USERNAME   user name to connect as\n");
-	printf("  -W, --password            force password prompt, and persistent connection\n");
+	printf("  -W, --password            force password prompt\n");
 }
 
-RETSIGTYPE
-onalrm(int i)					/* SIGALRM handler */
+/* seconds spent gathering the update on the screen, and waiting for the db */
+static double tick_latency;
+static double db_latency;
+
+/* a command was given, so the next update should not wait for the delay */
+static int	refresh_wanted;
 
+/*
+ *	latency_minibar - format the time spent waiting for the database and the
+ *	time spent gathering the whole update, in milliseconds
+ */
+static int
+latency_minibar(char *buf, int width)
 {
-	/* this is only used in batch mode to break out of the pause() */
-	/* return; */
+	return snprintf(buf, width + 1, "db %.1f/%.1fms",
+					db_latency * 1000.0, tick_latency * 1000.0);
+}
+
+/*
+ *	make_request - what the collector thread should gather for the display
+ *	as it is now set up
+ */
+static void
+make_request(struct pg_top_context *pgtctx, struct snapshot_request *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->ps = pgtctx->ps;
+
+	/* only the processes that fit on the screen need to be sorted */
+	req->ps.topn = pgtctx->topn < max_topn ? pgtctx->topn : max_topn;
+	req->ps.width = screen_width < MAX_COLS ? screen_width : MAX_COLS - 1;
+
+	req->mode = pgtctx->mode;
+	req->mode_remote = pgtctx->mode_remote;
+	req->order_index = pgtctx->order_index;
+	req->delay = pgtctx->delay;
+	req->sample = pgtctx->sample;
+	req->header_text = pgtctx->header_text;
 }
 
 void
@@ -177,36 +228,59 @@ do_display(struct pg_top_context *pgtctx)
 	register int i = 0;
 	register int active_procs;
 
-	caddr_t		processes;
+	struct snapshot *snap;
+	struct snapshot_request req;
 	time_t		curr_time;
+	static char *shown_header = NULL;
+	static int	shown_cgroup = No;
+	int			cgroup;
 	static struct ext_decl exts = {NULL, NULL};
 
-	/* get the current stats and processes */
-	if (pgtctx->mode_remote == 0)
+	/* a changed setting is gathered right away, without waiting */
+	make_request(pgtctx, &req);
+	snapshot_request(&req, refresh_wanted);
+	refresh_wanted = No;
+
+	/* draw the latest snapshot the collector thread has published */
+	while ((snap = snapshot_latest()) == NULL)
+		snapshot_wait();
+	tick_latency = snap->tick_latency;
+	db_latency = snap->query_latency;
+
+	/* the header only changes with the rows that go with it */
+	if (snap->header_text != shown_header)
 	{
-		get_system_info(&pgtctx->system_info);
-		processes = get_process_info(&pgtctx->system_info, &pgtctx->ps,
-									 pgtctx->order_index, &pgtctx->conninfo,
-									pgtctx->mode);
+		reset_display(pgtctx);
+		shown_header = snap->header_text;
 	}
-	else
+
+	/* the figures of the server's cgroup take the place of the host's */
+	cgroup = !pgtctx->hostview && snap->system_info.cgroup != NULL;
+	if (cgroup != shown_cgroup)
 	{
-		get_system_info_r(&pgtctx->system_info, &pgtctx->conninfo);
-		processes = get_process_info_r(&pgtctx->system_info, &pgtctx->ps,
-									   pgtctx->order_index, &pgtctx->conninfo, pgtctx->mode);
+		max_topn = display_cgroup(cgroup);
+		reset_display(pgtctx);
+		shown_cgroup = cgroup;
 	}
 
 	/* display the load averages */
-	(*d_loadave) (pgtctx->system_info.last_pid, pgtctx->system_info.load_avg);
+	(*d_loadave) (snap->system_info.last_pid, snap->system_info.load_avg);
 
-	/* this method of getting the time SHOULD be fairly portable */
-	time(&curr_time);
+	/* the time the snapshot was taken */
+	curr_time = snap->time;
 
-	/* if we have a minibar extension, use it, otherwise show uptime */
+	/*
+	 * if we have a minibar extension, use it, otherwise show the latency when
+	 * debugging or else the uptime
+	 */
 	if (exts.f_minibar != NULL)
 	{
 		(*d_minibar) (exts.f_minibar);
 	}
+	else if (pgtctx->debug)
+	{
+		(*d_minibar) (latency_minibar);
+	}
 	else
 	{
 		(*d_uptime) (&pgtctx->statics.boottime, &curr_time);
@@ -216,44 +290,61 @@ do_display(struct pg_top_context *pgtctx)
 	i_timeofday(&curr_time);
 
 	/* display process state breakdown */
-	(*d_procstates) (pgtctx->system_info.p_total, pgtctx->system_info.procstates);
+	(*d_procstates) (snap->system_info.p_total, snap->system_info.procstates);
 
-	/* display the cpu state percentage breakdown */
-	if (pgtctx->dostates)		/* but not the first time */
+	/* display those of the cgroup, stalls included */
+	if (shown_cgroup)
 	{
-		(*d_cpustates) (pgtctx->system_info.cpustates);
+		(*d_cgroup) (snap->system_info.cgroup);
 	}
 	else
 	{
-		/* we'll do it next time */
-		if (smart_terminal)
+		/* display the cpu state percentage breakdown */
+		if (pgtctx->dostates)	/* but not the first time */
 		{
-			z_cpustates();
+			(*d_cpustates) (snap->system_info.cpustates);
+
+			/* and those of each cpu, if asked */
+			if (pgtctx->percpu)
+			{
+				i_percpu(snap->system_info.percpu_cpustates);
+			}
+		}
+		else
+		{
+			/* we'll do it next time */
+			if (smart_terminal)
+			{
+				z_cpustates();
+			}
+			pgtctx->dostates = Yes;
 		}
-		pgtctx->dostates = Yes;
-	}
 
-	/* display memory stats */
-	(*d_memory) (pgtctx->system_info.memory);
+		/* display memory stats */
+		(*d_memory) (snap->system_info.memory);
 
-	/* display swap stats */
-	(*d_swap) (pgtctx->system_info.swap);
+		/* display swap stats */
+		(*d_swap) (snap->system_info.swap);
+
+		/* display pressure stall stats */
+		(*d_pressure) (snap->system_info.pressure);
+	}
 
 	/* handle message area */
 	(*d_message) ();
 
 	/* update the header area */
-	pgtctx->d_header(pgtctx->header_text);
+	pgtctx->d_header(snap->header_text);
 
 	if (pgtctx->topn > 0)
 	{
 		/* determine number of processes to actually display */
 
 		/*
-		 * this number will be the smallest of:  active processes, number user
-		 * requested, number current screen accomodates
+		 * this number will be the smallest of:  rows formatted in the
+		 * snapshot, number user requested, number current screen accomodates
 		 */
-		active_procs = pgtctx->system_info.P_ACTIVE;
+		active_procs = snap->nrows;
 		if (active_procs > pgtctx->topn)
 		{
 			active_procs = pgtctx->topn;
@@ -264,37 +355,9 @@ do_display(struct pg_top_context *pgtctx)
 		}
 
 		/* Now show the top "n" processes or other statistics. */
-		switch (pgtctx->mode)
+		for (i = 0; i < active_procs; i++)
 		{
-#if defined(__linux__) || defined(__FreeBSD__)
-			case MODE_IO_STATS:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_io(processes));
-					else
-						(*d_process) (i, format_next_io_r(processes));
-				}
-				break;
-#endif /* defined(__linux__) || defined(__FreeBSD__) */
-			case MODE_REPLICATION:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_replication(processes));
-					else
-						(*d_process) (i, format_next_replication_r(processes));
-				}
-				break;
-			case MODE_PROCESSES:
-			default:
-				for (i = 0; i < active_procs; i++)
-				{
-					if (pgtctx->mode_remote == 0)
-						(*d_process) (i, format_next_process(processes));
-					else
-						(*d_process) (i, format_next_process_r(processes));
-				}
+			(*d_process) (i, snap->rows[i]);
 		}
 	}
 	else
@@ -333,6 +396,8 @@ do_display(struct pg_top_context *pgtctx)
 				d_cpustates = u_cpustates;
 				d_memory = u_memory;
 				d_swap = u_swap;
+				d_pressure = u_pressure;
+				d_cgroup = u_cgroup;
 				d_message = u_message;
 				pgtctx->d_header = u_header;
 				d_process = u_process;
@@ -341,12 +406,8 @@ do_display(struct pg_top_context *pgtctx)
 
 		if (!pgtctx->interactive)
 		{
-			/* set up alarm */
-			(void) signal(SIGALRM, onalrm);
-			(void) alarm((unsigned) pgtctx->delay);
-
-			/* wait for the rest of it .... */
-			pause();
+			/* wait for the next snapshot */
+			snapshot_wait();
 		}
 		else
 			process_commands(pgtctx);
@@ -359,7 +420,7 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 	int			i;
 	int			option_index;
 
-	while ((i = getopt_long(ac, av, "CDITbcinRrVh:s:d:U:o:Wp:Xx:z:",
+	while ((i = getopt_long(ac, av, "CDGIPTbcinRrVh:s:d:U:o:Wp:Xx:z:",
 							long_options, &option_index)) != EOF)
 	{
 		switch (i)
@@ -372,6 +433,7 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 
 			case 'D':
 				debug_set(1);
+				pgtctx->debug = 1;
 				break;
 
 			case 'V':			/* show version number */
@@ -387,6 +449,14 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				pgtctx->ps.idle = !pgtctx->ps.idle;
 				break;
 
+			case 'P':			/* show the states of each cpu */
+				pgtctx->percpu = 1;
+				break;
+
+			case 'G':			/* show the host even with a cgroup */
+				pgtctx->hostview = 1;
+				break;
+
 			case 'T':			/* show color tags */
 				pgtctx->show_tags = 1;
 				break;
@@ -417,8 +487,9 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				break;
 
 			case 's':
-				if ((pgtctx->delay = atoi(optarg)) < 0 ||
-					(pgtctx->delay == 0 && getuid() != 0))
+				if ((pgtctx->delay = atosecs(optarg)) < 0 ||
+					(pgtctx->delay < Minimum_DELAY &&
+					 (pgtctx->delay != 0 || getuid() != 0)))
 				{
 					new_message(MT_standout | MT_delayed,
 								" Bad seconds delay (ignored)");
@@ -443,7 +514,8 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				break;
 
 			case 'W':			/* prompt for database password */
-				pgtctx->conninfo.persistent = 1;
+				if (pgtctx->conninfo.values[PG_PASSWORD] != NULL)
+					free((void *) pgtctx->conninfo.values[PG_PASSWORD]);
 				pgtctx->conninfo.values[PG_PASSWORD] =
 					simple_prompt("Password: ", 1000, 0);
 				break;
@@ -472,6 +544,43 @@ process_arguments(struct pg_top_context *pgtctx, int ac, char **av)
 				pgtctx->mode = MODE_IO_STATS;
 				break;
 
+			case 1:				/* collector threads */
+				if ((i = atoiwi(optarg)) == Invalid || i < 1)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad collector thread count (ignored)");
+				}
+				else
+				{
+					pgtctx->ps.collectors = i;
+				}
+				break;
+
+			case 2:				/* seconds between lock counts */
+				if ((i = atoiwi(optarg)) == Invalid || i < 0)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad lock interval (ignored)");
+				}
+				else
+				{
+					pgtctx->ps.lock_interval = i;
+				}
+				break;
+
+			case 3:				/* no lock counts, only lock waits */
+				pgtctx->ps.lock_waits = 1;
+				break;
+
+			case 4:				/* seconds between samples */
+				if ((pgtctx->sample = atosecs(optarg)) < Minimum_DELAY)
+				{
+					new_message(MT_standout | MT_delayed,
+								" Bad sample interval (ignored)");
+					pgtctx->sample = 0;
+				}
+				break;
+
 			default:
 				fprintf(stderr, "Try \"%s --help\" for more information.\n",
 						progname);
@@ -491,16 +600,21 @@ process_commands(struct pg_top_context *pgtctx)
 	{
 		no_command = No;
 
-		/* set up arguments for select with timeout */
+		/* set up arguments for select */
 		FD_ZERO(&readfds);
 		FD_SET(0, &readfds);	/* for standard input */
-		pgtctx->timeout.tv_sec = pgtctx->delay;
-		pgtctx->timeout.tv_usec = 0;
+		FD_SET(snapshot_fd(), &readfds);
 
-		/* wait for either input or the end of the delay period */
-		if (select(32, &readfds, (fd_set *) NULL, (fd_set *) NULL,
-				   &pgtctx->timeout) > 0)
+		/* wait for either input or the next snapshot */
+		if (select(snapshot_fd() + 1, &readfds, (fd_set *) NULL,
+				   (fd_set *) NULL, NULL) > 0)
 		{
+			if (!FD_ISSET(0, &readfds))
+			{
+				snapshot_wait();
+				break;
+			}
+
 			/* something to read -- clear the message area first */
 			clear_message();
 
@@ -516,6 +630,7 @@ process_commands(struct pg_top_context *pgtctx)
 			}
 
 			no_command = execute_command(pgtctx, ch);
+			refresh_wanted = Yes;
 
 			/* flush out stuff that may have been written */
 			fflush(stdout);
@@ -538,6 +653,8 @@ reset_display(struct pg_top_context *pgtctx)
 	d_cpustates = i_cpustates;
 	d_memory = i_memory;
 	d_swap = i_swap;
+	d_pressure = i_pressure;
+	d_cgroup = i_cgroup;
 	d_message = i_message;
 	pgtctx->d_header = i_header;
 	d_process = i_process;
@@ -565,8 +682,9 @@ set_signal(int sig, RETSIGTYPE(*handler) (int))
 RETSIGTYPE
 leave(int i)					/* exit under normal conditions -- INT handler */
 {
-	end_screen();
-	exit(0);
+	/* quit from the main loop, where the collector can be stopped */
+	leaving = 1;
+	longjmp(jmp_int, 1);
 }
 
 RETSIGTYPE
@@ -636,6 +754,7 @@ winch(int i)					/* SIGWINCH handler */
 void
 quit(int status)				/* exit under duress */
 {
+	snapshot_stop();
 	end_screen();
 	exit(status);
 	/* NOTREACHED */
@@ -646,6 +765,7 @@ main(int argc, char *argv[])
 {
 	register int i;
 	struct pg_top_context pgtctx;
+	struct snapshot_request req;
 
 #ifdef BSD_SIGNALS
 	int			old_sigmask;	/* only used for BSD-style signals */
@@ -683,14 +803,18 @@ main(int argc, char *argv[])
 	pgtctx.mode = MODE_PROCESSES;
 	pgtctx.mode_remote = No;
 	pgtctx.order_index = -1;
+	pgtctx.percpu = No;
+	pgtctx.hostview = No;
 	pgtctx.ps.idle = Yes;
 	pgtctx.ps.fullcmd = Yes;
 	pgtctx.ps.command = NULL;
 	pgtctx.ps.usename[0] = '\0';
+	pgtctx.ps.collectors = 1;
+	pgtctx.ps.lock_interval = Default_LOCK_INTERVAL;
+	pgtctx.ps.lock_waits = No;
 	pgtctx.show_tags = No;
 	pgtctx.topn = 0;
 	pgtctx.conninfo.connection = NULL;
-	pgtctx.conninfo.persistent = 0;
 
 	/* Show help or version number if necessary */
 	if (argc > 1)
@@ -895,6 +1019,12 @@ main(int argc, char *argv[])
 		pgtctx.topn = display_resize();
 	}
 
+	/* the per-CPU area takes lines from the processes while it is shown */
+	if (pgtctx.percpu)
+	{
+		max_topn = display_percpu(1);
+	}
+
 	/* print warning if user requested more processes than we can display */
 	if (pgtctx.topn > max_topn)
 	{
@@ -957,10 +1087,16 @@ main(int argc, char *argv[])
 	(void) set_signal(SIGWINCH, winch);
 #endif
 
+	/* from here on the statistics are gathered by the collector thread */
+	make_request(&pgtctx, &req);
+	snapshot_start(&pgtctx.statics, &pgtctx.conninfo, &req);
+
 	/* setup the jump buffer for stops */
 	if (setjmp(jmp_int) != 0)
 	{
 		/* control ends up here after an interrupt */
+		if (leaving)
+			quit(0);
 		reset_display(&pgtctx);
 	}
 
@@ -985,26 +1121,9 @@ main(int argc, char *argv[])
 	(void) sigsetmask(old_sigmask);
 #endif
 
-	/* some systems require a warmup */
+	/* the collector thread warms up some systems before the first snapshot */
 	if (pgtctx.statics.flags.warmup)
 	{
-		if (pgtctx.mode_remote == 0)
-		{
-			get_system_info(&pgtctx.system_info);
-			(void) get_process_info(&pgtctx.system_info, &pgtctx.ps, -1,
-									&pgtctx.conninfo, pgtctx.mode);
-		}
-		else
-		{
-			get_system_info_r(&pgtctx.system_info, &pgtctx.conninfo);
-			(void) get_process_info_r(&pgtctx.system_info, &pgtctx.ps, -1,
-									  &pgtctx.conninfo, -1);
-		}
-
-		pgtctx.timeout.tv_sec = 1;
-		pgtctx.timeout.tv_usec = 0;
-		select(0, NULL, NULL, NULL, &pgtctx.timeout);
-
 		/* if we've warmed up, then we can show good states too */
 		pgtctx.dostates = Yes;
 	}
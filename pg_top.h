@@ -56,6 +56,15 @@ struct ext_decl
 #define Default_DELAY	5
 #endif
 
+/* the shortest delay, in seconds; only root may ask for none at all */
+#ifndef Minimum_DELAY
+#define Minimum_DELAY	0.1
+#endif
+
+#ifndef Default_LOCK_INTERVAL
+#define Default_LOCK_INTERVAL	30
+#endif
+
 /*
  *	If the local system's getpwnam interface uses random access to retrieve
  *	a record (i.e.: 4.3 systems, Sun "yellow pages"), then defining
@@ -87,8 +96,10 @@ struct pg_top_context
 #ifdef ENABLE_COLOR
 	int			color_on;
 #endif
-	int			delay;
+	int			debug;			/* show sampling latency */
+	double		delay;			/* seconds between screen updates */
 	int			displays;
+	char		hostview;		/* show the host's figures, not the cgroup's */
 	void		(*d_header) (char *);
 	char		do_unames;
 	char		dostates;
@@ -100,11 +111,11 @@ struct pg_top_context
 								 * system. */
 	int			order_index;
 	char	   *order_name;
+	char		percpu;			/* show the states of each cpu */
 	struct process_select ps;
+	double		sample;			/* seconds between samples, 0 for delay */
 	char		show_tags;
 	struct statics statics;
-	struct system_info system_info;
-	struct timeval timeout;
 	int			topn;
 	struct pg_conninfo_ctx conninfo;
 };
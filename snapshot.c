@@ -0,0 +1,601 @@
+/*
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+/*
+ * The snapshots the display draws are taken by a collector thread, on its
+ * own schedule, so that a slow sample neither stalls the screen nor pushes
+ * back the next one.  The thread gathers the system and process statistics,
+ * formats the rows to show and publishes the result through a triple
+ * buffer: one snapshot is being taken, one is on the screen, and the third
+ * is the latest one published.  Publishing one and taking one are each a
+ * single atomic exchange of the latest index, so neither thread ever waits
+ * for the other.
+ *
+ * Samples can be taken more often than the screen is updated.  Those taken
+ * in between only gather the system statistics, and the CPU states that are
+ * published are the average over all of them.  Process rates already span
+ * the time since the last full sample, which is the last update.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "machine.h"
+#include "pg.h"
+#include "remote.h"
+#include "snapshot.h"
+
+/* set in latest while its snapshot has not been taken by the display */
+#define SNAPSHOT_FRESH	4
+
+/* seconds early that a tick still counts as due, for rounding */
+#define SNAPSHOT_SLACK	1e-6
+
+static struct snapshot snapshots[3];
+static atomic_int latest = 1;
+static int	front = -1;			/* on the screen, owned by the display */
+static int	back = 2;			/* being taken, owned by the collector */
+
+static int	num_procstates;
+static int	num_cpustates;
+static int	num_percpu;			/* num_cpustates for each cpu */
+static int	num_pressure;		/* some and full for each pressure name */
+static int	num_cgroup;			/* the cgroup names, then pressure */
+static int	num_memory;
+static int	num_swap;
+static int	warmup;
+
+/*
+ * CPU states of the samples since the last snapshot, weighted by duration:
+ * those of all the cpus, then those of each one
+ */
+static double *cpu_sum;
+static double *pressure_sum;
+static double cpu_weight;
+
+/* and the figures of the server's cgroup, for the time it was found in */
+static double *cgroup_sum;
+static double cgroup_weight;
+static struct timespec last_sample;
+
+/* the collector's own connection; the display keeps another for commands */
+static struct pg_conninfo_ctx conninfo;
+static struct system_info system_info;
+
+static pthread_t collector;
+static int	collecting;			/* set while the collector thread runs */
+static atomic_int stopping;		/* set to have the collector return */
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot_request request;
+static unsigned int request_generation;
+
+static int	published[2];		/* a byte is written for each snapshot */
+static int	interrupt[2];		/* a byte cuts short the sample under way */
+static int	timer = -1;			/* a timerfd on CLOCK_MONOTONIC, if there is one */
+
+static int
+count_names(char **names)
+{
+	int			i = 0;
+
+	if (names != NULL)
+		while (names[i] != NULL)
+			i++;
+	return i;
+}
+
+static void *
+alloc_stats(int n, size_t size)
+{
+	void	   *p;
+
+	if ((p = calloc(n > 0 ? n : 1, size)) == NULL)
+	{
+		fprintf(stderr, "calloc error\n");
+		exit(1);
+	}
+	return p;
+}
+
+static double
+seconds_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) * 1e-9;
+}
+
+/*
+ * sample_system - gather the system statistics, and add the CPU states to
+ * the ones averaged into the next snapshot
+ */
+static void
+sample_system(const struct snapshot_request *req)
+{
+	struct timespec now;
+	double		weight;
+	int			i;
+
+	if (req->mode_remote == 0)
+		get_system_info(&system_info);
+	else
+		get_system_info_r(&system_info, &conninfo);
+
+	/* the states of the first sample cover no time at all */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	weight = last_sample.tv_sec != 0 ? seconds_between(&last_sample, &now) : 0;
+	last_sample = now;
+	if (system_info.cpustates == NULL || weight <= 0)
+		return;
+	for (i = 0; i < num_cpustates; i++)
+		cpu_sum[i] += system_info.cpustates[i] * weight;
+	if (system_info.percpu_cpustates != NULL)
+		for (i = 0; i < num_percpu; i++)
+			cpu_sum[num_cpustates + i] +=
+				system_info.percpu_cpustates[i] * weight;
+
+	/* the stall shares are averaged the same way, but may be missing */
+	if (system_info.pressure != NULL)
+		for (i = 0; i < num_pressure; i++)
+			if (system_info.pressure[i] > 0)
+				pressure_sum[i] += system_info.pressure[i] * weight;
+	cpu_weight += weight;
+
+	/* as are those of the cgroup, which is only known after a while */
+	if (system_info.cgroup != NULL)
+	{
+		for (i = 0; i < num_cgroup; i++)
+			if (system_info.cgroup[i] > 0)
+				cgroup_sum[i] += system_info.cgroup[i] * weight;
+		cgroup_weight += weight;
+	}
+}
+
+/*
+ * average_states - set out to the average of the n states summed over weight
+ * seconds in sum, or to those of the last sample when no time has been
+ * summed or it is missing one
+ */
+static void
+average_states(int64_t *out, const int64_t *last, const double *sum, int n,
+			   double weight)
+{
+	int			i;
+
+	for (i = 0; i < n; i++)
+		out[i] = weight > 0 && last[i] >= 0 ?
+			(int64_t) (sum[i] / weight + 0.5) : last[i];
+}
+
+/*
+ * take_snapshot - gather the statistics req asks for into s, and format the
+ * rows that will be displayed
+ */
+static void
+take_snapshot(struct snapshot *s, const struct snapshot_request *req)
+{
+	struct process_select ps = req->ps;
+	caddr_t		processes;
+	struct timespec start,
+				end;
+	int			i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sample_system(req);
+	if (req->mode_remote == 0)
+		processes = get_process_info(&system_info, &ps, req->order_index,
+									 &conninfo, req->mode);
+	else
+		processes = get_process_info_r(&system_info, &ps, req->order_index,
+									   &conninfo, req->mode);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	s->tick_latency = seconds_between(&start, &end);
+	s->query_latency = query_latency;
+	time(&s->time);
+	s->header_text = req->header_text;
+
+	/* copy out what the machine module will change in the next sample */
+	s->system_info.last_pid = system_info.last_pid;
+	memcpy(s->system_info.load_avg, system_info.load_avg,
+		   sizeof(system_info.load_avg));
+	s->system_info.p_total = system_info.p_total;
+	s->system_info.P_ACTIVE = system_info.P_ACTIVE;
+	if (system_info.procstates != NULL)
+		memcpy(s->system_info.procstates, system_info.procstates,
+			   num_procstates * sizeof(int));
+	if (system_info.cpustates != NULL)
+		average_states(s->system_info.cpustates, system_info.cpustates,
+					   cpu_sum, num_cpustates, cpu_weight);
+	if (system_info.percpu_cpustates != NULL &&
+		s->system_info.percpu_cpustates != NULL)
+		average_states(s->system_info.percpu_cpustates,
+					   system_info.percpu_cpustates,
+					   &cpu_sum[num_cpustates], num_percpu, cpu_weight);
+	if (system_info.pressure != NULL)
+		average_states(s->system_info.pressure, system_info.pressure,
+					   pressure_sum, num_pressure, cpu_weight);
+	s->system_info.cgroup = NULL;
+	if (system_info.cgroup != NULL)
+	{
+		average_states(s->cgroup, system_info.cgroup, cgroup_sum, num_cgroup,
+					   cgroup_weight);
+		s->system_info.cgroup = s->cgroup;
+	}
+	memset(cpu_sum, 0, (num_cpustates + num_percpu) * sizeof(double));
+	memset(pressure_sum, 0, num_pressure * sizeof(double));
+	memset(cgroup_sum, 0, num_cgroup * sizeof(double));
+	cpu_weight = cgroup_weight = 0;
+	if (system_info.memory != NULL)
+		memcpy(s->system_info.memory, system_info.memory,
+			   num_memory * sizeof(long));
+	if (system_info.swap != NULL)
+		memcpy(s->system_info.swap, system_info.swap,
+			   num_swap * sizeof(long));
+
+	s->nrows = system_info.P_ACTIVE < ps.topn ? system_info.P_ACTIVE :
+		ps.topn;
+	if (s->nrows > s->rows_size)
+	{
+		void	   *rows;
+
+		if ((rows = reallocarray(s->rows, s->nrows, MAX_COLS)) == NULL)
+		{
+			fprintf(stderr, "reallocarray error\n");
+			exit(1);
+		}
+		s->rows = rows;
+		s->rows_size = s->nrows;
+	}
+
+	for (i = 0; i < s->nrows; i++)
+	{
+		switch (req->mode)
+		{
+#if defined(__linux__) || defined(__FreeBSD__)
+			case MODE_IO_STATS:
+				if (req->mode_remote == 0)
+					format_next_io(processes, s->rows[i]);
+				else
+					format_next_io_r(processes, s->rows[i]);
+				break;
+#endif /* defined(__linux__) || defined(__FreeBSD__) */
+			case MODE_REPLICATION:
+				if (req->mode_remote == 0)
+					format_next_replication(processes, s->rows[i]);
+				else
+					format_next_replication_r(processes, s->rows[i]);
+				break;
+			case MODE_PROCESSES:
+			default:
+				if (req->mode_remote == 0)
+					format_next_process(processes, s->rows[i]);
+				else
+					format_next_process_r(processes, s->rows[i]);
+		}
+	}
+}
+
+static void
+publish(void)
+{
+	back = atomic_exchange(&latest, back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+	(void) write(published[1], "", 1);
+}
+
+/*
+ * wait_until - sleep until the monotonic clock reaches deadline, or until
+ * the display asks for something else
+ */
+static void
+wait_until(const struct timespec *deadline)
+{
+	struct pollfd fds[2];
+	struct timespec now;
+	int			nfds = 1;
+	int			timeout = -1;
+	uint64_t	expirations;
+
+	fds[0].fd = interrupt[0];
+	fds[0].events = POLLIN;
+	if (timer != -1)
+	{
+#ifdef __linux__
+		struct itimerspec when;
+
+		memset(&when, 0, sizeof(when));
+		when.it_value = *deadline;
+		timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+#endif
+		fds[1].fd = timer;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+	else
+	{
+		/* rounded up, so as not to wake up just short of it */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (int) (seconds_between(&now, deadline) * 1000.0 + 0.999);
+		if (timeout < 0)
+			timeout = 0;
+	}
+
+	while (poll(fds, nfds, timeout) == -1 && errno == EINTR)
+		;
+	if (timer != -1)
+		(void) read(timer, &expirations, sizeof(expirations));
+}
+
+static void *
+collector_main(void *arg)
+{
+	struct snapshot_request req;
+	unsigned int generation;
+	struct timespec start,
+				next,
+				now;
+	double		sample,
+				elapsed,
+				due;
+	long long	ticks = 0;		/* samples due since start */
+	long long	updates = 0;	/* snapshots due since start */
+	long long	nsec;
+	char		buf[64];
+	int			stale;
+
+	/* some systems require a warmup */
+	if (warmup)
+	{
+		pthread_mutex_lock(&request_lock);
+		req = request;
+		pthread_mutex_unlock(&request_lock);
+		take_snapshot(&snapshots[back], &req);
+		sleep(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;)
+	{
+		pthread_mutex_lock(&request_lock);
+		req = request;
+		generation = request_generation;
+		pthread_mutex_unlock(&request_lock);
+
+		/* whatever cut short the last sample has been dealt with */
+		while (read(interrupt[0], buf, sizeof(buf)) > 0)
+			;
+		if (atomic_load(&stopping))
+			break;
+
+		/*
+		 * Snapshots are due every delay seconds and samples of the system
+		 * every sample seconds, both counted from the start, so that the time
+		 * each one takes does not push back the ones after it.  Whichever is
+		 * due next is taken; the ones that have been missed are skipped.
+		 */
+		sample = req.sample > 0 && req.sample < req.delay ? req.sample : 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = seconds_between(&start, &now) + SNAPSHOT_SLACK;
+		if (updates * req.delay <= elapsed)
+		{
+			take_snapshot(&snapshots[back], &req);
+
+			/* a snapshot of what is no longer asked for is not shown */
+			pthread_mutex_lock(&request_lock);
+			stale = generation != request_generation;
+			pthread_mutex_unlock(&request_lock);
+			if (!stale)
+				publish();
+		}
+		else
+			sample_system(&req);
+
+		if (req.delay > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = seconds_between(&start, &now) + SNAPSHOT_SLACK;
+			if (updates * req.delay <= elapsed)
+				updates = (long long) (elapsed / req.delay) + 1;
+			due = updates * req.delay;
+			if (sample > 0)
+			{
+				if (ticks * sample <= elapsed)
+					ticks = (long long) (elapsed / sample) + 1;
+				if (ticks * sample < due)
+					due = ticks * sample;
+			}
+			nsec = (long long) (due * 1e9 + 0.5) + start.tv_nsec;
+			next.tv_sec = start.tv_sec + nsec / 1000000000;
+			next.tv_nsec = nsec % 1000000000;
+			wait_until(&next);
+		}
+
+		/* something else was asked for: start over with it right away */
+		pthread_mutex_lock(&request_lock);
+		if (generation != request_generation)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ticks = updates = 0;
+		}
+		pthread_mutex_unlock(&request_lock);
+	}
+	return NULL;
+}
+
+/*
+ * snapshot_start - start taking snapshots of what req asks for.  The
+ * connection in ci is handed over to the collector thread, and ci is left
+ * to connect again when a command needs the database.
+ */
+void
+snapshot_start(struct statics *statics, struct pg_conninfo_ctx *ci,
+			   const struct snapshot_request *req)
+{
+	sigset_t	all,
+				old;
+	int			i;
+
+	num_procstates = count_names(statics->procstate_names);
+	num_cpustates = count_names(statics->cpustate_names);
+	num_percpu = statics->ncpus * num_cpustates;
+	num_pressure = count_names(statics->pressure_names) * 2;
+	num_cgroup = count_names(statics->cgroup_cpu_names) +
+		count_names(statics->cgroup_memory_names) +
+		count_names(statics->cgroup_io_names);
+	if (num_cgroup > 0)
+		num_cgroup += num_pressure;
+	num_memory = count_names(statics->memory_names);
+	num_swap = count_names(statics->swap_names);
+	warmup = statics->flags.warmup;
+	for (i = 0; i < 3; i++)
+	{
+		snapshots[i].system_info.procstates =
+			alloc_stats(num_procstates, sizeof(int));
+		snapshots[i].system_info.cpustates =
+			alloc_stats(num_cpustates, sizeof(int64_t));
+		if (num_percpu > 0)
+			snapshots[i].system_info.percpu_cpustates =
+				alloc_stats(num_percpu, sizeof(int64_t));
+		snapshots[i].system_info.pressure =
+			alloc_stats(num_pressure, sizeof(int64_t));
+		snapshots[i].cgroup = alloc_stats(num_cgroup, sizeof(int64_t));
+		snapshots[i].system_info.memory = alloc_stats(num_memory, sizeof(long));
+		snapshots[i].system_info.swap = alloc_stats(num_swap, sizeof(long));
+	}
+	cpu_sum = alloc_stats(num_cpustates + num_percpu, sizeof(double));
+	pressure_sum = alloc_stats(num_pressure, sizeof(double));
+	cgroup_sum = alloc_stats(num_cgroup, sizeof(double));
+
+	conninfo = *ci;
+	ci->connection = NULL;
+	pg_set_sampler(&conninfo);
+	request = *req;
+
+	if (pipe(published) == -1 || pipe(interrupt) == -1)
+	{
+		fprintf(stderr, "pipe error\n");
+		exit(1);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		fcntl(published[i], F_SETFL, O_NONBLOCK);
+		fcntl(interrupt[i], F_SETFL, O_NONBLOCK);
+	}
+	pg_interrupt_fd = interrupt[0];
+
+#ifdef __linux__
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+
+	/* signals are left to the display thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&collector, NULL, collector_main, NULL) != 0)
+	{
+		fprintf(stderr, "pthread_create error\n");
+		exit(1);
+	}
+	collecting = 1;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * snapshot_stop - have the collector thread cut short what it is doing and
+ * wait for it to return, then close its connection and descriptors.  Does
+ * nothing if snapshot_start() was not called.
+ */
+void
+snapshot_stop(void)
+{
+	if (!collecting)
+		return;
+	collecting = 0;
+
+	atomic_store(&stopping, 1);
+	(void) write(interrupt[1], "", 1);
+	pthread_join(collector, NULL);
+
+	if (conninfo.connection != NULL)
+		disconnect_from_db(&conninfo);
+
+	pg_interrupt_fd = -1;
+	close(published[0]);
+	close(published[1]);
+	close(interrupt[0]);
+	close(interrupt[1]);
+	if (timer != -1)
+	{
+		close(timer);
+		timer = -1;
+	}
+}
+
+/*
+ * snapshot_request - ask for snapshots of req from now on.  If that is not
+ * what was asked for before, or refresh is set, the sample under way is cut
+ * short and a new one taken right away.
+ */
+void
+snapshot_request(const struct snapshot_request *req, int refresh)
+{
+	sigset_t	all,
+				old;
+
+	/* a signal handler that longjmps must not leave the lock held */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_mutex_lock(&request_lock);
+	if (refresh || memcmp(&request, req, sizeof(request)) != 0)
+	{
+		request = *req;
+		request_generation++;
+		(void) write(interrupt[1], "", 1);
+	}
+	pthread_mutex_unlock(&request_lock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* snapshot_fd - a descriptor that becomes readable when one is published */
+int
+snapshot_fd(void)
+{
+	return published[0];
+}
+
+/* snapshot_wait - wait until a snapshot has been published */
+void
+snapshot_wait(void)
+{
+	struct pollfd fds;
+	char		buf[64];
+
+	fds.fd = published[0];
+	fds.events = POLLIN;
+	while (poll(&fds, 1, -1) == -1 && errno == EINTR)
+		;
+	while (read(published[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * snapshot_latest - the latest snapshot published, or NULL before the first
+ * one.  It stays the display's until the next call.
+ */
+struct snapshot *
+snapshot_latest(void)
+{
+	if (atomic_load(&latest) & SNAPSHOT_FRESH)
+		front = atomic_exchange(&latest, front < 0 ? 0 : front) &
+			~SNAPSHOT_FRESH;
+	return front < 0 ? NULL : &snapshots[front];
+}
@@ -0,0 +1,55 @@
+/*
+ * call specifications for snapshot.c
+ *
+ *	Copyright (c) 2007-2019, Mark Wong
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "machine.h"
+#include "pg.h"
+
+/*
+ * Everything the display needs to draw one update.  A snapshot is filled in
+ * by the collector thread and not changed again once it has been published,
+ * until the display hands it back by taking a newer one.
+ */
+struct snapshot
+{
+	struct system_info system_info; /* its arrays point into this snapshot */
+	int64_t    *cgroup;			/* where system_info.cgroup points, if it
+								 * has a cgroup */
+	time_t		time;			/* when it was taken */
+	double		tick_latency;	/* seconds spent taking it */
+	double		query_latency;	/* of those, seconds waiting for the server */
+	char	   *header_text;	/* the header the rows are formatted for */
+	int			nrows;
+	int			rows_size;		/* rows allocated */
+	char		(*rows)[MAX_COLS];
+};
+
+/*
+ * What the collector thread is asked to gather, copied from the display's
+ * context so that the two threads never share it.
+ */
+struct snapshot_request
+{
+	struct process_select ps;
+	int			mode;
+	int			mode_remote;
+	int			order_index;
+	double		delay;			/* seconds between snapshots */
+	double		sample;			/* seconds between samples, 0 for delay */
+	char	   *header_text;
+};
+
+void		snapshot_start(struct statics *, struct pg_conninfo_ctx *,
+						   const struct snapshot_request *);
+void		snapshot_stop(void);
+void		snapshot_request(const struct snapshot_request *, int);
+int			snapshot_fd(void);
+void		snapshot_wait(void);
+struct snapshot *snapshot_latest(void);
+
+#endif							/* _SNAPSHOT_H_ */
@@ -64,6 +64,25 @@ atoiwi(char *str)
 	return (0);
 }
 
+/*
+ *	atosecs - convert a string of seconds, such as "2" or "0.5", to a
+ *	double.  Returns -1 if the string is not a number of seconds.
+ */
+
+double
+atosecs(char *str)
+{
+	char	   *end;
+	double		secs;
+
+	secs = strtod(str, &end);
+	if (end == str || *end != '\0' || !(secs >= 0 && secs < 1e6))
+	{
+		return (-1);
+	}
+	return (secs);
+}
+
 /*
  *	itoa - convert integer (decimal) to ascii string for positive numbers
  *		   only (we don't bother with negative numbers since we know we
@@ -493,12 +512,9 @@ format_percent(double v)
 	return result;
 }
 
-/* format_time(seconds) - format number of seconds into a suitable
- *		display that will fit within 6 characters.	Note that this
- *		routine builds its string in a static area.  If it needs
- *		to be called more than once without overwriting previous data,
- *		then we will need to adopt a technique similar to the
- *		one used for format_k.
+/* format_time(seconds, result) - format number of seconds into a suitable
+ *		display that will fit within 6 characters.	The string is built
+ *		in "result", which must hold FORMAT_SIZE characters, and returned.
  */
 
 /* Explanation:
@@ -510,10 +526,8 @@ format_percent(double v)
  */
 
 char *
-format_time(long seconds)
+format_time(long seconds, char *result)
 {
-	static char result[10];
-
 	/* sanity protection */
 	if (seconds < 0 || seconds > (99999l * 360l))
 	{
@@ -540,28 +554,20 @@ format_time(long seconds)
 	return (result);
 }
 
-#define NUM_STRINGS 8
-
 /*
- * format_b(amt) - format a byte memory value, returning a string
- *		suitable for display.  Returns a pointer to a static
- *		area that changes each call.  "amt" is converted to a
+ * format_b(amt, ret) - format a byte memory value, returning a string
+ *		suitable for display.  The string is built in "ret", which
+ *		must hold FORMAT_SIZE characters.  "amt" is converted to a
  *		string with a trailing "B".  If "amt" is 10000 or greater,
  *		then it is formatted as megabytes (rounded) with a
  *		trailing "K".  And so on...
  */
 
 char *
-format_b(long long amt)
+format_b(long long amt, char *ret)
 {
-	static char retarray[NUM_STRINGS][16];
-	static int	index = 0;
-	register char *ret;
 	register char tag = 'B';
 
-	ret = retarray[index];
-	index = (index + 1) % NUM_STRINGS;
-
 	if (amt >= 10000)
 	{
 		amt = (amt + 512) / 1024;
@@ -578,45 +584,32 @@ format_b(long long amt)
 		}
 	}
 
-	snprintf(ret, sizeof(retarray[index]) - 1, "%lld%c", amt, tag);
+	snprintf(ret, FORMAT_SIZE, "%lld%c", amt, tag);
 
 	return (ret);
 }
 
 /*
- * format_k(amt) - format a kilobyte memory value, returning a string
- *		suitable for display.  Returns a pointer to a static
- *		area that changes each call.  "amt" is converted to a
+ * format_k(amt, ret) - format a kilobyte memory value, returning a string
+ *		suitable for display.  The string is built in "ret", which
+ *		must hold FORMAT_SIZE characters.  "amt" is converted to a
  *		string with a trailing "K".  If "amt" is 10000 or greater,
  *		then it is formatted as megabytes (rounded) with a
  *		trailing "M".
  */
 
 /*
- * Compromise time.  We need to return a string, but we don't want the
- * caller to have to worry about freeing a dynamically allocated string.
- * Unfortunately, we can't just return a pointer to a static area as one
- * of the common uses of this function is in a large call to sprintf where
- * it might get invoked several times.	Our compromise is to maintain an
- * array of strings and cycle thru them with each invocation.  We make the
- * array large enough to handle the above mentioned case.  The constant
- * NUM_STRINGS defines the number of strings in this array:  we can tolerate
- * up to NUM_STRINGS calls before we start overwriting old information.
- * Keeping NUM_STRINGS a power of two will allow an intelligent optimizer
- * to convert the modulo operation into something quicker.	What a hack!
+ * These used to cycle through an array of static strings so that several
+ * could be used in one call to sprintf.  The processes are now formatted
+ * by the collector thread while the display formats the memory figures, so
+ * each caller passes the buffer to build its string in instead.
  */
 
 char *
-format_k(long amt)
+format_k(long amt, char *ret)
 {
-	static char retarray[NUM_STRINGS][16];
-	static int	index = 0;
-	register char *ret;
 	register char tag = 'K';
 
-	ret = retarray[index];
-	index = (index + 1) % NUM_STRINGS;
-
 	if (amt >= 10000)
 	{
 		amt = (amt + 512) / 1024;
@@ -628,7 +621,25 @@ format_k(long amt)
 		}
 	}
 
-	snprintf(ret, sizeof(retarray[index]) - 1, "%ld%c", amt, tag);
+	snprintf(ret, FORMAT_SIZE, "%ld%c", amt, tag);
+
+	return (ret);
+}
+
+/*
+ * format_lsn(lsn, ret) - format a WAL location the way the server prints it.
+ *		The invalid location 0 comes out empty.  The string is built in
+ *		"ret", as format_k does.
+ */
+
+char *
+format_lsn(uint64_t lsn, char *ret)
+{
+	if (lsn == 0)
+		ret[0] = '\0';
+	else
+		snprintf(ret, FORMAT_SIZE, "%X/%X",
+				 (unsigned int) (lsn >> 32), (unsigned int) lsn);
 
 	return (ret);
 }
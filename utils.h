@@ -12,9 +12,13 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+/* size of the buffers format_time, format_b, format_k and format_lsn fill */
+#define FORMAT_SIZE	24
+
 /* prototypes for functions found in utils.c */
 
 int			atoiwi(char *);
+double		atosecs(char *);
 char	   *itoa(int);
 char	   *itoa7(uid_t);
 int			digits(int);
@@ -26,9 +30,10 @@ char	  **argparse(char *, int *);
 long		percentages(int, int64_t *, int64_t *, int64_t *, int64_t *);
 char	   *errmsg(int);
 char	   *format_percent(double);
-char	   *format_time(long);
-char	   *format_b(long long);
-char	   *format_k(long);
+char	   *format_time(long, char *);
+char	   *format_b(long long, char *);
+char	   *format_k(long, char *);
+char	   *format_lsn(uint64_t, char *);
 char	   *string_list(char **);
 void		debug_set(int);
 